@@ -1,85 +1,357 @@
 // Virtual cable program to test serial port.
-// Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Creates pairs of virtual Tx / Rx serial ports (pseudo-terminals), one pair
+// per link; a single process and event loop hosts all the links.
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 // Modified by: Rui Prior [rcprior@fc.up.pt]
 
+#define _GNU_SOURCE            // posix_openpt() and friends
+
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
-#define TXDEV "/dev/ttyS10"
-#define RXDEV "/dev/ttyS11"
-// Baudrate settings are defined in <asm/termbits.h>, which is
-// included by <termios.h>
-#define BAUDRATE B9600         // For struct termios
+#define DEVICE_FORMAT "%s/ttyS%d"   // Link n uses 10 + 2n (Tx) and 11 + 2n (Rx)
+#define DEFAULT_DEVICE_DIR "/dev"
+#define FIRST_DEVICE 10
 #define DEFAULT_BAUDRATE 9600  // For the delaying transmissions
 #define _POSIX_SOURCE 1        // POSIX compliant source
 #define FALSE 0
 #define TRUE 1
 
-#define BUF_SIZE 2048
+#define BUF_SIZE 65536
+
+#define MAX_LINKS 64
+#define MAX_PATH_SIZE 128
+
+#define MIN_BAUDRATE 1200
+#define MAX_BAUDRATE 10000000
+#define MAX_PROP_DELAY 60000000  // usec
+
+#define PSEC_PER_USEC 1000000LL
+#define PSEC_PER_SEC 1000000000000LL
+#define READ_AHEAD_PSEC 2000000000LL  // Line time accepted ahead of the line (2 ms)
+#define SLICE_PSEC 100000000LL  // Minimum sleep while bytes are in flight (100 us)
+#define DEFAULT_SEED 1
+#define MAX_COMMAND_SIZE 256
+#define MAX_FLAG_COMMANDS 16
+#define NEVER (LLONG_MAX / 4)   // Skip distance for events with probability 0
+#define RING_MIN_CAPACITY 4096
+
+// Byte impairments
+#define IMP_NONE 0
+#define IMP_DROP 1
+#define IMP_INSERT 2
+#define IMP_DUPLICATE 3
+
+// Delay variation distributions
+#define JITTER_NONE 0
+#define JITTER_UNIFORM 1
+#define JITTER_EXPONENTIAL 2
+#define JITTER_NORMAL 3
+
+#define MAX_SKEW_PPM 100000
+#define MAX_COALESCE_TIME 1000000  // usec
+
+#define CAPTURE_RING_SIZE (16 * 1024 * 1024)
+#define CAPTURE_MAX_FRAME 65536
+#define CAPTURE_LINKTYPE 147  // LINKTYPE_USER0: frames as sent on the line, FLAG to FLAG
+#define FLAG 0x7E
+#define ESC 0x7D
+
+// Frames told apart by the fault rules (control fields as in frame.h).
+// I-frames carry the RR control field too, but also a payload.
+#define FRAME_SET 0
+#define FRAME_UA 1
+#define FRAME_DISC 2
+#define FRAME_RR 3
+#define FRAME_REJ 4
+#define FRAME_I 5
+#define FRAME_OTHER 6          // Not a frame of the protocol
+#define FRAME_ANY 7            // Rules only: every frame
+#define NUM_FRAME_KINDS 8
+
+// Fault rule actions and the fields they corrupt
+#define FAULT_DROP 0
+#define FAULT_DUPLICATE 1
+#define FAULT_DELAY 2
+#define FAULT_CORRUPT 3
+#define FIELD_ADDRESS 0
+#define FIELD_CONTROL 1
+#define FIELD_BCC1 2
+#define FIELD_DATA 3
+#define FIELD_BCC2 4
+#define NUM_FIELDS 5
+
+// Flow control of a direction by its receiver
+#define FLOW_NONE 0
+#define FLOW_RTSCTS 1
+#define MAX_RX_BUFFER 4095     // What a pty holds for the program reading it
+#define FLOW_POLL_PSEC 1000000000LL  // Receiver buffer check while it holds off (1 ms)
+
+#define MAX_FAULTS 16          // Rules per direction
+#define MAX_STAGED_FRAME 16384 // Longer runs between FLAGs are not frames
+#define FRAME_TIMEOUT_PSEC 10000000000LL  // Wait for the end of a frame (10 ms)
+
+#define RATE_BURST_PSEC 1000000000LL  // Shortest burst used to measure the rate (1 ms)
+
+// Error model of a direction. Bit errors follow a Gilbert-Elliott channel;
+// without transitions out of the good state it is the independent bit error
+// model. Errors and impairments are drawn as skip distances, so error-free
+// bytes cost no random numbers.
+struct ErrorModel {
+    double ber[2];         // Bit error rate in the good and bad states
+    double leave[2];       // Probability per bit of leaving the good / bad state
+    double drop;           // Probabilities per byte of the byte impairments
+    double insert;
+    double duplicate;
+};
+
+// Timing impairments of a direction: delay variation, rate skew of the
+// sender's clock and delivery in bursts, as by a USB adapter that holds the
+// bytes until its latency timer expires or its packet fills up.
+struct TimingModel {
+    int jitter;            // One of JITTER_NONE, JITTER_UNIFORM, JITTER_EXPONENTIAL or JITTER_NORMAL
+    double jitterMean;     // usec; for uniform jitter, half the maximum
+    double jitterDeviation;   // Standard deviation of normal jitter (usec)
+    double skew;           // ppm; positive values make the sender slower
+    long long coalesceTime;   // psec, 0 to deliver bytes as soon as they arrive
+    size_t coalesceBytes;  // Bytes that end the wait early, 0 for none
+};
+
+// Deterministic fault on frames of one kind: the n-th one after the rule
+// was set, or every n-th one
+struct FaultRule {
+    int frame;             // FRAME_* kind targeted
+    int every;             // TRUE to hit every n-th frame
+    unsigned long n;
+    int action;            // One of FAULT_DROP, FAULT_DUPLICATE, FAULT_DELAY or FAULT_CORRUPT
+    int field;             // FIELD_* corrupted
+    long long delay;       // Added to the frame's delivery (psec)
+    unsigned long long seen;   // Frames of the kind since the rule was set
+    unsigned long long hits;
+};
+
+// Bytes sent back to back on the line, due one byte time apart. The delay
+// line keeps one entry per burst rather than a timestamp per byte, so long
+// delays at high baud rates cost little more than the bytes themselves.
+struct Burst {
+    long long due;         // Time the last bit of the first byte reaches the other end
+    long long byteTime;    // Of the baud rate the burst was sent at
+    size_t length;
+};
+
+// One direction of the cable. Bytes read from inFd wait in a queue, in
+// bursts tagged with the time they reach the other end. All times are in
+// picoseconds since the cable started.
+struct Direction {
+    char name[32];
+    struct Link *link;
+    int interface;         // 2 * link index, plus 1 for Rx->Tx (capture, random stream)
+    int inFd;
+    int outFd;
+    int outSlave;          // The receiving program's end, to see what it has not read
+
+    // Line parameters, set for each direction independently
+    unsigned long baud;
+    long long byteTime;        // Time to send one byte (psec)
+    unsigned long propDelay;   // Propagation delay in usec
+    struct ErrorModel model;
+    struct TimingModel timing;
+
+    // Bytes in flight and the bursts they form. Both rings grow on demand.
+    unsigned char *data;
+    size_t capacity;       // Power of two
+    size_t head;           // Index of the oldest byte
+    size_t count;          // Bytes in flight
+    struct Burst *bursts;
+    size_t burstCapacity;  // Power of two
+    size_t burstHead;
+    size_t burstCount;
+    long long lineFree;    // When the line finishes sending the last byte
+    int watching;          // TRUE while epoll watches inFd for input
+    int lineIdle;          // TRUE until the next byte after a gap (for logging)
+
+    // Error model state. Each direction has its own random stream so that
+    // the errors only depend on the seed and on the bytes sent.
+    uint64_t rng[4];
+    uint64_t timingRng[4]; // Separate, so that jitter does not change the errors
+    int badState;          // TRUE while the channel is in the bad state
+    long long stateBits;   // Bits left before the channel changes state
+    long long errorBits;   // Error-free bits left before the next bit error
+    long long cleanBytes;  // Bytes left before the next byte impairment
+
+    // Statistics since the last baud rate or propagation delay change
+    unsigned long long released;
+    long long burstDue;        // Due time of the first byte of the current burst
+    long long burstRelease;    // Actual release time of that byte
+    long long lastDue;
+    long long lastRelease;
+    long long targetTime;      // Expected duration of the long bursts seen so far
+    long long actualTime;      // Their actual duration
+    unsigned long long lateCount;
+    double lateSum;            // Time between the due and the actual release
+    double lateSquares;
+    long long lateMax;
+    unsigned long long overruns;   // Bytes lost because the receiver's buffer was full
+    unsigned long long stops;      // Times the sender was held off
+
+    // Receiving UART: its buffer, and the flow control that holds the
+    // sender off before the buffer overflows
+    size_t rxBuffer;           // Bytes it holds, 0 for as many as the pty takes (no overruns)
+    int flow;                  // FLOW_NONE or FLOW_RTSCTS
+    int holdOff;               // TRUE while the receiver asks the sender to stop
+    int stopped;               // TRUE while the sender is stopped
+    long long flowChange;      // When the sender sees the last request, -1 once it has
+
+    // Fault rules. While there are any, frames are held from their opening
+    // to their closing FLAG, so that the rules see them whole.
+    struct FaultRule faults[MAX_FAULTS];
+    int numFaults;
+    unsigned char *frame;      // MAX_STAGED_FRAME bytes, allocated with the first rule
+    size_t frameLength;        // 0 outside a frame
+    long long frameRead;       // When its last bytes were read
+    long long extraDelay;      // Added to the due time of the bytes sent (psec)
+};
+
+// A virtual cable between a transmitter and a receiver port. Each link has
+// its own devices, parameters, error models and statistics.
+struct Link {
+    char prefix[16];       // "link<n> " in messages, empty with a single link
+    char txDevice[MAX_PATH_SIZE];  // Opened by the transmitter
+    char rxDevice[MAX_PATH_SIZE];  // Opened by the receiver
+    int txSlave;           // The cable keeps the programs' ends open too
+    int rxSlave;
+    int cableOn;
+    struct Direction tx2rx;
+    struct Direction rx2tx;
+};
+
+// Scenario action: a command run at a given time (psec) after the first
+// byte enters the cable
+struct Action {
+    long long time;
+    char command[MAX_COMMAND_SIZE];
+};
+
+// Header of a burst in the capture ring, followed by its bytes. The bytes
+// were sent back to back, one byte time apart.
+struct CaptureRecord {
+    long long time;        // Delivery time of the first byte (psec)
+    long long byteTime;
+    unsigned int length;
+    unsigned int direction;  // Capture interface of the direction
+};
+
+// Frame being assembled by the capture writer for one direction
+struct CaptureFrame {
+    unsigned char data[CAPTURE_MAX_FRAME];
+    unsigned int length;
+    long long time;        // Delivery time of the first byte (psec)
+};
+
+// Capture of the bytes delivered by the cable. The real-time loop only
+// copies bursts into a preallocated ring; a background thread splits them
+// into frames and writes them as pcap-ng packets.
+struct Capture {
+    FILE *file;
+    unsigned char *ring;   // CAPTURE_RING_SIZE bytes
+    atomic_ullong head;    // Next byte to be consumed by the writer
+    atomic_ullong tail;    // Next byte to be produced by the cable
+    atomic_int closed;
+    sem_t records;         // Records ready for the writer
+    pthread_t writer;
+    unsigned long long dropped;   // Bytes lost because the ring was full
+    unsigned long long packets;   // Written by the writer thread
+    long long wallClock;   // Wall clock time (nsec) at the cable clock origin
+    struct CaptureFrame *frames;  // One per direction of every link
+};
 
 // Current running parameters
 struct Parameters {
-    int cableOn;
-    double byteER;   // Byte error rate
-    struct timespec byteDelay;
-    unsigned long propDelay;   // Desired propagation delay in usec
-    int bufSize;  // Dimensioned to enforce the propagation delay
-    char *tx2rx;
-    char *tx2rxValid;  // TRUE if corresponding entry holds a byte
-    long tx2rxIdx;     // Input index for the tx2rx buffer
-    char *rx2tx;
-    char *rx2txValid;  // TRUE if corresponding entry holds a byte
-    long rx2txIdx;     // Input index for the tx2rx buffer
+    unsigned long long seed;   // Of the error models of every direction
+    struct timespec start;     // Origin of the cable clock
+    struct Link links[MAX_LINKS];
+    int numLinks;
+    struct Action *actions;    // Scenario, sorted by time
+    int numActions;
+    int nextAction;
+    long long origin;          // When the first byte entered the cable, -1 before
     FILE *logfile;
+    struct Capture *capture;   // NULL when not capturing
+    int epollFd;               // Input of every direction, stdin and timerFd
+    int timerFd;               // Next deadline, absolute
 };
 
 struct Parameters par = {
-    .cableOn = TRUE,
-    .byteER = 0.0,
-    .propDelay = 0,
-    .tx2rx = NULL,
-    .tx2rxValid = NULL,
-    .rx2tx = NULL,
-    .rx2txValid = NULL,
+    .seed = DEFAULT_SEED,
+    .actions = NULL,
+    .origin = -1,
     .logfile = NULL};
 
-// Returns: serial port file descriptor (fd).
-int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
+// Names of the frame kinds and of the fields of a frame, as shown and as
+// given in fault rules (in any case)
+const char *frameNames[NUM_FRAME_KINDS] = { "SET", "UA", "DISC", "RR", "REJ", "I", "OTHER", "ANY" };
+const char *fieldNames[NUM_FIELDS] = { "address", "control", "bcc1", "data", "bcc2" };
+
+// Create a pseudo-terminal and link it at device for a program to open as
+// a serial port. The cable reads and writes the master end; it also keeps
+// the slave end open, in raw mode, so that the master never hangs up while
+// no program has the port open.
+// Returns the master file descriptor (slave in *slave), or -1 on error.
+int open_pty(const char *device, int *slave)
 {
-    int fd = open(serialPort, O_RDWR | O_NONBLOCK | O_NOCTTY);
-
-    if (fd < 0)
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (master < 0)
+    {
         return -1;
-
-    // Save current port settings
-    if (tcgetattr(fd, oldtio) == -1)
+    }
+    const char *name = NULL;
+    if (grantpt(master) == 0 && unlockpt(master) == 0)
+    {
+        name = ptsname(master);
+    }
+    *slave = name != NULL ? open(name, O_RDWR | O_NOCTTY | O_NONBLOCK) : -1;
+    if (*slave < 0)
+    {
+        close(master);
         return -1;
+    }
 
-    memset(newtio, 0, sizeof(*newtio));
-    newtio->c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
-    newtio->c_iflag = IGNPAR;
-    newtio->c_oflag = 0;
-    newtio->c_lflag = 0;
-    newtio->c_cc[VTIME] = 0; // Inter-character timer unused (polling mode)
-    newtio->c_cc[VMIN] = 0;  // Read without blocking
-    tcflush(fd, TCIOFLUSH);
+    struct termios tio;
+    tcgetattr(*slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(*slave, TCSANOW, &tio);
+    chmod(name, 0666);
 
-    if (tcsetattr(fd, TCSANOW, newtio) == -1)
+    // Replace what an earlier run left at the device path
+    unlink(device);
+    if (symlink(name, device) != 0)
+    {
+        close(*slave);
+        close(master);
         return -1;
-
-    return fd;
+    }
+    return master;
 }
 
 
@@ -90,469 +362,2515 @@ void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
 }
 
 
-// Initialize the ring buffers that implement the propagation delay
-// Returns 0 on success, -1 on failure
-int init_ring_buffers(void)
+// Compute the sum of two timespecs
+struct timespec timespec_sum(const struct timespec *t1, const struct timespec *t2)
+{
+    struct timespec sum = { .tv_sec = t1->tv_sec + t2->tv_sec,
+                             .tv_nsec = t1->tv_nsec + t2->tv_nsec };
+    if (sum.tv_nsec >= 1000000000) {
+        sum.tv_nsec -= 1000000000;
+        ++sum.tv_sec;
+    }
+    return sum;
+}
+
+
+// Picoseconds elapsed since the cable started
+long long now_ps(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) (now.tv_sec - par.start.tv_sec) * PSEC_PER_SEC
+           + (long long) (now.tv_nsec - par.start.tv_nsec) * 1000;
+}
+
+
+// Arm the timer for the given time (picoseconds since the cable started),
+// or disarm it if when is negative
+void set_timer(long long when)
 {
-    long nsecPropDelay = 1000 * par.propDelay;
-    long bytesInFlight = nsecPropDelay / par.byteDelay.tv_nsec;
-    // Round instead of truncating
-    if (nsecPropDelay % par.byteDelay.tv_nsec > par.byteDelay.tv_nsec / 2)
+    struct itimerspec timer = { 0 };
+    if (when >= 0)
     {
-        ++bytesInFlight;
+        long long nsec = when / 1000;
+        struct timespec offset = { .tv_sec = nsec / 1000000000, .tv_nsec = nsec % 1000000000 };
+        timer.it_value = timespec_sum(&par.start, &offset);
     }
-    long actualPropDelay = bytesInFlight * par.byteDelay.tv_nsec / 1000; // usec
-    par.bufSize = bytesInFlight + 1;
-    par.tx2rx = realloc(par.tx2rx, par.bufSize);
-    par.tx2rxValid = realloc(par.tx2rxValid, par.bufSize);
-    par.rx2tx = realloc(par.rx2tx, par.bufSize);
-    par.rx2txValid = realloc(par.rx2txValid, par.bufSize);
-    if (par.tx2rx == NULL || par.tx2rxValid == NULL || par.rx2tx == NULL || par.rx2txValid == NULL)
+    timerfd_settime(par.timerFd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+
+// Square root by Newton's method, to avoid linking with libm
+double square_root(double x)
+{
+    if (x <= 0.0)
     {
-        return -1;
+        return 0.0;
     }
-    bzero(par.tx2rxValid, par.bufSize);
-    bzero(par.rx2txValid, par.bufSize);
-    par.tx2rxIdx = 0;
-    par.rx2txIdx = 0;
-    printf("PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n", actualPropDelay, par.propDelay);
-    return 0;
+    double r = x > 1.0 ? x : 1.0;
+    for (int i = 0; i < 64; i++)
+    {
+        double next = (r + x / r) / 2;
+        if (next >= r)
+        {
+            break;
+        }
+        r = next;
+    }
+    return r;
+}
+
+
+// Natural logarithm, to avoid linking with libm. x must be positive.
+double natural_log(double x)
+{
+    // Split x into m * 2^e with m in [sqrt(1/2), sqrt(2))
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int e = (int) ((bits >> 52) & 0x7FF) - 1023;
+    bits = (bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+    if (m > 1.4142135623730951)
+    {
+        m /= 2;
+        e++;
+    }
+
+    // ln(m) = 2 * (z + z^3 / 3 + z^5 / 5 + ...) with z = (m - 1) / (m + 1)
+    double z = (m - 1) / (m + 1);
+    double z2 = z * z;
+    double term = z;
+    double sum = 0.0;
+    for (int k = 1; k < 40; k += 2)
+    {
+        sum += term / k;
+        term *= z2;
+    }
+    return 2 * sum + e * 0.6931471805599453;
 }
 
 
-// Set the byte delay corresponding to the selected baud rate
-void set_baud_rate(unsigned long baud)
+// Next number of the xoshiro256** generator
+uint64_t next_random(uint64_t *s)
 {
-    // 10 bit times per byte; delay in nanoseconds
-    double delay = 1.0e10 / baud;
-    par.byteDelay.tv_sec = 0;
-    par.byteDelay.tv_nsec = (long) delay;
-    printf("BAUD RATE: %lu\n", baud);
-    init_ring_buffers();
+    uint64_t x = s[1] * 5;
+    uint64_t result = ((x << 7) | (x >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
 }
 
 
-// Make the program use RT priority to improve precision in timing
-void set_rt_priority(void) {
-    struct sched_param sp = { .sched_priority = 50 };
-    if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1) {
-      perror("Could not set realtime priority");
+// Seed a xoshiro256** state from a single number with splitmix64
+void seed_random(uint64_t *s, uint64_t seed)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        s[i] = z ^ (z >> 31);
     }
 }
 
 
-// Compute the difference between two timespecs
-struct timespec timespec_diff(const struct timespec *t2, const struct timespec *t1)
+// Uniform number in (0, 1]
+double uniform(uint64_t *s)
+{
+    return ((next_random(s) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+
+// Number of failures before the first success of independent trials that
+// succeed with probability p
+long long geometric(uint64_t *s, double p)
 {
-    struct timespec diff = { .tv_sec = t2->tv_sec - t1->tv_sec,
-                             .tv_nsec = t2->tv_nsec - t1->tv_nsec };
-    if (diff.tv_nsec < 0) {
-        diff.tv_nsec += 1000000000;
-        --diff.tv_sec;
+    if (p <= 0.0)
+    {
+        return NEVER;
+    }
+    if (p >= 1.0)
+    {
+        return 0;
     }
-    return diff;
+    double skip = natural_log(uniform(s)) / natural_log(1.0 - p);
+    return skip < NEVER ? (long long) skip : NEVER;
 }
 
 
-// Compute the sum of two timespecs
-struct timespec timespec_sum(const struct timespec *t1, const struct timespec *t2)
+// Restart the error model of a direction from the seed
+void reset_model(struct Direction *dir)
 {
-    struct timespec sum = { .tv_sec = t1->tv_sec + t2->tv_sec,
-                             .tv_nsec = t1->tv_nsec + t2->tv_nsec };
-    if (sum.tv_nsec >= 1000000000) {
-        sum.tv_nsec -= 1000000000;
-        ++sum.tv_sec;
+    struct ErrorModel *m = &dir->model;
+    seed_random(dir->rng, par.seed + dir->interface);
+    dir->badState = FALSE;
+    dir->stateBits = 1 + geometric(dir->rng, m->leave[FALSE]);
+    dir->errorBits = geometric(dir->rng, m->ber[FALSE]);
+    dir->cleanBytes = geometric(dir->rng, m->drop + m->insert + m->duplicate);
+}
+
+
+// Restart every direction after the seed changed
+void reset_models(void)
+{
+    for (int i = 0; i < 2 * par.numLinks; i++)
+    {
+        struct Direction *dir = i % 2 == 0 ? &par.links[i / 2].tx2rx : &par.links[i / 2].rx2tx;
+        reset_model(dir);
+        seed_random(dir->timingRng, ~(par.seed + dir->interface));
     }
-    return sum;
 }
 
 
-// Compare two timespecs returning -1, 0 or 1 if t1 is less than, equal or
-// greater than t2, respectively
-int timespec_comp(const struct timespec *t1, const struct timespec *t2)
+// Extra delay of a byte (psec), drawn from the delay variation distribution
+long long delay_variation(struct Direction *dir)
 {
-    if (t1->tv_sec < t2->tv_sec) {
-        return -1;
+    struct TimingModel *t = &dir->timing;
+    double usec = 0.0;
+    if (t->jitter == JITTER_UNIFORM)
+    {
+        usec = 2 * t->jitterMean * (1.0 - uniform(dir->timingRng));
     }
-    else if (t1->tv_sec > t2->tv_sec) {
-        return 1;
+    else if (t->jitter == JITTER_EXPONENTIAL)
+    {
+        usec = -t->jitterMean * natural_log(uniform(dir->timingRng));
     }
-    else if (t1->tv_nsec < t2->tv_nsec) {
-        return -1;
+    else if (t->jitter == JITTER_NORMAL)
+    {
+        // Sum of 12 uniforms: mean 6, variance 1, close enough to normal
+        double sum = 0.0;
+        for (int i = 0; i < 12; i++)
+        {
+            sum += uniform(dir->timingRng);
+        }
+        usec = t->jitterMean + t->jitterDeviation * (sum - 6.0);
     }
-    else if (t1->tv_nsec > t2->tv_nsec) {
-        return 1;
+    return usec > 0.0 ? (long long) (usec * PSEC_PER_USEC) : 0;
+}
+
+
+// Flip the bits of a byte hit by errors. The 8 data bits are consumed from
+// the skip distances in runs, so a byte without errors needs no random numbers.
+unsigned char add_bit_errors(struct Direction *dir, unsigned char byte)
+{
+    struct ErrorModel *m = &dir->model;
+    int bit = 0;
+
+    while (bit < 8)
+    {
+        if (dir->stateBits == 0)
+        {
+            dir->badState = !dir->badState;
+            dir->stateBits = 1 + geometric(dir->rng, m->leave[dir->badState]);
+            dir->errorBits = geometric(dir->rng, m->ber[dir->badState]);
+        }
+
+        long long run = 8 - bit;
+        if (dir->stateBits < run)
+        {
+            run = dir->stateBits;
+        }
+        if (dir->errorBits < run)
+        {
+            bit += dir->errorBits;
+            dir->stateBits -= dir->errorBits + 1;
+            byte ^= 1 << bit;
+            bit++;
+            dir->errorBits = geometric(dir->rng, m->ber[dir->badState]);
+        }
+        else
+        {
+            bit += run;
+            dir->stateBits -= run;
+            dir->errorBits -= run;
+        }
     }
-    return 0;
+
+    return byte;
 }
 
 
-int timespec_is_negative(const struct timespec *t)
+// Decide whether the next byte is dropped, followed by an inserted byte or
+// duplicated.
+// Returns one of IMP_NONE, IMP_DROP, IMP_INSERT or IMP_DUPLICATE.
+int next_impairment(struct Direction *dir)
 {
-    if (t->tv_sec < 0 || t->tv_nsec < 0)
+    struct ErrorModel *m = &dir->model;
+    if (dir->cleanBytes > 0)
     {
-        return TRUE;
+        dir->cleanBytes--;
+        return IMP_NONE;
     }
-    return FALSE;
+
+    double total = m->drop + m->insert + m->duplicate;
+    double u = uniform(dir->rng) * total;
+    dir->cleanBytes = geometric(dir->rng, total);
+    if (u <= m->drop)
+    {
+        return IMP_DROP;
+    }
+    if (u <= m->drop + m->insert)
+    {
+        return IMP_INSERT;
+    }
+    return IMP_DUPLICATE;
 }
 
 
-void endlog(void)
+// Show the error model of a direction
+void print_model(const struct Direction *dir)
 {
-    if (par.logfile != NULL)
+    const struct ErrorModel *m = &dir->model;
+    if (m->leave[FALSE] > 0.0)
     {
-        fclose(par.logfile);
-        par.logfile = NULL;
+        printf("%s GILBERT-ELLIOTT: good->bad %g, bad->good %g, BER good %g, BER bad %g\n",
+               dir->name, m->leave[FALSE], m->leave[TRUE], m->ber[FALSE], m->ber[TRUE]);
+    }
+    else
+    {
+        printf("%s BER: %g\n", dir->name, m->ber[FALSE]);
     }
+    printf("%s DROP: %g, INSERT: %g, DUPLICATE: %g (per byte)\n",
+           dir->name, m->drop, m->insert, m->duplicate);
 }
 
 
-void startlog(const char *filename)
+// Show the timing impairments of a direction
+void print_timing(const struct Direction *dir)
 {
-    endlog();
-    par.logfile = fopen(filename, "w");
-    if (par.logfile != NULL)
+    const struct TimingModel *t = &dir->timing;
+    printf("%s JITTER: ", dir->name);
+    if (t->jitter == JITTER_UNIFORM)
     {
-        fprintf(par.logfile, "Tx->Rx | Rx->Tx\n");
-        printf("LOGGING TO FILE %s\n", filename);
+        printf("uniform up to %g usec", 2 * t->jitterMean);
+    }
+    else if (t->jitter == JITTER_EXPONENTIAL)
+    {
+        printf("exponential, mean %g usec", t->jitterMean);
+    }
+    else if (t->jitter == JITTER_NORMAL)
+    {
+        printf("normal, mean %g usec, deviation %g usec", t->jitterMean, t->jitterDeviation);
     }
     else
     {
-        printf("ERROR OPENING FILE %s, NOT LOGGING\n", filename);
+        printf("none");
+    }
+    printf(", SKEW: %g ppm, COALESCE: ", t->skew);
+    if (t->coalesceTime > 0)
+    {
+        printf("%lld usec", t->coalesceTime / PSEC_PER_USEC);
+        if (t->coalesceBytes > 0)
+        {
+            printf(" or %zu bytes", t->coalesceBytes);
+        }
+        printf("\n");
+    }
+    else
+    {
+        printf("none\n");
     }
 }
 
 
-// Show help
-void help()
+// Show the receiver's buffer and flow control of a direction
+void print_flow(const struct Direction *dir)
 {
-    printf("\n\n"
-           "Transmitter must open " TXDEV "\n"
-           "Receiver must open " RXDEV "\n"
-           "\n"
-           "The cable program is sensible to the following interactive commands:\n"
-           "--- help         : show this help\n"
-           "--- on           : connect the cable and data is exchanged (default state)\n"
-           "--- off          : disconnect the cable disabling data to be exchanged\n"
-           "--- ber <ber>    : add noise to data bits at a specified BER (default=0)\n"
-           "--- baud <rate>  : set baud rate, between 1200 and 115200 (default=9600)\n"
-           "                   note that 10 bits are sent per byte (8-N-1)\n"
-           "--- prop <delay> : set the propagation delay in usec (0-1000000, default=0)\n"
-           "                   will be approximated to an integer multiple of the byte\n"
-           "                   delay (10 / baud_rate)\n"
-           "--- log <file>   : log transmitted data to file\n"
-           "--- endlog       : stop logging transmitted data\n"
-           "--- quit         : terminate the program\n"
-           "\n"
-           "IMPORTANT: Changing the baud rate or propagation delay while a transmission is\n"
-           "           ongoing will result in losses.\n"
-           "\n");
+    static const char *flowNames[] = { "none", "RTS/CTS" };
+    printf("%s RX BUFFER: ", dir->name);
+    if (dir->rxBuffer > 0)
+    {
+        printf("%zu bytes", dir->rxBuffer);
+    }
+    else
+    {
+        printf("unlimited");
+    }
+    printf(", FLOW CONTROL: %s\n", flowNames[dir->flow]);
 }
 
-int main(int argc, char *argv[])
+
+// Forget the rate and jitter measured so far
+void reset_stats(struct Direction *dir)
 {
-    printf("\n");
+    dir->released = 0;
+    dir->lastDue = -1;
+    dir->targetTime = 0;
+    dir->actualTime = 0;
+    dir->lateCount = 0;
+    dir->lateSum = 0.0;
+    dir->lateSquares = 0.0;
+    dir->lateMax = 0;
+    dir->overruns = 0;
+    dir->stops = 0;
+}
 
-    system("socat -dd PTY,link=" TXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorTx,mode=777,raw,echo=0 &");
-    sleep(1);
-    printf("\n");
 
-    system("socat -dd PTY,link=" RXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorRx,mode=777,raw,echo=0 &");
-    sleep(1);
+// Account for the burst that just ended. Only bursts long enough for the
+// release slices to average out are used to measure the rate.
+void end_burst(struct Direction *dir)
+{
+    if (dir->lastDue >= 0 && dir->lastDue - dir->burstDue >= RATE_BURST_PSEC)
+    {
+        dir->targetTime += dir->lastDue - dir->burstDue;
+        dir->actualTime += dir->lastRelease - dir->burstRelease;
+    }
+}
 
-    help();
 
-    // Configure serial ports
-    struct termios oldtioTx;
-    struct termios newtioTx;
+// Make room in a ring for at least needed elements, doubling its capacity
+// and moving the elements to its start
+// Returns 0 on success, -1 on failure
+int grow_ring(void **ring, size_t elementSize, size_t *capacity, size_t *head, size_t count, size_t needed)
+{
+    if (needed <= *capacity)
+    {
+        return 0;
+    }
+    size_t grown = *capacity > 0 ? *capacity : RING_MIN_CAPACITY;
+    while (grown < needed)
+    {
+        grown *= 2;
+    }
+    unsigned char *bigger = malloc(grown * elementSize);
+    if (bigger == NULL)
+    {
+        return -1;
+    }
+    if (count > 0)
+    {
+        size_t first = *capacity - *head < count ? *capacity - *head : count;
+        memcpy(bigger, (unsigned char *) *ring + *head * elementSize, first * elementSize);
+        memcpy(bigger + first * elementSize, *ring, (count - first) * elementSize);
+    }
+    free(*ring);
+    *ring = bigger;
+    *capacity = grown;
+    *head = 0;
+    return 0;
+}
 
-    int fdTx = openSerialPort("/dev/emulatorTx", &oldtioTx, &newtioTx);
 
-    if (fdTx < 0)
+// Time to send one byte at the baud rate of a direction, as seen through
+// the skewed clock of its sender
+void update_byte_time(struct Direction *dir)
+{
+    // 10 bit times per byte; delay in picoseconds
+    dir->byteTime = 10 * PSEC_PER_SEC / (long long) dir->baud;
+    if (dir->timing.skew != 0.0)
     {
-        perror("Opening Tx emulator serial port");
-        exit(-1);
+        dir->byteTime += (long long) (dir->byteTime * dir->timing.skew / 1000000.0);
     }
+}
+
+
+// Set the byte delay of a direction corresponding to the selected baud rate.
+// Bytes already on the line keep the timing they were sent with.
+void set_baud_rate(struct Direction *dir, unsigned long baud)
+{
+    // 10 bit times per byte; delay in picoseconds
+    dir->baud = baud;
+    update_byte_time(dir);
+    reset_stats(dir);
+    printf("%s BAUD RATE: %lu\n", dir->name, baud);
+}
+
+
+// Set the propagation delay (usec) of a direction. Bytes already on the line
+// keep their delay, and later bytes never overtake them.
+void set_prop_delay(struct Direction *dir, unsigned long propDelay)
+{
+    dir->propDelay = propDelay;
+    reset_stats(dir);
+    printf("%s PROPAGATION DELAY SET TO %lu usec\n", dir->name, propDelay);
+}
+
+
+// Copy bytes into the capture ring at the given position, wrapping around
+void capture_put(struct Capture *c, unsigned long long position, const void *data, size_t length)
+{
+    size_t offset = position % CAPTURE_RING_SIZE;
+    size_t first = CAPTURE_RING_SIZE - offset < length ? CAPTURE_RING_SIZE - offset : length;
+    memcpy(c->ring + offset, data, first);
+    memcpy(c->ring, (const unsigned char *) data + first, length - first);
+}
 
-    struct termios oldtioRx;
-    struct termios newtioRx;
 
-    int fdRx = openSerialPort("/dev/emulatorRx", &oldtioRx, &newtioRx);
+// Copy bytes out of the capture ring from the given position, wrapping around
+void capture_get(struct Capture *c, unsigned long long position, void *data, size_t length)
+{
+    size_t offset = position % CAPTURE_RING_SIZE;
+    size_t first = CAPTURE_RING_SIZE - offset < length ? CAPTURE_RING_SIZE - offset : length;
+    memcpy(data, c->ring + offset, first);
+    memcpy((unsigned char *) data + first, c->ring, length - first);
+}
+
 
-    if (fdRx < 0)
+// Record a burst of bytes delivered back to back, from the real-time loop.
+// Never blocks: if the writer has fallen behind, the burst is dropped.
+void capture_burst(struct Direction *dir, long long time, const unsigned char *data, size_t length)
+{
+    struct Capture *c = par.capture;
+    if (c == NULL || length == 0)
     {
-        perror("Opening Rx emulator serial port");
-        exit(-1);
+        return;
     }
 
-    // Configure stdin to receive commands to this program
-    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+    struct CaptureRecord record = { .time = time, .byteTime = dir->byteTime,
+                                    .length = length, .direction = dir->interface };
+    unsigned long long tail = atomic_load_explicit(&c->tail, memory_order_relaxed);
+    unsigned long long head = atomic_load_explicit(&c->head, memory_order_acquire);
+    if (CAPTURE_RING_SIZE - (tail - head) < sizeof(record) + length)
+    {
+        c->dropped += length;
+        return;
+    }
+    capture_put(c, tail, &record, sizeof(record));
+    capture_put(c, tail + sizeof(record), data, length);
+    atomic_store_explicit(&c->tail, tail + sizeof(record) + length, memory_order_release);
+    sem_post(&c->records);
+}
 
-    char rxStdin[BUF_SIZE] = {0};
 
-    int STOP = FALSE;
+// Write a pcap-ng block: type, total length, body padded to 32 bits, total length
+void write_block(FILE *file, uint32_t type, const void *body, uint32_t length)
+{
+    static const unsigned char padding[3];
+    uint32_t padded = (length + 3) & ~3U;
+    uint32_t total = padded + 12;
+    fwrite(&type, 4, 1, file);
+    fwrite(&total, 4, 1, file);
+    fwrite(body, 1, length, file);
+    fwrite(padding, 1, padded - length, file);
+    fwrite(&total, 4, 1, file);
+}
 
-    set_baud_rate(DEFAULT_BAUDRATE);
 
-    set_rt_priority();
+// Append a pcap-ng option to a block body
+// Returns the new body length.
+uint32_t add_option(unsigned char *body, uint32_t length, uint16_t code, const void *value, uint16_t size)
+{
+    memcpy(body + length, &code, 2);
+    memcpy(body + length + 2, &size, 2);
+    memcpy(body + length + 4, value, size);
+    length += 4 + size;
+    while (length % 4 != 0)
+    {
+        body[length++] = 0;
+    }
+    return length;
+}
 
-    // For logging
-    char tx2rxTx[3], tx2rxRx[3], rx2txTx[3], rx2txRx[3];
-    int cableIdle = FALSE;
 
-    printf("\nCable ready\n\n");
+// Write the section header and one interface per direction
+void write_capture_header(FILE *file)
+{
+    unsigned char body[128];
+    uint32_t length = 0;
+
+    // Section header: byte order magic, version 1.0, unknown section length
+    uint32_t magic = 0x1A2B3C4D;
+    uint16_t version[2] = { 1, 0 };
+    int64_t sectionLength = -1;
+    memcpy(body, &magic, 4);
+    memcpy(body + 4, version, 4);
+    memcpy(body + 8, &sectionLength, 8);
+    length = add_option(body, 16, 4, "RCOM virtual cable", 18);  // shb_userappl
+    length = add_option(body, length, 0, NULL, 0);
+    write_block(file, 0x0A0D0D0A, body, length);
+
+    for (int i = 0; i < 2 * par.numLinks; i++)
+    {
+        struct Link *link = &par.links[i / 2];
+        const char *name = i % 2 == 0 ? link->tx2rx.name : link->rx2tx.name;
+        // Interface description: link type, reserved, no snapshot limit
+        uint16_t linkType[2] = { CAPTURE_LINKTYPE, 0 };
+        uint32_t snapLength = 0;
+        unsigned char resolution = 9;  // Nanosecond timestamps
+        memcpy(body, linkType, 4);
+        memcpy(body + 4, &snapLength, 4);
+        length = add_option(body, 8, 2, name, strlen(name));          // if_name
+        length = add_option(body, length, 9, &resolution, 1);        // if_tsresol
+        length = add_option(body, length, 0, NULL, 0);
+        write_block(file, 1, body, length);
+    }
+}
 
-    // To compensate for deviations in byte transmission time
-    struct timespec currentTime, nextTxTime, timeDiff, nextWait;
-    int skipWait = FALSE;
-    int unreliableRate = FALSE;
-    clock_gettime(CLOCK_MONOTONIC, &nextTxTime);
 
-    while (STOP == FALSE)
+// Write a frame as an enhanced packet block on the interface of its direction
+void write_packet(struct Capture *c, int direction, struct CaptureFrame *frame)
+{
+    static unsigned char body[CAPTURE_MAX_FRAME + 64];
+    if (frame->length == 0)
+    {
+        return;
+    }
+
+    uint64_t timestamp = c->wallClock + frame->time / 1000;
+    uint32_t header[5] = { direction, timestamp >> 32, (uint32_t) timestamp,
+                           frame->length, frame->length };
+    memcpy(body, header, sizeof(header));
+    memcpy(body + sizeof(header), frame->data, frame->length);
+    uint32_t length = sizeof(header) + ((frame->length + 3) & ~3U);
+    memset(body + sizeof(header) + frame->length, 0, length - sizeof(header) - frame->length);
+
+    // epb_flags: Tx->Rx is outbound and Rx->Tx inbound, as seen by the transmitter
+    uint32_t flags = direction % 2 == 0 ? 2 : 1;
+    length = add_option(body, length, 2, &flags, 4);
+    length = add_option(body, length, 0, NULL, 0);
+    write_block(c->file, 6, body, length);
+
+    c->packets++;
+    frame->length = 0;
+}
+
+
+// Add the bytes of a burst to the frame of its direction. A packet ends at
+// the FLAG closing a frame; bytes found between frames form packets of
+// their own.
+void capture_bytes(struct Capture *c, const struct CaptureRecord *record, const unsigned char *data)
+{
+    struct CaptureFrame *frame = &c->frames[record->direction];
+    for (unsigned int i = 0; i < record->length; i++)
     {
-        // Check how much waiting time we should have (if any)
-        clock_gettime(CLOCK_MONOTONIC, &currentTime);
-        timeDiff = timespec_diff(&currentTime, &nextTxTime);
-        nextTxTime = timespec_sum(&nextTxTime, &par.byteDelay);
-        if (timeDiff.tv_sec >= 1)
+        long long time = record->time + i * record->byteTime;
+        if (data[i] == FLAG && frame->length > 0 && frame->data[0] == FLAG && frame->length > 1)
         {
-            if (unreliableRate == FALSE)
+            frame->data[frame->length++] = FLAG;
+            write_packet(c, record->direction, frame);
+            continue;
+        }
+        if (data[i] == FLAG)
+        {
+            if (frame->length > 0 && frame->data[0] != FLAG)
             {
-                printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
-                       "No further warnings will be issued\n");
-                unreliableRate = TRUE;
+                write_packet(c, record->direction, frame);
             }
+            frame->length = 0;
         }
-        nextWait = timespec_diff(&nextTxTime, &currentTime);
-        if (timespec_is_negative(&nextWait))
+        if (frame->length == 0)
         {
-            skipWait = TRUE;
+            frame->time = time;
         }
-        else
+        frame->data[frame->length++] = data[i];
+        if (frame->length == CAPTURE_MAX_FRAME)
         {
-            skipWait = FALSE;
+            write_packet(c, record->direction, frame);
         }
+    }
+}
 
-        // Read from Tx
-        int bytesFromTx = read(fdTx, par.tx2rx + par.tx2rxIdx, 1);
-        par.tx2rxValid[par.tx2rxIdx] = bytesFromTx > 0;
 
-        // Read from Rx
-        int bytesFromRx = read(fdRx, par.rx2tx + par.rx2txIdx, 1);
-        par.rx2txValid[par.rx2txIdx] = bytesFromRx > 0;
+// Background writer: turn the records of the capture ring into packets
+void *capture_writer(void *arg)
+{
+    static unsigned char data[BUF_SIZE];
+    struct Capture *c = arg;
 
-        if (!par.cableOn)
+    while (TRUE)
+    {
+        sem_wait(&c->records);
+        unsigned long long head = atomic_load_explicit(&c->head, memory_order_relaxed);
+        if (head == atomic_load_explicit(&c->tail, memory_order_acquire))
         {
-            // Ignore what was read
-            par.tx2rxValid[par.tx2rxIdx] = 0;
-            par.rx2txValid[par.rx2txIdx] = 0;
+            if (atomic_load_explicit(&c->closed, memory_order_acquire))
+            {
+                break;
+            }
+            continue;
         }
 
-        if (par.logfile != NULL)  // Currently logging
+        struct CaptureRecord record;
+        capture_get(c, head, &record, sizeof(record));
+        capture_get(c, head + sizeof(record), data, record.length);
+        atomic_store_explicit(&c->head, head + sizeof(record) + record.length, memory_order_release);
+        capture_bytes(c, &record, data);
+
+        if (head + sizeof(record) + record.length == atomic_load_explicit(&c->tail, memory_order_acquire))
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxTx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
+            // Keep the file readable while the cable runs
+            fflush(c->file);
+        }
+    }
+
+    for (int i = 0; i < 2 * par.numLinks; i++)
+    {
+        write_packet(c, i, &c->frames[i]);
+    }
+    return NULL;
+}
+
+
+void endcapture(void)
+{
+    struct Capture *c = par.capture;
+    if (c == NULL)
+    {
+        return;
+    }
+    par.capture = NULL;
+
+    atomic_store_explicit(&c->closed, TRUE, memory_order_release);
+    sem_post(&c->records);
+    pthread_join(c->writer, NULL);
+    fclose(c->file);
+    printf("CAPTURE ENDED: %llu packets, %llu bytes dropped\n", c->packets, c->dropped);
+
+    sem_destroy(&c->records);
+    free(c->frames);
+    free(c->ring);
+    free(c);
+}
+
+
+void startcapture(const char *filename)
+{
+    endcapture();
+
+    struct Capture *c = calloc(1, sizeof(*c));
+    if (c == NULL || (c->ring = malloc(CAPTURE_RING_SIZE)) == NULL
+        || (c->frames = calloc(2 * par.numLinks, sizeof(*c->frames))) == NULL)
+    {
+        printf("OUT OF MEMORY, NOT CAPTURING\n");
+        if (c != NULL)
+        {
+            free(c->ring);
+        }
+        free(c);
+        return;
+    }
+    c->file = fopen(filename, "wb");
+    if (c->file == NULL)
+    {
+        printf("ERROR OPENING FILE %s, NOT CAPTURING\n", filename);
+        free(c->frames);
+        free(c->ring);
+        free(c);
+        return;
+    }
+    // Touch the ring now so that the real-time loop never page faults on it
+    memset(c->ring, 0, CAPTURE_RING_SIZE);
+
+    struct timespec wallClock;
+    clock_gettime(CLOCK_REALTIME, &wallClock);
+    c->wallClock = (long long) wallClock.tv_sec * 1000000000 + wallClock.tv_nsec - now_ps() / 1000;
+    write_capture_header(c->file);
+
+    atomic_init(&c->head, 0);
+    atomic_init(&c->tail, 0);
+    atomic_init(&c->closed, FALSE);
+    sem_init(&c->records, 0, 0);
+    if (pthread_create(&c->writer, NULL, capture_writer, c) != 0)
+    {
+        printf("ERROR STARTING THE CAPTURE WRITER, NOT CAPTURING\n");
+        sem_destroy(&c->records);
+        fclose(c->file);
+        free(c->frames);
+        free(c->ring);
+        free(c);
+        return;
+    }
+
+    par.capture = c;
+    printf("CAPTURING TO FILE %s\n", filename);
+}
+
+
+// Put one byte on the line: it starts once the line is free, takes one
+// byte time to serialize and arrives a propagation delay later. sent is the
+// byte read from the sender and delivered the byte that reaches the other
+// end, or -1 for none (a byte inserted or dropped by the cable). A dropped
+// byte still takes its time on the line.
+void send_byte(struct Direction *dir, long long now, int sent, int delivered)
+{
+    if (dir->lineFree <= now)
+    {
+        if (par.logfile != NULL && !dir->lineIdle)
+        {
+            fputs("---------------\n", par.logfile);
+        }
+        dir->lineFree = now;
+    }
+    dir->lineFree += dir->byteTime;
+    dir->lineIdle = FALSE;
+
+    if (delivered >= 0)
+    {
+        long long due = dir->lineFree + dir->propDelay * PSEC_PER_USEC + dir->extraDelay;
+        if (dir->timing.jitter != JITTER_NONE)
+        {
+            due += delay_variation(dir);
+        }
+        struct Burst *last = NULL;
+        if (dir->burstCount > 0)
+        {
+            last = &dir->bursts[(dir->burstHead + dir->burstCount - 1) & (dir->burstCapacity - 1)];
+        }
+
+        if (last != NULL && last->byteTime == dir->byteTime
+            && due <= last->due + (long long) last->length * last->byteTime)
+        {
+            // Back to back with the last byte (or held behind it)
+            last->length++;
+        }
+        else
+        {
+            if (last != NULL && due < last->due + (long long) (last->length - 1) * last->byteTime)
+            {
+                due = last->due + (long long) (last->length - 1) * last->byteTime;
+            }
+            size_t tail = (dir->burstHead + dir->burstCount) & (dir->burstCapacity - 1);
+            dir->bursts[tail] = (struct Burst) { .due = due, .byteTime = dir->byteTime, .length = 1 };
+            dir->burstCount++;
+        }
+        dir->data[(dir->head + dir->count) & (dir->capacity - 1)] = delivered;
+        dir->count++;
+    }
+
+    if (par.logfile != NULL)  // Currently logging
+    {
+        char in[3] = "--";
+        char out[3] = "--";
+        if (sent >= 0)
+        {
+            sprintf(in, "%02hhX", (unsigned char) sent);
+        }
+        if (delivered >= 0)
+        {
+            sprintf(out, "%02hhX", (unsigned char) delivered);
+        }
+        if (dir == &dir->link->tx2rx)
+        {
+            fprintf(par.logfile, "%s%s  %s |       \n", dir->link->prefix, in, out);
+        }
+        else
+        {
+            fprintf(par.logfile, "%s       | %s  %s\n", dir->link->prefix, in, out);
+        }
+    }
+}
+
+
+// TRUE if a direction takes new bytes now: the sender is not held off by
+// flow control, and the line backlog is within the read-ahead or a frame
+// is being held back for the fault rules
+int can_accept(const struct Direction *dir, long long now)
+{
+    return !dir->stopped && (dir->frameLength > 0 || dir->lineFree - now < READ_AHEAD_PSEC);
+}
+
+
+// Watch the input of a direction only while it can take bytes, so that a
+// sender ahead of the line does not keep waking the cable up
+void watch_input(struct Direction *dir, int enable)
+{
+    if (dir->watching != enable)
+    {
+        struct epoll_event event = { .events = enable ? EPOLLIN : 0, .data.ptr = dir };
+        epoll_ctl(par.epollFd, EPOLL_CTL_MOD, dir->inFd, &event);
+        dir->watching = enable;
+    }
+}
+
+
+// Make room in the queue for the given number of bytes, each of which may
+// start a burst of its own.
+// Returns 0 on success, -1 if out of memory.
+int reserve(struct Direction *dir, size_t bytes)
+{
+    if (grow_ring((void **) &dir->data, 1, &dir->capacity, &dir->head, dir->count,
+                  dir->count + bytes) != 0
+        || grow_ring((void **) &dir->bursts, sizeof(struct Burst), &dir->burstCapacity, &dir->burstHead,
+                     dir->burstCount, dir->burstCount + bytes) != 0)
+    {
+        printf("%s: OUT OF MEMORY FOR THE BYTES IN FLIGHT\n", dir->name);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Put a byte read from the sender on the line, applying the error model.
+// Takes up to two places in the queue.
+void put_byte(struct Direction *dir, long long now, unsigned char byte)
+{
+    int impairment = next_impairment(dir);
+    if (impairment == IMP_DROP)
+    {
+        send_byte(dir, now, byte, -1);
+        return;
+    }
+
+    send_byte(dir, now, byte, add_bit_errors(dir, byte));
+    if (impairment == IMP_INSERT)
+    {
+        send_byte(dir, now, -1, add_bit_errors(dir, next_random(dir->rng) & 0xFF));
+    }
+    else if (impairment == IMP_DUPLICATE)
+    {
+        send_byte(dir, now, -1, add_bit_errors(dir, byte));
+    }
+}
+
+
+// Kind of a frame, FLAG to FLAG as sent. Supervision frames and I-frames
+// with the same control field differ in length only.
+int frame_kind(const unsigned char *frame, size_t length)
+{
+    if (length < 5)
+    {
+        return FRAME_OTHER;
+    }
+    switch (frame[2])
+    {
+    case 0x03:
+        return FRAME_SET;
+    case 0x07:
+        return FRAME_UA;
+    case 0x0B:
+        return FRAME_DISC;
+    case 0xAA:
+    case 0xAB:
+        return length == 5 ? FRAME_RR : FRAME_I;
+    case 0x54:
+    case 0x55:
+        return FRAME_REJ;
+    }
+    return FRAME_OTHER;
+}
+
+
+// Flip a bit of one field of a frame. The byte never becomes a FLAG or an
+// ESC, so the frame keeps its length and only the checks fail.
+void corrupt_field(unsigned char *frame, size_t length, int field)
+{
+    size_t index;
+    switch (field)
+    {
+    case FIELD_ADDRESS:
+        index = 1;
+        break;
+    case FIELD_CONTROL:
+        index = 2;
+        break;
+    case FIELD_BCC1:
+        index = 3;
+        break;
+    case FIELD_DATA:
+        // The first payload byte, or the value after its ESC
+        index = frame[4] == ESC ? 5 : 4;
+        break;
+    default:
+        index = length - 2;
+        break;
+    }
+    if (length < 5 || (field >= FIELD_DATA && length < 7))
+    {
+        // A supervision frame has no payload nor BCC2
+        return;
+    }
+    unsigned char flipped = frame[index] ^ 0x01;
+    frame[index] ^= flipped == FLAG || flipped == ESC ? 0x04 : 0x01;
+}
+
+
+// Put the frame held back on the line as it was read
+void flush_frame(struct Direction *dir, long long now)
+{
+    for (size_t i = 0; i < dir->frameLength; i++)
+    {
+        put_byte(dir, now, dir->frame[i]);
+    }
+    dir->frameLength = 0;
+}
+
+
+// Put a complete frame on the line, applying the fault rules that hit it
+void send_frame(struct Direction *dir, long long now)
+{
+    static const char *actionNames[] = { "DROPPED", "DUPLICATED", "DELAYED", "CORRUPTED" };
+    int kind = frame_kind(dir->frame, dir->frameLength);
+    int drop = FALSE;
+    int copies = 1;
+
+    for (int i = 0; i < dir->numFaults; i++)
+    {
+        struct FaultRule *rule = &dir->faults[i];
+        if (rule->frame != FRAME_ANY && rule->frame != kind)
+        {
+            continue;
+        }
+        rule->seen++;
+        if (rule->every ? rule->seen % rule->n != 0 : rule->seen != rule->n)
+        {
+            continue;
+        }
+        rule->hits++;
+        printf("%s FAULT %d: %s %s #%llu\n", dir->name, i + 1, actionNames[rule->action],
+               frameNames[kind], rule->seen);
+        switch (rule->action)
+        {
+        case FAULT_DROP:
+            drop = TRUE;
+            break;
+        case FAULT_DUPLICATE:
+            copies = 2;
+            break;
+        case FAULT_DELAY:
+            dir->extraDelay += rule->delay;
+            break;
+        default:
+            corrupt_field(dir->frame, dir->frameLength, rule->field);
+            break;
+        }
+    }
+
+    if (drop)
+    {
+        // Like dropped bytes, the frame still takes its time on the line
+        for (size_t i = 0; i < dir->frameLength; i++)
+        {
+            send_byte(dir, now, dir->frame[i], -1);
+        }
+        dir->frameLength = 0;
+    }
+    else
+    {
+        size_t length = dir->frameLength;
+        for (int c = 0; c < copies; c++)
+        {
+            dir->frameLength = length;
+            flush_frame(dir, now);
+        }
+    }
+    // Later bytes are held behind a delayed frame, but not delayed further
+    dir->extraDelay = 0;
+}
+
+
+// Pass a byte read from the sender through the frame being held back.
+// Bytes between frames go straight on the line.
+void stage_byte(struct Direction *dir, long long now, unsigned char byte)
+{
+    if (dir->frameLength == 0 && byte != FLAG)
+    {
+        put_byte(dir, now, byte);
+        return;
+    }
+    if (dir->frameLength == 1 && byte == FLAG)
+    {
+        // Back to back FLAGs: the first one opens no frame
+        flush_frame(dir, now);
+    }
+
+    dir->frame[dir->frameLength++] = byte;
+    if (byte == FLAG && dir->frameLength > 1)
+    {
+        send_frame(dir, now);
+    }
+    else if (dir->frameLength == MAX_STAGED_FRAME)
+    {
+        // Too long to be a frame
+        flush_frame(dir, now);
+    }
+}
+
+
+// Read the burst waiting at the input of a direction with a single read()
+// and put its bytes on the line, applying the fault rules and the error
+// model
+void accept_burst(struct Direction *dir, long long now)
+{
+    static unsigned char burst[BUF_SIZE];
+
+    // Like a real UART, only take what the line can send within the
+    // read-ahead, leaving the rest in the sender's buffer
+    long long backlog = dir->lineFree > now ? dir->lineFree - now : 0;
+    long long room = backlog < READ_AHEAD_PSEC ? (READ_AHEAD_PSEC - backlog) / dir->byteTime + 1 : 0;
+    if (dir->frameLength > 0 && room < MAX_STAGED_FRAME - (long long) dir->frameLength)
+    {
+        // The rest of a frame held back takes no line time until it ends
+        room = MAX_STAGED_FRAME - dir->frameLength;
+    }
+    if (room == 0)
+    {
+        return;
+    }
+    if (room > BUF_SIZE)
+    {
+        room = BUF_SIZE;
+    }
+
+    // Inserted and duplicated bytes take two places in the queue; a frame
+    // held back goes out with this burst, twice if duplicated
+    int staging = dir->numFaults > 0 || dir->frameLength > 0;
+    if (reserve(dir, 2 * room + (staging ? 4 * (room + MAX_STAGED_FRAME) : 0)) != 0)
+    {
+        return;
+    }
+
+    int bytes = read(dir->inFd, burst, room);
+    if (bytes > 0 && par.origin < 0)
+    {
+        // Scenario times count from the first byte
+        par.origin = now;
+    }
+    if (bytes <= 0 || !dir->link->cableOn)
+    {
+        // Ignore what was read while the cable is off
+        return;
+    }
+
+    for (int i = 0; i < bytes; i++)
+    {
+        if (staging)
+        {
+            stage_byte(dir, now, burst[i]);
+        }
+        else
+        {
+            put_byte(dir, now, burst[i]);
+        }
+    }
+    dir->frameRead = now;
+}
+
+
+// Send on a frame whose end has not come for a while: the sender stopped
+// in the middle of it, or the bytes were not a frame. The input is watched
+// throughout a frame, so the sender has really gone quiet.
+void expire_frame(struct Direction *dir, long long now)
+{
+    if (dir->stopped)
+    {
+        // Only the time the sender may send counts
+        dir->frameRead = now;
+        return;
+    }
+    if (dir->frameLength > 0 && now >= dir->frameRead + FRAME_TIMEOUT_PSEC
+        && reserve(dir, 2 * dir->frameLength) == 0)
+    {
+        flush_frame(dir, now);
+    }
+}
+
+
+// Account for the first bytes of the oldest burst, written at the given
+// time: capture them and update the rate and jitter statistics
+void release_burst(struct Direction *dir, const unsigned char *bytes, size_t length, long long now)
+{
+    struct Burst *burst = &dir->bursts[dir->burstHead];
+    long long spacing = burst->byteTime;
+    if (dir->lastDue < 0 || burst->due - dir->lastDue != spacing)
+    {
+        // Not back to back with the previous byte: a new burst starts
+        end_burst(dir);
+        dir->burstDue = burst->due;
+        dir->burstRelease = now;
+    }
+    capture_burst(dir, burst->due, bytes, length);
+
+    // Byte i is late by late - i * spacing; sum those and their squares
+    double late = now - burst->due;
+    double n = length;
+    double indexSum = n * (n - 1) / 2;
+    double indexSquares = (n - 1) * n * (2 * n - 1) / 6;
+    dir->lateCount += length;
+    dir->lateSum += n * late - spacing * indexSum;
+    dir->lateSquares += n * late * late - 2 * late * spacing * indexSum + (double) spacing * spacing * indexSquares;
+    if (now - burst->due > dir->lateMax)
+    {
+        dir->lateMax = now - burst->due;
+    }
+
+    dir->lastDue = burst->due + (long long) (length - 1) * spacing;
+    dir->lastRelease = now;
+    dir->released += length;
+    burst->due += (long long) length * spacing;
+    burst->length -= length;
+    if (burst->length == 0)
+    {
+        dir->burstHead = (dir->burstHead + 1) & (dir->burstCapacity - 1);
+        dir->burstCount--;
+    }
+}
+
+
+// Number of bytes due by now, up to limit
+size_t count_due(const struct Direction *dir, long long now, size_t limit)
+{
+    size_t count = 0;
+    for (size_t b = 0; b < dir->burstCount && count < limit; b++)
+    {
+        const struct Burst *burst = &dir->bursts[(dir->burstHead + b) & (dir->burstCapacity - 1)];
+        if (burst->due > now)
+        {
+            break;
+        }
+        size_t due = (now - burst->due) / burst->byteTime + 1;
+        if (due < burst->length)
+        {
+            count += due;
+            break;
+        }
+        count += burst->length;
+    }
+    return count < limit ? count : limit;
+}
+
+
+// Time the byte at a given position in the queue becomes due, or -1 if
+// there are not that many bytes queued
+long long byte_due(const struct Direction *dir, size_t position)
+{
+    for (size_t b = 0; b < dir->burstCount; b++)
+    {
+        const struct Burst *burst = &dir->bursts[(dir->burstHead + b) & (dir->burstCapacity - 1)];
+        if (position < burst->length)
+        {
+            return burst->due + (long long) position * burst->byteTime;
+        }
+        position -= burst->length;
+    }
+    return -1;
+}
+
+
+// TRUE while a coalescing direction holds the bytes that are due: the
+// oldest has not waited the latency time and not enough have arrived
+int holding(const struct Direction *dir, long long now)
+{
+    const struct TimingModel *t = &dir->timing;
+    if (t->coalesceTime == 0 || dir->bursts[dir->burstHead].due + t->coalesceTime <= now)
+    {
+        return FALSE;
+    }
+    return t->coalesceBytes == 0 || count_due(dir, now, t->coalesceBytes) < t->coalesceBytes;
+}
+
+
+// Bytes the receiving program has not read yet
+size_t unread_bytes(const struct Direction *dir)
+{
+    int unread = 0;
+    ioctl(dir->outSlave, FIONREAD, &unread);
+    return unread > 0 ? unread : 0;
+}
+
+
+// Lose the oldest bytes in flight: they reached a receiver whose buffer
+// was full, like a UART overrun
+void overrun(struct Direction *dir, size_t length)
+{
+    dir->overruns += length;
+    dir->head = (dir->head + length) & (dir->capacity - 1);
+    dir->count -= length;
+    while (length > 0)
+    {
+        struct Burst *burst = &dir->bursts[dir->burstHead];
+        size_t lost = burst->length < length ? burst->length : length;
+        burst->due += (long long) lost * burst->byteTime;
+        burst->length -= lost;
+        length -= lost;
+        if (burst->length == 0)
+        {
+            dir->burstHead = (dir->burstHead + 1) & (dir->burstCapacity - 1);
+            dir->burstCount--;
+        }
+    }
+}
+
+
+// Write every byte that is due by now with as few write() calls as the
+// queue wraps, updating the rate and jitter statistics. With a finite
+// receiver buffer, the bytes that do not fit are lost.
+void release_due(struct Direction *dir, long long now)
+{
+    if ((dir->count > 0 || dir->frameLength > 0) && !dir->link->cableOn)
+    {
+        // Bytes in flight are lost when the cable is unplugged
+        dir->count = 0;
+        dir->burstCount = 0;
+        dir->frameLength = 0;
+        dir->lineIdle = TRUE;
+    }
+    if (dir->burstCount == 0 || dir->bursts[dir->burstHead].due > now || holding(dir, now))
+    {
+        return;
+    }
+
+    while (dir->burstCount > 0 && dir->bursts[dir->burstHead].due <= now)
+    {
+        // Bytes due, up to where the byte ring wraps
+        size_t limit = dir->capacity - dir->head;
+        if (limit > dir->count)
+        {
+            limit = dir->count;
+        }
+        size_t run = count_due(dir, now, limit);
+        size_t lost = 0;
+        if (dir->rxBuffer > 0)
+        {
+            size_t unread = unread_bytes(dir);
+            size_t space = unread < dir->rxBuffer ? dir->rxBuffer - unread : 0;
+            if (space < run)
+            {
+                lost = run - space;
+                run = space;
+            }
+        }
+
+        int written = run > 0 ? write(dir->outFd, dir->data + dir->head, run) : 0;
+        if (written < 0 || (written == 0 && lost == 0))
+        {
+            // The receiving end is full; try again on the next tick
+            return;
+        }
+
+        size_t done = 0;
+        while (done < (size_t) written)
+        {
+            size_t length = dir->bursts[dir->burstHead].length;
+            if (length > written - done)
+            {
+                length = written - done;
+            }
+            release_burst(dir, dir->data + dir->head + done, length, now);
+            done += length;
+        }
+        dir->head = (dir->head + written) & (dir->capacity - 1);
+        dir->count -= written;
+        if ((size_t) written < run)
+        {
+            return;
+        }
+        if (lost > 0)
+        {
+            overrun(dir, lost);
+        }
+    }
+}
+
+
+// The direction in the opposite sense on the same link
+struct Direction *reverse(struct Direction *dir)
+{
+    return dir == &dir->link->tx2rx ? &dir->link->rx2tx : &dir->link->tx2rx;
+}
+
+
+// Follow the receiver's buffer with the flow control of a direction: the
+// receiver asks the sender to stop once the buffer is three quarters full,
+// and to resume once it is down to a quarter. The request reaches the
+// sender a propagation delay later, which then stops taking bytes from its
+// program. The programs only notice because their writes block once their
+// pty buffer fills: ptys have no modem lines to show RTS/CTS.
+void update_flow(struct Direction *dir, long long now)
+{
+    if (dir->flowChange >= 0 && dir->flowChange <= now)
+    {
+        if (dir->holdOff && !dir->stopped)
+        {
+            dir->stops++;
+        }
+        dir->stopped = dir->holdOff;
+        dir->flowChange = -1;
+    }
+    if (dir->flow == FLOW_NONE || !dir->link->cableOn)
+    {
+        return;
+    }
+
+    size_t capacity = dir->rxBuffer > 0 ? dir->rxBuffer : MAX_RX_BUFFER;
+    size_t unread = unread_bytes(dir);
+    int holdOff = dir->holdOff ? unread > capacity / 4 : unread >= capacity * 3 / 4;
+    if (holdOff == dir->holdOff)
+    {
+        return;
+    }
+
+    dir->flowChange = now + reverse(dir)->propDelay * PSEC_PER_USEC;
+    dir->holdOff = holdOff;
+}
+
+
+// Earliest time queued bytes can be released, or -1 if the queue is empty
+long long next_due(const struct Direction *dir)
+{
+    if (dir->burstCount == 0)
+    {
+        return -1;
+    }
+    const struct TimingModel *t = &dir->timing;
+    long long due = dir->bursts[dir->burstHead].due;
+    if (t->coalesceTime > 0)
+    {
+        // When the latency timer expires, or earlier if the packet fills up
+        long long full = t->coalesceBytes > 0 ? byte_due(dir, t->coalesceBytes - 1) : -1;
+        due = full >= 0 && full < due + t->coalesceTime ? full : due + t->coalesceTime;
+    }
+    return due;
+}
+
+
+// Show the rate achieved during bursts and how late bytes were delivered
+void print_stats(struct Direction *dir)
+{
+    end_burst(dir);
+    dir->lastDue = -1;
+
+    printf("%s: %llu bytes", dir->name, dir->released);
+    if (dir->actualTime > 0)
+    {
+        double achieved = (double) dir->baud * dir->targetTime / dir->actualTime;
+        printf(", rate %.0f baud (target %lu, %+.2f%%)", achieved, dir->baud,
+               100.0 * (achieved - dir->baud) / dir->baud);
+    }
+    if (dir->lateCount > 0)
+    {
+        double mean = dir->lateSum / dir->lateCount;
+        double variance = dir->lateSquares / dir->lateCount - mean * mean;
+        printf(", lateness mean %.1f usec, max %.1f usec, jitter %.1f usec",
+               mean / PSEC_PER_USEC, (double) dir->lateMax / PSEC_PER_USEC,
+               square_root(variance) / PSEC_PER_USEC);
+    }
+    if (dir->overruns > 0)
+    {
+        printf(", %llu bytes lost to overruns", dir->overruns);
+    }
+    if (dir->stops > 0)
+    {
+        printf(", sender held off %llu times", dir->stops);
+    }
+    printf("\n");
+}
+
+
+// Make the program use RT priority to improve precision in timing
+void set_rt_priority(void) {
+    struct sched_param sp = { .sched_priority = 50 };
+    if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1) {
+      perror("Could not set realtime priority");
+    }
+}
+
+
+// Parse a scenario time such as "2.5s", "250ms", "100us" or "4" (seconds)
+// Returns the time in picoseconds, or -1 on error.
+long long parse_time(const char *text)
+{
+    char *unit;
+    double value = strtod(text, &unit);
+    if (unit == text || value < 0.0)
+    {
+        return -1;
+    }
+    if (*unit == '\0' || strcmp(unit, "s") == 0)
+    {
+        return (long long) (value * PSEC_PER_SEC);
+    }
+    if (strcmp(unit, "ms") == 0)
+    {
+        return (long long) (value * PSEC_PER_SEC / 1000);
+    }
+    if (strcmp(unit, "us") == 0)
+    {
+        return (long long) (value * PSEC_PER_USEC);
+    }
+    return -1;
+}
+
+
+// Load a scenario file. Each line holds a command, optionally preceded by
+// "t=<time>"; commands without a time (such as "seed 42") are run when the
+// cable starts, the others once that time has passed since the first byte.
+// Empty lines and lines starting with # are ignored.
+// Returns 0 on success, -1 on error.
+int load_scenario(const char *filename, char *initial[], int *numInitial)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    char line[MAX_COMMAND_SIZE + 32];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        lineNumber++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *text = line + strspn(line, " \t");
+        if (*text == '\0' || *text == '#')
+        {
+            continue;
+        }
+
+        long long time = -1;
+        if (strncmp(text, "t=", 2) == 0)
+        {
+            char *end = text + strcspn(text, " \t");
+            if (*end == '\0')
+            {
+                fprintf(stderr, "%s:%d: missing command\n", filename, lineNumber);
+                fclose(file);
+                return -1;
+            }
+            *end = '\0';
+            time = parse_time(text + 2);
+            if (time < 0)
+            {
+                fprintf(stderr, "%s:%d: bad time \"%s\"\n", filename, lineNumber, text + 2);
+                fclose(file);
+                return -1;
+            }
+            text = end + 1 + strspn(end + 1, " \t");
+        }
+        if (strlen(text) >= MAX_COMMAND_SIZE)
+        {
+            fprintf(stderr, "%s:%d: command too long\n", filename, lineNumber);
+            fclose(file);
+            return -1;
+        }
+
+        if (time < 0)
+        {
+            if (*numInitial == MAX_FLAG_COMMANDS)
+            {
+                fprintf(stderr, "%s:%d: too many untimed commands (at most %d, options included)\n",
+                        filename, lineNumber, MAX_FLAG_COMMANDS);
+                fclose(file);
+                return -1;
+            }
+            initial[(*numInitial)++] = strdup(text);
+            continue;
+        }
+
+        // Keep the actions sorted by time, in file order for equal times
+        struct Action *actions = realloc(par.actions, (par.numActions + 1) * sizeof(*actions));
+        if (actions == NULL)
+        {
+            fclose(file);
+            return -1;
+        }
+        par.actions = actions;
+        int i = par.numActions++;
+        while (i > 0 && actions[i - 1].time > time)
+        {
+            actions[i] = actions[i - 1];
+            i--;
+        }
+        actions[i].time = time;
+        strcpy(actions[i].command, text);
+    }
+
+    fclose(file);
+    printf("SCENARIO %s: %d TIMED ACTIONS\n", filename, par.numActions);
+    return 0;
+}
+
+
+void endlog(void)
+{
+    if (par.logfile != NULL)
+    {
+        fclose(par.logfile);
+        par.logfile = NULL;
+    }
+}
+
+
+void startlog(const char *filename)
+{
+    endlog();
+    par.logfile = fopen(filename, "w");
+    if (par.logfile != NULL)
+    {
+        fprintf(par.logfile, "Tx->Rx | Rx->Tx\n");
+        printf("LOGGING TO FILE %s\n", filename);
+    }
+    else
+    {
+        printf("ERROR OPENING FILE %s, NOT LOGGING\n", filename);
+    }
+}
+
+
+// Parse a fault rule: <frame> [every] <n> followed by drop, dup,
+// delay <time> or corrupt <field>.
+// Returns 0 on success, -1 on error.
+int parse_fault(const char *text, struct FaultRule *rule)
+{
+    char frame[8];
+    char action[16];
+    char argument[16];
+    int consumed = 0;
+    memset(rule, 0, sizeof(*rule));
+
+    rule->frame = -1;
+    if (sscanf(text, "%7s %n", frame, &consumed) < 1)
+    {
+        return -1;
+    }
+    for (int i = 0; i < NUM_FRAME_KINDS; i++)
+    {
+        if (strcasecmp(frame, frameNames[i]) == 0)
+        {
+            rule->frame = i;
+        }
+    }
+    text += consumed;
+    if (strncmp(text, "every ", 6) == 0)
+    {
+        rule->every = TRUE;
+        text += 6;
+    }
+    int fields = sscanf(text, "%lu %15s %15s", &rule->n, action, argument);
+    if (rule->frame < 0 || fields < 2 || rule->n == 0 || text[0] == '-')
+    {
+        return -1;
+    }
+
+    if (strcmp(action, "drop") == 0 && fields == 2)
+    {
+        rule->action = FAULT_DROP;
+    }
+    else if (strcmp(action, "dup") == 0 && fields == 2)
+    {
+        rule->action = FAULT_DUPLICATE;
+    }
+    else if (strcmp(action, "delay") == 0 && fields == 3)
+    {
+        rule->action = FAULT_DELAY;
+        rule->delay = parse_time(argument);
+        if (rule->delay < 0 || rule->delay > MAX_PROP_DELAY * PSEC_PER_USEC)
+        {
+            return -1;
+        }
+    }
+    else if (strcmp(action, "corrupt") == 0 && fields == 3)
+    {
+        rule->action = FAULT_CORRUPT;
+        rule->field = -1;
+        for (int i = 0; i < NUM_FIELDS; i++)
+        {
+            if (strcasecmp(argument, fieldNames[i]) == 0)
+            {
+                rule->field = i;
+            }
+        }
+        if (rule->field < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+// Show a fault rule of a direction and how often it hit
+void print_fault(const struct Direction *dir, int index)
+{
+    const struct FaultRule *rule = &dir->faults[index];
+    static const char *actionNames[] = { "drop", "dup", "delay", "corrupt" };
+    printf("%s FAULT %d: %s %s%lu %s", dir->name, index + 1, frameNames[rule->frame],
+           rule->every ? "every " : "#", rule->n, actionNames[rule->action]);
+    if (rule->action == FAULT_DELAY)
+    {
+        printf(" %.6f s", (double) rule->delay / PSEC_PER_SEC);
+    }
+    else if (rule->action == FAULT_CORRUPT)
+    {
+        printf(" %s", fieldNames[rule->field]);
+    }
+    printf(" (%llu seen, %llu hits)\n", rule->seen, rule->hits);
+}
+
+
+// Show help
+void help()
+{
+    printf("\n\n");
+    for (int i = 0; i < par.numLinks; i++)
+    {
+        struct Link *link = &par.links[i];
+        printf("%sTransmitter must open %s\n", link->prefix, link->txDevice);
+        printf("%sReceiver must open %s\n", link->prefix, link->rxDevice);
+    }
+    printf("\n"
+           "The cable program is sensible to the following interactive commands:\n"
+           "--- help         : show this help\n"
+           "--- on           : connect the cable and data is exchanged (default state)\n"
+           "--- off          : disconnect the cable disabling data to be exchanged\n"
+           "--- ber <ber>    : flip data bits independently at a specified BER (default=0)\n"
+           "--- ge <p> <r> <ber good> <ber bad>\n"
+           "                 : Gilbert-Elliott burst errors; p and r are the probabilities\n"
+           "                   per bit of going from the good to the bad state and back\n"
+           "--- drop <prob>  : drop bytes with the given probability (default=0)\n"
+           "--- insert <prob>: insert random bytes with the given probability (default=0)\n"
+           "--- dup <prob>   : duplicate bytes with the given probability (default=0)\n"
+           "--- seed <n>     : restart the error models from seed n (default=1), so that\n"
+           "                   runs with the same seed see the same errors\n"
+           "--- model        : show the error and timing models in use\n"
+           "--- baud <rate>  : set baud rate, between 1200 and 10000000 (default=9600)\n"
+           "                   note that 10 bits are sent per byte (8-N-1)\n"
+           "--- prop <delay> : set the propagation delay in usec (0-60000000, default=0)\n"
+           "--- jitter <distribution>\n"
+           "                 : add a random delay to each byte, in usec: off (default),\n"
+           "                   uniform <max>, exp <mean> or normal <mean> <deviation>;\n"
+           "                   bytes still arrive in order\n"
+           "--- skew <ppm>   : make the sender's clock slower (> 0) or faster (< 0)\n"
+           "--- coalesce <usec> [<bytes>]\n"
+           "                 : deliver in bursts, like a USB adapter: hold the bytes until\n"
+           "                   the oldest waited usec or <bytes> are waiting (0 = off)\n"
+           "--- rxbuf <bytes>: size of the receiver's buffer (1-4095, or 0 for unlimited,\n"
+           "                   the default); bytes arriving when it is full are lost\n"
+           "--- flow <mode>  : flow control by the receiver: none (default) or rtscts;\n"
+           "                   it stops the sender at 3/4 of the buffer and resumes\n"
+           "                   it at 1/4 (the sender's writes block meanwhile)\n"
+           "--- fault <frame> [every] <n> <action>\n"
+           "                 : fault on the n-th frame (or every n-th frame) of a kind\n"
+           "                   from now on: set, ua, disc, rr, rej, i or any; the action\n"
+           "                   is drop, dup, delay <time> (e.g. 2s, 500ms) or corrupt\n"
+           "                   <address|control|bcc1|data|bcc2>, e.g. \"fault rr 3 drop\"\n"
+           "--- fault list   : show the fault rules and how often they hit\n"
+           "--- fault clear  : remove the fault rules\n"
+           "--- stats        : show the achieved rate and delivery jitter per direction\n"
+           "--- log <file>   : log transmitted data to file\n"
+           "--- endlog       : stop logging transmitted data\n"
+           "--- capture <file>: capture the delivered frames to a pcap-ng file, much\n"
+           "                   cheaper than logging; one interface per direction\n"
+           "--- endcapture   : stop capturing\n"
+           "--- quit         : terminate the program\n"
+           "\n"
+           "Prefix the line commands (ber, ge, drop, insert, dup, model, baud, prop,\n"
+           "jitter, skew, coalesce, rxbuf, flow, fault and stats) with tx2rx or rx2tx to apply them to one\n"
+           "direction only (e.g. \"rx2tx ber 1e-4\"); without a prefix they apply to\n"
+           "both. Prefix these and on or off with link <n>, before any direction, to\n"
+           "apply them to one link only (e.g. \"link 2 off\").\n"
+           "\n"
+           "Run with -h to see how to give these settings and timed scenarios on the\n"
+           "command line.\n"
+           "\n"
+           "NOTE: Bytes already on the line keep their timing when the baud rate or the\n"
+           "      propagation delay changes.\n"
+           "\n");
+}
+
+// Run one cable command, typed on stdin, given as a flag or scheduled by
+// a scenario.
+// Returns TRUE if the command ends the program.
+int run_command(char *command)
+{
+    // Link commands apply to every link unless prefixed with "link <n>",
+    // and line commands to both directions unless prefixed with one
+    int firstLink = 0;
+    int lastLink = par.numLinks - 1;
+    int linkGiven = strncmp(command, "link ", 5) == 0;
+    if (linkGiven)
+    {
+        char *rest;
+        long index = strtol(command + 5, &rest, 10);
+        if (rest == command + 5 || *rest != ' ' || index < 0 || index >= par.numLinks)
+        {
+            printf("NO SUCH LINK (link <0-%d> <command>)\n", par.numLinks - 1);
+            return FALSE;
+        }
+        firstLink = index;
+        lastLink = index;
+        command = rest + 1;
+    }
+    int first = 0;
+    int last = 1;
+    if (strncmp(command, "tx2rx ", 6) == 0)
+    {
+        last = 0;
+        command += 6;
+    }
+    else if (strncmp(command, "rx2tx ", 6) == 0)
+    {
+        first = 1;
+        command += 6;
+    }
+
+    static const char *lineCommands[] = { "ber ", "ge ", "drop ", "insert ", "dup ", "model",
+                                          "baud ", "prop ", "jitter ", "skew ", "coalesce ",
+                                          "rxbuf ", "flow ", "fault ", "stats", "on", "off" };
+    int numLineCommands = sizeof(lineCommands) / sizeof(lineCommands[0]);
+    if (first == last)
+    {
+        // Not on or off: a direction cannot be unplugged on its own
+        numLineCommands -= 2;
+    }
+    if (first == last || linkGiven)
+    {
+        int found = FALSE;
+        for (int i = 0; i < numLineCommands; i++)
+        {
+            found |= strncmp(command, lineCommands[i], strlen(lineCommands[i])) == 0;
+        }
+        if (!found && first == last)
+        {
+            printf("ONLY THE LINE COMMANDS TAKE A DIRECTION (SEE help)\n");
+            return FALSE;
+        }
+        if (!found)
+        {
+            printf("ONLY on, off AND THE COMMANDS THAT TAKE A DIRECTION TAKE A LINK\n");
+            return FALSE;
+        }
+    }
+
+    struct Direction *dirs[2 * MAX_LINKS];
+    int numDirs = 0;
+    for (int i = firstLink; i <= lastLink; i++)
+    {
+        if (first == 0)
+        {
+            dirs[numDirs++] = &par.links[i].tx2rx;
+        }
+        if (last == 1)
+        {
+            dirs[numDirs++] = &par.links[i].rx2tx;
+        }
+    }
+
+    if (strcmp(command, "off") == 0)
+    {
+        for (int i = firstLink; i <= lastLink; i++)
+        {
+            struct Link *link = &par.links[i];
+            printf("%sCONNECTION OFF\n", link->prefix);
+            if (link->cableOn && par.logfile != NULL)
+            {
+                fprintf(par.logfile, "%sCABLE OFF\n", link->prefix);
+            }
+            link->cableOn = FALSE;
+        }
+    }
+    else if (strcmp(command, "on") == 0)
+    {
+        for (int i = firstLink; i <= lastLink; i++)
+        {
+            printf("%sCONNECTION ON\n", par.links[i].prefix);
+            par.links[i].cableOn = TRUE;
+        }
+    }
+    else if (strncmp(command, "ber ", 4) == 0)
+    {
+        double ber;
+        if (sscanf(command + 4, "%lf", &ber) < 1 || ber < 0.0 || ber >= 1.0)
+        {
+            printf("BAD BER VALUE (MUST BE 0 <= BER < 1.0)\n");
+        }
+        else
+        {
+            for (int i = 0; i < numDirs; i++)
+            {
+                dirs[i]->model.ber[FALSE] = ber;
+                dirs[i]->model.leave[FALSE] = 0.0;
+                reset_model(dirs[i]);
+                printf("%s BER SET TO %g\n", dirs[i]->name, ber);
+            }
+        }
+    }
+    else if (strncmp(command, "ge ", 3) == 0)
+    {
+        double toBad, toGood, berGood, berBad;
+        if (sscanf(command + 3, "%lf %lf %lf %lf", &toBad, &toGood, &berGood, &berBad) < 4
+            || toBad < 0.0 || toBad > 1.0 || toGood <= 0.0 || toGood > 1.0
+            || berGood < 0.0 || berGood >= 1.0 || berBad < 0.0 || berBad >= 1.0)
+        {
+            printf("BAD GILBERT-ELLIOTT PARAMETERS (ge <good->bad> <bad->good> <ber good> <ber bad>)\n");
+        }
+        else
+        {
+            for (int i = 0; i < numDirs; i++)
             {
-                memcpy(tx2rxTx, "  ", 3);
+                struct ErrorModel *m = &dirs[i]->model;
+                m->leave[FALSE] = toBad;
+                m->leave[TRUE] = toGood;
+                m->ber[FALSE] = berGood;
+                m->ber[TRUE] = berBad;
+                reset_model(dirs[i]);
+                print_model(dirs[i]);
             }
-            if (par.rx2txValid[par.rx2txIdx])
+        }
+    }
+    else if (strncmp(command, "drop ", 5) == 0 || strncmp(command, "insert ", 7) == 0
+             || strncmp(command, "dup ", 4) == 0)
+    {
+        double probability;
+        if (sscanf(strchr(command, ' ') + 1, "%lf", &probability) < 1 || probability < 0.0)
+        {
+            printf("BAD PROBABILITY (DROP + INSERT + DUP MUST BE BETWEEN 0 AND 1)\n");
+            return FALSE;
+        }
+        for (int i = 0; i < numDirs; i++)
+        {
+            struct ErrorModel *m = &dirs[i]->model;
+            double *target = command[0] == 'd' ? (command[1] == 'r' ? &m->drop : &m->duplicate)
+                                               : &m->insert;
+            if (probability + m->drop + m->insert + m->duplicate - *target > 1.0)
             {
-                sprintf(rx2txTx, "%02hhX", par.rx2tx[par.rx2txIdx]);
+                printf("%s: BAD PROBABILITY (DROP + INSERT + DUP MUST BE BETWEEN 0 AND 1)\n", dirs[i]->name);
+                continue;
             }
-            else
+            *target = probability;
+            reset_model(dirs[i]);
+            print_model(dirs[i]);
+        }
+    }
+    else if (strncmp(command, "seed ", 5) == 0)
+    {
+        unsigned long long seed;
+        if (sscanf(command + 5, "%llu", &seed) < 1)
+        {
+            printf("BAD SEED\n");
+        }
+        else
+        {
+            par.seed = seed;
+            reset_models();
+            printf("SEED SET TO %llu\n", seed);
+        }
+    }
+    else if (strcmp(command, "model") == 0)
+    {
+        printf("SEED: %llu\n", par.seed);
+        for (int i = 0; i < numDirs; i++)
+        {
+            print_model(dirs[i]);
+            print_timing(dirs[i]);
+            print_flow(dirs[i]);
+        }
+    }
+    else if (strncmp(command, "jitter ", 7) == 0)
+    {
+        char kind[16];
+        double mean = 0.0;
+        double deviation = 0.0;
+        int fields = sscanf(command + 7, "%15s %lf %lf", kind, &mean, &deviation);
+        int jitter = -1;
+        if (fields >= 1 && strcmp(kind, "off") == 0)
+        {
+            jitter = JITTER_NONE;
+        }
+        else if (fields >= 2 && mean >= 0.0 && strcmp(kind, "uniform") == 0)
+        {
+            jitter = JITTER_UNIFORM;
+            mean /= 2;
+        }
+        else if (fields >= 2 && mean >= 0.0 && strcmp(kind, "exp") == 0)
+        {
+            jitter = JITTER_EXPONENTIAL;
+        }
+        else if (fields == 3 && mean >= 0.0 && deviation >= 0.0 && strcmp(kind, "normal") == 0)
+        {
+            jitter = JITTER_NORMAL;
+        }
+
+        if (jitter < 0)
+        {
+            printf("BAD JITTER (jitter off | uniform <max> | exp <mean> | normal <mean> <deviation>, in usec)\n");
+        }
+        else
+        {
+            for (int i = 0; i < numDirs; i++)
             {
-                memcpy(rx2txTx, "  ", 3);
+                dirs[i]->timing.jitter = jitter;
+                dirs[i]->timing.jitterMean = mean;
+                dirs[i]->timing.jitterDeviation = deviation;
+                print_timing(dirs[i]);
             }
         }
-
-        // Advance indices to next position
-        par.tx2rxIdx = (par.tx2rxIdx + 1) % par.bufSize;
-        par.rx2txIdx = (par.rx2txIdx + 1) % par.bufSize;
-
-        if (par.cableOn)
+    }
+    else if (strncmp(command, "skew ", 5) == 0)
+    {
+        double skew;
+        if (sscanf(command + 5, "%lf", &skew) < 1 || skew < -MAX_SKEW_PPM || skew > MAX_SKEW_PPM)
+        {
+            printf("BAD SKEW (MUST BE BETWEEN -%d AND %d ppm)\n", MAX_SKEW_PPM, MAX_SKEW_PPM);
+        }
+        else
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
+            for (int i = 0; i < numDirs; i++)
             {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.tx2rx[par.tx2rxIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdRx, par.tx2rx + par.tx2rxIdx, 1);
+                dirs[i]->timing.skew = skew;
+                update_byte_time(dirs[i]);
+                reset_stats(dirs[i]);
+                print_timing(dirs[i]);
             }
-
-            if (par.rx2txValid[par.rx2txIdx])
+        }
+    }
+    else if (strncmp(command, "coalesce ", 9) == 0)
+    {
+        unsigned long usec;
+        int bytes = 0;
+        if (sscanf(command + 9, "%lu %d", &usec, &bytes) < 1 || usec > MAX_COALESCE_TIME || bytes < 0)
+        {
+            printf("BAD COALESCING (coalesce <usec, up to %d> [<bytes>], 0 for none)\n", MAX_COALESCE_TIME);
+        }
+        else
+        {
+            for (int i = 0; i < numDirs; i++)
+            {
+                dirs[i]->timing.coalesceTime = usec * PSEC_PER_USEC;
+                dirs[i]->timing.coalesceBytes = bytes;
+                print_timing(dirs[i]);
+            }
+        }
+    }
+    else if (strncmp(command, "baud ", 5) == 0)
+    {
+        unsigned long baud = 0;
+        if (sscanf(command + 5, "%lu", &baud) < 1 || baud < MIN_BAUDRATE || baud > MAX_BAUDRATE)
+        {
+            printf("UNSUPPORTED BAUD RATE: must be between %d and %d\n", MIN_BAUDRATE, MAX_BAUDRATE);
+        }
+        else
+        {
+            for (int i = 0; i < numDirs; i++)
+            {
+                set_baud_rate(dirs[i], baud);
+            }
+        }
+    }
+    else if (strncmp(command, "prop ", 5) == 0)
+    {
+        unsigned long propDelay;
+        if (sscanf(command + 5, "%lu", &propDelay) < 1 || propDelay > MAX_PROP_DELAY)
+        {
+            printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
+        }
+        else
+        {
+            for (int i = 0; i < numDirs; i++)
+            {
+                set_prop_delay(dirs[i], propDelay);
+            }
+        }
+    }
+    else if (strncmp(command, "rxbuf ", 6) == 0)
+    {
+        char *end;
+        long size = strtol(command + 6, &end, 10);
+        if (end == command + 6 || *end != '\0' || size < 0 || size > MAX_RX_BUFFER)
+        {
+            printf("BAD RECEIVER BUFFER SIZE (MUST BE BETWEEN 1 AND %d BYTES, 0 FOR UNLIMITED)\n", MAX_RX_BUFFER);
+        }
+        else
+        {
+            for (int i = 0; i < numDirs; i++)
             {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.rx2tx[par.rx2txIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdTx, par.rx2tx + par.rx2txIdx, 1);
+                dirs[i]->rxBuffer = size;
+                print_flow(dirs[i]);
             }
         }
+    }
+    else if (strncmp(command, "flow ", 5) == 0)
+    {
+        int flow = -1;
+        if (strcmp(command + 5, "none") == 0)
+        {
+            flow = FLOW_NONE;
+        }
+        else if (strcmp(command + 5, "rtscts") == 0)
+        {
+            flow = FLOW_RTSCTS;
+        }
 
-        if (par.logfile != NULL)  // Currently logging
+        if (flow < 0)
+        {
+            printf("BAD FLOW CONTROL (flow none | rtscts)\n");
+        }
+        else
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
+            for (int i = 0; i < numDirs; i++)
             {
-                sprintf(tx2rxRx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
+                // A sender held off resumes; the new flow control decides
+                // afresh
+                dirs[i]->flow = flow;
+                dirs[i]->holdOff = FALSE;
+                dirs[i]->stopped = FALSE;
+                dirs[i]->flowChange = -1;
+                print_flow(dirs[i]);
             }
-            else
+        }
+    }
+    else if (strcmp(command, "fault list") == 0)
+    {
+        for (int i = 0; i < numDirs; i++)
+        {
+            if (dirs[i]->numFaults == 0)
             {
-                memcpy(tx2rxRx, "  ", 3);
+                printf("%s: NO FAULT RULES\n", dirs[i]->name);
             }
-            if (par.rx2txValid[par.rx2txIdx])
+            for (int f = 0; f < dirs[i]->numFaults; f++)
             {
-                sprintf(rx2txRx, "%02hhX", par.rx2tx[par.rx2txIdx]);
+                print_fault(dirs[i], f);
             }
-            else
+        }
+    }
+    else if (strcmp(command, "fault clear") == 0)
+    {
+        for (int i = 0; i < numDirs; i++)
+        {
+            // A frame being held back still goes out once it ends
+            dirs[i]->numFaults = 0;
+            printf("%s FAULT RULES CLEARED\n", dirs[i]->name);
+        }
+    }
+    else if (strncmp(command, "fault ", 6) == 0)
+    {
+        struct FaultRule rule;
+        if (parse_fault(command + 6, &rule) != 0)
+        {
+            printf("BAD FAULT RULE (fault <set|ua|disc|rr|rej|i|any> [every] <n> "
+                   "drop | dup | delay <time> | corrupt <address|control|bcc1|data|bcc2>)\n");
+            return FALSE;
+        }
+        for (int i = 0; i < numDirs; i++)
+        {
+            struct Direction *dir = dirs[i];
+            if (dir->frame == NULL)
             {
-                memcpy(rx2txRx, "  ", 3);
+                dir->frame = malloc(MAX_STAGED_FRAME);
             }
+            if (dir->frame == NULL || dir->numFaults == MAX_FAULTS)
+            {
+                printf("%s: NO ROOM FOR MORE FAULT RULES (UP TO %d)\n", dir->name, MAX_FAULTS);
+                continue;
+            }
+            dir->faults[dir->numFaults++] = rule;
+            print_fault(dir, dir->numFaults - 1);
+        }
+    }
+    else if (strcmp(command, "stats") == 0)
+    {
+        for (int i = 0; i < numDirs; i++)
+        {
+            print_stats(dirs[i]);
+        }
+    }
+    else if (strncmp(command, "log ", 4) == 0)
+    {
+        startlog(command + 4);
+    }
+    else if (strcmp(command, "endlog") == 0)
+    {
+        endlog();
+        printf("NOT LOGGING\n");
+    }
+    else if (strncmp(command, "capture ", 8) == 0)
+    {
+        startcapture(command + 8);
+    }
+    else if (strcmp(command, "endcapture") == 0)
+    {
+        if (par.capture == NULL)
+        {
+            printf("NOT CAPTURING\n");
+        }
+        endcapture();
+    }
+    else if (strcmp(command, "quit") == 0)
+    {
+        for (int i = 0; i < numDirs; i++)
+        {
+            print_stats(dirs[i]);
+        }
+        endcapture();
+        printf("END OF THE PROGRAM\n");
+        return TRUE;
+    }
+    else if (strcmp(command, "help") == 0)
+    {
+        help();
+    }
+    else
+    {
+        printf("BAD COMMAND OR MISSING PARAMETERS\n");
+    }
+
+    return FALSE;
+}
+
+
+// Set up a link on the given devices, with the default line parameters
+// Returns 0 on success, -1 if the device names are too long.
+int init_link(int index, const char *txDevice, const char *rxDevice)
+{
+    struct Link *link = &par.links[index];
+    if (strlen(txDevice) >= MAX_PATH_SIZE || strlen(rxDevice) >= MAX_PATH_SIZE)
+    {
+        return -1;
+    }
+    strcpy(link->txDevice, txDevice);
+    strcpy(link->rxDevice, rxDevice);
+    if (par.numLinks > 1)
+    {
+        sprintf(link->prefix, "link%d ", index);
+    }
+    link->cableOn = TRUE;
+
+    struct Direction *dirs[2] = { &link->tx2rx, &link->rx2tx };
+    const char *names[2] = { "Tx->Rx", "Rx->Tx" };
+    for (int i = 0; i < 2; i++)
+    {
+        struct Direction *dir = dirs[i];
+        snprintf(dir->name, sizeof(dir->name), "%s%s", link->prefix, names[i]);
+        dir->link = link;
+        dir->interface = 2 * index + i;
+        dir->lineIdle = TRUE;
+        dir->baud = DEFAULT_BAUDRATE;
+        dir->byteTime = 10 * PSEC_PER_SEC / DEFAULT_BAUDRATE;
+        dir->flowChange = -1;
+        reset_stats(dir);
+    }
+    return 0;
+}
+
+
+// Show the command line options
+void usage(const char *program)
+{
+    printf("Usage: %s [options]\n"
+           "  -f <scenario> : run the timed commands of a scenario file\n"
+           "  -s <seed>     : seed of the error models\n"
+           "  -b <baud>     : baud rate\n"
+           "  -p <usec>     : propagation delay\n"
+           "  -e <ber>      : bit error rate\n"
+           "  -l <file>     : log transmitted data to file\n"
+           "  -c <file>     : capture delivered frames to a pcap-ng file\n"
+           "  -n <links>    : host this many links, link n on /dev/ttyS<10+2n> (Tx)\n"
+           "                  and /dev/ttyS<11+2n> (Rx); default 1\n"
+           "  -L <tx>,<rx>  : add a link on the given Tx and Rx devices (repeatable)\n"
+           "  -d <dir>      : create the numbered devices in dir instead of /dev, which\n"
+           "                  needs no root privileges (e.g. -d /tmp gives /tmp/ttyS10)\n"
+           "  -h            : show this help\n"
+           "\n"
+           "Scenario lines are commands, optionally preceded by t=<time> (s, ms or\n"
+           "us; seconds by default). Timed commands run that long after the first\n"
+           "byte enters the cable, the others when the cable starts. For example:\n"
+           "  seed 42\n"
+           "  t=2.5s off\n"
+           "  t=4s on\n"
+           "  t=10s ber 1e-4\n"
+           "  t=12s rx2tx prop 50000\n"
+           "  t=15s link 1 off\n",
+           program);
+}
 
-            if (*tx2rxTx == ' ' && *rx2txTx == ' ' && *tx2rxRx == ' ' && *rx2txRx == ' ')
+int main(int argc, char *argv[])
+{
+    // Options become commands run once the cable is ready, in order
+    char *initial[MAX_FLAG_COMMANDS];
+    int numInitial = 0;
+    const char *flagCommands[] = { ['s'] = "seed", ['b'] = "baud", ['p'] = "prop",
+                                   ['e'] = "ber", ['l'] = "log", ['c'] = "capture" };
+    int numNumbered = 0;
+    const char *deviceDir = DEFAULT_DEVICE_DIR;
+    char *given[MAX_LINKS];   // Devices of the links given with -L
+    int numGiven = 0;
+    int option;
+    while ((option = getopt(argc, argv, "f:s:b:p:e:l:c:n:L:d:h")) != -1)
+    {
+        if (option == 'n')
+        {
+            numNumbered = atoi(optarg);
+        }
+        else if (option == 'd')
+        {
+            deviceDir = optarg;
+        }
+        else if (option == 'L')
+        {
+            if (strchr(optarg, ',') == NULL || numGiven == MAX_LINKS)
             {
-                if (cableIdle == FALSE)
-                {
-                    fputs("---------------\n", par.logfile);
-                    cableIdle = TRUE;
-                }
+                usage(argv[0]);
+                exit(-1);
             }
-            else
+            given[numGiven++] = optarg;
+        }
+        else if (option == 'f')
+        {
+            if (load_scenario(optarg, initial, &numInitial) != 0)
             {
-                fprintf(par.logfile, "%s  %s | %s  %s\n", tx2rxTx, tx2rxRx, rx2txTx, rx2txRx);
-                cableIdle = FALSE;
+                exit(-1);
             }
         }
+        else if (option == 'h' || option == '?')
+        {
+            usage(argv[0]);
+            exit(option == 'h' ? 0 : -1);
+        }
+        else if (numInitial == MAX_FLAG_COMMANDS)
+        {
+            printf("TOO MANY OPTIONS (AT MOST %d, SCENARIO COMMANDS WITHOUT A TIME INCLUDED)\n", MAX_FLAG_COMMANDS);
+            exit(-1);
+        }
+        else
+        {
+            initial[numInitial] = malloc(strlen(flagCommands[option]) + strlen(optarg) + 2);
+            sprintf(initial[numInitial++], "%s %s", flagCommands[option], optarg);
+        }
+    }
 
-        // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
+    // Numbered links on the default devices first, then those given with -L
+    if (numNumbered + numGiven == 0)
+    {
+        numNumbered = 1;
+    }
+    if (numNumbered < 0 || numNumbered + numGiven > MAX_LINKS)
+    {
+        printf("BETWEEN 1 AND %d LINKS ARE SUPPORTED\n", MAX_LINKS);
+        exit(-1);
+    }
+    par.numLinks = numNumbered + numGiven;
+    for (int i = 0; i < par.numLinks; i++)
+    {
+        char txDevice[MAX_PATH_SIZE + 1];  // Too long names stay too long
+        char rxDevice[MAX_PATH_SIZE + 1];
+        if (i < numNumbered)
+        {
+            snprintf(txDevice, sizeof(txDevice), DEVICE_FORMAT, deviceDir, FIRST_DEVICE + 2 * i);
+            snprintf(rxDevice, sizeof(rxDevice), DEVICE_FORMAT, deviceDir, FIRST_DEVICE + 2 * i + 1);
+        }
+        else
+        {
+            char *comma = strchr(given[i - numNumbered], ',');
+            *comma = '\0';
+            snprintf(txDevice, sizeof(txDevice), "%s", given[i - numNumbered]);
+            snprintf(rxDevice, sizeof(rxDevice), "%s", comma + 1);
+        }
+        if (init_link(i, txDevice, rxDevice) != 0)
+        {
+            printf("DEVICE NAME TOO LONG: %s\n", i < numNumbered ? deviceDir : given[i - numNumbered]);
+            exit(-1);
+        }
+    }
+
+    for (int i = 0; i < par.numLinks; i++)
+    {
+        struct Link *link = &par.links[i];
+        link->tx2rx.inFd = open_pty(link->txDevice, &link->txSlave);
+        if (link->tx2rx.inFd < 0)
+        {
+            perror(link->txDevice);
+            exit(-1);
+        }
+        link->rx2tx.inFd = open_pty(link->rxDevice, &link->rxSlave);
+        if (link->rx2tx.inFd < 0)
+        {
+            perror(link->rxDevice);
+            exit(-1);
+        }
+        link->tx2rx.outFd = link->rx2tx.inFd;
+        link->rx2tx.outFd = link->tx2rx.inFd;
+        link->tx2rx.outSlave = link->rxSlave;
+        link->rx2tx.outSlave = link->txSlave;
+    }
+
+    help();
+
+    // Configure stdin to receive commands to this program
+    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
+    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+
+    char rxStdin[BUF_SIZE] = {0};
+    int stdinLength = 0;
+
+    int STOP = FALSE;
+
+    clock_gettime(CLOCK_MONOTONIC, &par.start);
+    reset_models();
+
+    set_rt_priority();
+
+    for (int i = 0; i < numInitial && STOP == FALSE; i++)
+    {
+        STOP = run_command(initial[i]);
+        free(initial[i]);
+    }
+
+    printf("\nCable ready\n\n");
+
+    // Sleep in epoll until input arrives, a command is typed or the timer
+    // fires for the next deadline. With nothing in flight the timer is
+    // disarmed, so an idle cable uses no CPU.
+    par.epollFd = epoll_create1(0);
+    par.timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (par.epollFd < 0 || par.timerFd < 0)
+    {
+        perror("Creating the epoll instance");
+        exit(-1);
+    }
+    // Events carry the direction whose input is ready, &par.timerFd for the
+    // timer and NULL for stdin
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &par.timerFd };
+    if (epoll_ctl(par.epollFd, EPOLL_CTL_ADD, par.timerFd, &event) < 0)
+    {
+        perror("epoll_ctl");
+        exit(-1);
+    }
+    for (int i = 0; i < 2 * par.numLinks; i++)
+    {
+        struct Direction *dir = i % 2 == 0 ? &par.links[i / 2].tx2rx : &par.links[i / 2].rx2tx;
+        event.data.ptr = dir;
+        if (epoll_ctl(par.epollFd, EPOLL_CTL_ADD, dir->inFd, &event) < 0)
         {
-            rxStdin[fromStdin - 1] = '\0';
+            perror("epoll_ctl");
+            exit(-1);
+        }
+        dir->watching = TRUE;
+    }
+    event.data.ptr = NULL;
+    if (epoll_ctl(par.epollFd, EPOLL_CTL_ADD, STDIN_FILENO, &event) < 0)
+    {
+        printf("STDIN IS NOT A TERMINAL OR PIPE, INTERACTIVE COMMANDS DISABLED\n");
+    }
 
-            if (strcmp(rxStdin, "off") == 0)
+    while (STOP == FALSE)
+    {
+        struct epoll_event events[2 * MAX_LINKS + 2];
+        int numEvents = epoll_wait(par.epollFd, events, 2 * MAX_LINKS + 2, -1);
+        long long now = now_ps();
+        int stdinReady = FALSE;
+
+        for (int i = 0; i < numEvents; i++)
+        {
+            void *source = events[i].data.ptr;
+            if (source == &par.timerFd)
             {
-                printf("CONNECTION OFF\n");
-                if (par.cableOn && par.logfile != NULL)
-                {
-                    fputs("CABLE OFF\n", par.logfile);
-                }
-                par.cableOn = FALSE;
+                uint64_t expirations;
+                read(par.timerFd, &expirations, sizeof(expirations));
             }
-            else if (strcmp(rxStdin, "on") == 0)
+            else if (source == NULL)
             {
-                printf("CONNECTION ON\n");
-                par.cableOn = TRUE;
+                stdinReady = TRUE;
             }
-            else if (strncmp(rxStdin, "ber ", 4) == 0)
+            else
             {
-                double ber;
-                sscanf(rxStdin + 4, "%lf", &ber);
-                // Compute pow(1 - ber, 8) without libm
-                double acc = 1 - ber;
-                acc *= acc;   // Squared
-                acc *= acc;   // To the fourth
-                acc *= acc;   // To the eightth
-                par.byteER = 1.0 - acc;
-                //printf("Byte Error Rate is %lf\n", par.byteER);
-                if (ber >= 0.0 && ber < 1.0)
-                {
-                    printf("BER SET TO %lf\n", ber);
-                    if (ber > 0.01)
-                    {
-                        printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
-                    }
-                }
-                else
-                {
-                    printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)", ber);
-                }
+                accept_burst(source, now);
             }
-            else if (strncmp(rxStdin, "baud ", 5) == 0)
+        }
+
+        for (int i = 0; i < par.numLinks; i++)
+        {
+            expire_frame(&par.links[i].tx2rx, now);
+            expire_frame(&par.links[i].rx2tx, now);
+            release_due(&par.links[i].tx2rx, now);
+            release_due(&par.links[i].rx2tx, now);
+            update_flow(&par.links[i].tx2rx, now);
+            update_flow(&par.links[i].rx2tx, now);
+        }
+
+        // Run the scenario actions that are due
+        while (par.nextAction < par.numActions && par.origin >= 0
+               && par.origin + par.actions[par.nextAction].time <= now && STOP == FALSE)
+        {
+            struct Action *action = &par.actions[par.nextAction++];
+            printf("t=%.3fs: %s\n", (double) action->time / PSEC_PER_SEC, action->command);
+            STOP = run_command(action->command);
+        }
+
+        // Read commands from STDIN to control the cable mode, one per line
+        int fromStdin = stdinReady ? read(STDIN_FILENO, rxStdin + stdinLength, BUF_SIZE - 1 - stdinLength) : -1;
+        if (fromStdin == 0)
+        {
+            // End of input: stop watching it
+            epoll_ctl(par.epollFd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+        }
+        if (fromStdin > 0)
+        {
+            stdinLength += fromStdin;
+            rxStdin[stdinLength] = '\0';
+            char *line = rxStdin;
+            char *end;
+            while ((end = strchr(line, '\n')) != NULL && STOP == FALSE)
             {
-                unsigned long baud = 0;
-                sscanf(rxStdin + 5, "%lu", &baud);
-                switch (baud) {
-                    case 1200:
-                    case 1800:
-                    case 2400:
-                    case 4800:
-                    case 9600:
-                    case 19200:
-                    case 38400:
-                    case 57600:
-                    case 115200:
-                        set_baud_rate(baud);
-                        break;
-                    default:
-                        printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600 or 115200\n");
-                }
+                *end = '\0';
+                STOP = run_command(line);
+                line = end + 1;
             }
-            else if (strncmp(rxStdin, "prop ", 5) == 0)
+            stdinLength -= line - rxStdin;
+            if (stdinLength == BUF_SIZE - 1)
             {
-                unsigned long propDelay;
-                if (sscanf(rxStdin + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
-                {
-                    printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
-                }
-                else
-                {
-                    par.propDelay = propDelay;
-                    init_ring_buffers();
-                }
+                // Line too long to be a command
+                stdinLength = 0;
             }
-            else if (strncmp(rxStdin, "log ", 4) == 0)
+            memmove(rxStdin, line, stdinLength);
+        }
+
+        // Next deadline: the first byte due, the moment a direction that is
+        // ahead of the line can take input again, the end of the wait for
+        // a frame held back, a flow control change, or the next scenario
+        // action. Bytes due within a slice of each other are released
+        // together.
+        long long wakeUp = -1;
+        for (int i = 0; i < 2 * par.numLinks; i++)
+        {
+            struct Direction *dir = i % 2 == 0 ? &par.links[i / 2].tx2rx : &par.links[i / 2].rx2tx;
+            watch_input(dir, can_accept(dir, now));
+            long long when = next_due(dir);
+            if (!dir->watching && dir->lineFree - READ_AHEAD_PSEC > now
+                && (when < 0 || dir->lineFree - READ_AHEAD_PSEC < when))
             {
-                startlog(rxStdin + 4);
+                when = dir->lineFree - READ_AHEAD_PSEC;
             }
-            else if (strcmp(rxStdin, "endlog") == 0)
+            if (dir->frameLength > 0 && (when < 0 || dir->frameRead + FRAME_TIMEOUT_PSEC < when))
             {
-                endlog();
-                printf("NOT LOGGING\n");
+                when = dir->frameRead + FRAME_TIMEOUT_PSEC;
             }
-            else if (strcmp(rxStdin, "quit") == 0)
+            if (dir->flowChange >= 0 && (when < 0 || dir->flowChange < when))
             {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
+                when = dir->flowChange;
             }
-            else if (strcmp(rxStdin, "help") == 0) {
-                help();
+            if (dir->holdOff && (when < 0 || now + FLOW_POLL_PSEC < when))
+            {
+                // Nothing tells when the receiving program reads
+                when = now + FLOW_POLL_PSEC;
             }
-            else {
-                printf("BAD COMMAND OR MISSING PARAMETERS\n");
+            if (when >= 0 && (wakeUp < 0 || when < wakeUp))
+            {
+                wakeUp = when;
             }
         }
-
-        if (skipWait == FALSE) {
-            nanosleep(&nextWait, NULL);
+        if (par.nextAction < par.numActions && par.origin >= 0
+            && (wakeUp < 0 || par.origin + par.actions[par.nextAction].time < wakeUp))
+        {
+            wakeUp = par.origin + par.actions[par.nextAction].time;
         }
+        if (wakeUp >= 0 && wakeUp < now + SLICE_PSEC)
+        {
+            wakeUp = now + SLICE_PSEC;
+        }
+        set_timer(wakeUp);
     }
 
-    // Restore the old port settings
-    if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
-    {
-        perror("tcsetattr");
-        exit(-1);
-    }
-
-    if (tcsetattr(fdTx, TCSANOW, &oldtioTx) == -1)
+    // Remove the ports
+    for (int i = 0; i < par.numLinks; i++)
     {
-        perror("tcsetattr");
-        exit(-1);
+        struct Link *link = &par.links[i];
+        unlink(link->txDevice);
+        unlink(link->rxDevice);
+        close(link->tx2rx.inFd);
+        close(link->rx2tx.inFd);
+        close(link->txSlave);
+        close(link->rxSlave);
     }
 
-    close(fdTx);
-    close(fdRx);
-
-    system("killall socat");
-
     return 0;
 }
@@ -0,0 +1,37 @@
+// Checkpoints of interrupted receptions, used to resume them.
+
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <stdint.h>
+
+#include "digest.h"
+
+#define CHECKPOINT_NAME_SIZE 256
+
+// Identity of the file being received and how much of it is safely on disk.
+// Stored next to the received file, in "<filename>.checkpoint".
+typedef struct
+{
+    char name[CHECKPOINT_NAME_SIZE];  // Name sent by the transmitter
+    uint64_t size;
+    int64_t mtime;
+    uint64_t offset;  // Bytes received contiguously and synced to disk
+    Digest digest;    // Digest of those bytes, so it need not be read back
+} Checkpoint;
+
+// Load the checkpoint of filename.
+// Returns 0 on success or -1 if there is none.
+int checkpointLoad(const char *filename, Checkpoint *checkpoint);
+
+// Atomically replace the checkpoint of filename.
+// Returns 0 on success or -1 on error.
+int checkpointSave(const char *filename, const Checkpoint *checkpoint);
+
+// Remove the checkpoint of filename, once it is fully received.
+void checkpointRemove(const char *filename);
+
+// Returns TRUE if both checkpoints describe the same version of a file.
+int checkpointSameFile(const Checkpoint *a, const Checkpoint *b);
+
+#endif // _CHECKPOINT_H_
@@ -0,0 +1,79 @@
+// Persistent content-addressed store of received chunks, shared by every
+// file received into the same directory. It is off unless the user turns it
+// on with a size limit (see chunkStoreLimit).
+//
+// Chunks are identified by XXH64, which is not a cryptographic hash: anyone
+// who can write into the store can plant a chunk that takes the place of
+// another. The store is only meant for directories that only the user
+// writes to, and is created readable by the user alone.
+
+#ifndef _CHUNK_STORE_H_
+#define _CHUNK_STORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHUNK_STORE_NAME ".chunks"
+
+// Environment variable with the size limit of the stores in MiB
+#define CHUNK_STORE_ENV "RCOM_CHUNK_STORE"
+
+// Kept in "<directory>/.chunks/": "data", a ring of at most limit bytes the
+// chunks are appended to, the newest overwriting the oldest, and "index", a
+// memory-mapped open-addressing hash table from chunk hash to position.
+typedef struct
+{
+    char magic[8];
+    uint64_t capacity;  // Number of buckets, a power of 2
+    uint64_t count;     // Buckets in use, including those of overwritten chunks
+    uint64_t limit;     // Size of the data ring
+    uint64_t head;      // Bytes ever appended to the ring, it holds the last limit
+} ChunkStoreHeader;
+
+typedef struct
+{
+    uint64_t hash;
+    uint64_t position;  // Value of head when the chunk was appended
+    uint32_t length;    // 0 if the chunk turned out to be damaged
+    uint32_t used;      // 0 for empty buckets
+} ChunkStoreEntry;
+
+typedef struct
+{
+    char path[512];
+    int dataFd;
+    int indexFd;
+    void *map;
+    size_t mapSize;
+    ChunkStoreHeader *header;
+    ChunkStoreEntry *entries;
+} ChunkStore;
+
+// Size limit of the stores, in bytes, set in MiB by the CHUNK_STORE_ENV
+// environment variable.
+// Returns 0 if it is not set, or not a positive number: the stores are off.
+uint64_t chunkStoreLimit(void);
+
+// Open (or create) the store of directory, holding up to limit bytes of
+// chunks. A store created with another limit starts over empty.
+// Returns 0 on success or -1 on error.
+int chunkStoreOpen(ChunkStore *store, const char *directory, uint64_t limit);
+
+// Look up a chunk by hash.
+// Returns its entry, or NULL if the store does not have it (anymore).
+const ChunkStoreEntry *chunkStoreFind(const ChunkStore *store, uint64_t hash);
+
+// Read a chunk into buffer (entry->length bytes) and check its hash. A damaged
+// chunk is forgotten.
+// Returns 0 on success or -1 on error.
+int chunkStoreRead(ChunkStore *store, const ChunkStoreEntry *entry, unsigned char *buffer);
+
+// Add a chunk, unless the store already has it. The oldest chunks are
+// overwritten to make room for it.
+// Returns 0 on success or -1 on error.
+int chunkStoreAdd(ChunkStore *store, uint64_t hash, const unsigned char *data, uint32_t length);
+
+// Sync the chunks and the index to disk and close the store.
+void chunkStoreClose(ChunkStore *store);
+
+#endif // _CHUNK_STORE_H_
@@ -0,0 +1,23 @@
+// Content-defined chunking, so identical data is split into identical chunks
+// wherever it sits in a file.
+
+#ifndef _CHUNKER_H_
+#define _CHUNKER_H_
+
+#include <stdint.h>
+
+#define CHUNK_MIN_SIZE (2 * 1024)
+#define CHUNK_MAX_SIZE (64 * 1024)
+#define CHUNK_AVERAGE_BITS 13  // 8 KiB on average
+
+typedef struct
+{
+    uint64_t hash;  // XXH64 of the chunk
+    uint32_t length;
+} Chunk;
+
+// Split size bytes into chunks, stored in *chunks (to be freed by the caller).
+// Returns the number of chunks or -1 on error.
+int64_t chunkSplit(const unsigned char *data, uint64_t size, Chunk **chunks);
+
+#endif // _CHUNKER_H_
@@ -0,0 +1,61 @@
+// Block signatures and matching for delta transfers.
+//
+// The receiver splits the copy of the file it already has into blocks and
+// sends a weak rolling checksum and a strong hash of each one. The sender
+// slides a window over the new file looking for those blocks, and only sends
+// the bytes in between; matched blocks are copied by the receiver.
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <stdint.h>
+
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK (64 * 1024)
+
+// Signature entry on the wire: weak checksum (4 bytes) and strong hash (8 bytes)
+#define DELTA_SIGNATURE_SIZE 12
+
+typedef struct
+{
+    uint32_t weak;
+    uint64_t strong;
+} DeltaSignature;
+
+// Signatures of the receiver's blocks, looked up by weak checksum in an
+// open-addressing hash table.
+typedef struct
+{
+    int blockSize;
+    uint32_t count;
+    DeltaSignature *blocks;  // In block order
+    int64_t *table;          // Block indexes, -1 for empty buckets
+    uint32_t tableMask;
+} DeltaIndex;
+
+// Block size used for a file of the given size.
+int deltaBlockSize(uint64_t fileSize);
+
+// Weak checksum of a block.
+uint32_t deltaWeak(const unsigned char *data, int length);
+
+// Slide the window of a weak checksum one byte: out leaves, in enters.
+uint32_t deltaRoll(uint32_t weak, unsigned char out, unsigned char in, int blockSize);
+
+// Strong hash of a block.
+uint64_t deltaStrong(const unsigned char *data, int length);
+
+// Allocate an index for count blocks of blockSize bytes.
+// Returns 0 on success or -1 on error.
+int deltaIndexInit(DeltaIndex *index, int blockSize, uint32_t count);
+
+// Add the signature of block number block.
+void deltaIndexAdd(DeltaIndex *index, uint32_t block, uint32_t weak, uint64_t strong);
+
+// Look for a block matching the blockSize bytes at window, with weak checksum weak.
+// Returns the block number or -1 if there is none.
+int64_t deltaIndexFind(const DeltaIndex *index, uint32_t weak, const unsigned char *window);
+
+void deltaIndexFree(DeltaIndex *index);
+
+#endif // _DELTA_H_
@@ -0,0 +1,27 @@
+// Streaming file digest (XXH64), computed while the file is read or written.
+
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIGEST_STRIPE 32
+
+typedef struct
+{
+    uint64_t acc[4];
+    uint64_t total;  // Bytes hashed so far
+    unsigned char buffer[DIGEST_STRIPE];  // Tail not yet folded into acc
+    int buffered;
+} Digest;
+
+void digestInit(Digest *digest);
+
+// Hash the next length bytes of the file.
+void digestUpdate(Digest *digest, const void *data, size_t length);
+
+// Digest of everything hashed so far. More data can still be added.
+uint64_t digestValue(const Digest *digest);
+
+#endif // _DIGEST_H_
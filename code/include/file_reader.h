@@ -0,0 +1,46 @@
+// Sequential reader for the file being transmitted.
+
+#ifndef _FILE_READER_H_
+#define _FILE_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The file is memory-mapped when it fits in the address space, so payloads are
+// encoded straight from the page cache. Otherwise it is streamed through a
+// bounded read-ahead buffer.
+typedef struct
+{
+    int fd;
+    uint64_t size;
+    int64_t mtime;           // Modification time, identifies the file version
+    uint64_t offset;         // Offset of the next byte to be returned
+    unsigned char *map;      // NULL when streaming
+    unsigned char *readAhead;
+    size_t readAheadLength;
+    size_t readAheadOffset;
+} FileReader;
+
+// Open filename for reading.
+// Returns 0 on success or -1 on error.
+int fileReaderOpen(FileReader *reader, const char *filename);
+
+// Continue reading from offset (e.g. to resume a transfer).
+// Returns 0 on success or -1 on error.
+int fileReaderSeek(FileReader *reader, uint64_t offset);
+
+// Get the next chunk of the file, at most maxBytes long. The chunk stays valid
+// until the next call.
+// Returns a pointer to the chunk (length in *length) or NULL on error or at the
+// end of the file.
+const unsigned char *fileReaderNext(FileReader *reader, int maxBytes, int *length);
+
+// Copy the next bytes of the file, at most maxBytes, into buffer. When the
+// file is streamed they are read straight into buffer.
+// Returns the number of bytes copied, 0 at the end of the file or -1 on error.
+int fileReaderRead(FileReader *reader, unsigned char *buffer, int maxBytes);
+
+// Release the mapping / read-ahead buffer and close the file.
+void fileReaderClose(FileReader *reader);
+
+#endif // _FILE_READER_H_
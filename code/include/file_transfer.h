@@ -0,0 +1,24 @@
+// File transfer over an open link.
+
+#ifndef _FILE_TRANSFER_H_
+#define _FILE_TRANSFER_H_
+
+// Size of the data carried by each data packet
+#define PACKET_SIZE 256
+
+// Send filename, announced to the receiver as name, resuming where the
+// receiver left off.
+// Returns 0 on success, 1 if the link was lost, or -1 on other errors.
+int sendFile(const char *filename, const char *name);
+
+// Receive a file into filename, starting from its START packet (already read
+// into request, a MAX_PAYLOAD_SIZE buffer, *requestSize bytes long).
+// A transfer interrupted earlier (in this run or a previous one, as recorded
+// by its checkpoint) resumes where it stopped. It stops if the sender aborts
+// it, or sends another request instead (such as the START of another file),
+// which is then left in request and *requestSize.
+// Returns 0 on success, 1 if the peer disconnected before the end, 2 if
+// another request arrived, or -1 on error.
+int receiveFile(const char *filename, unsigned char *request, int *requestSize);
+
+#endif // _FILE_TRANSFER_H_
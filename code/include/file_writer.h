@@ -0,0 +1,59 @@
+// Write-behind writer for the file being received.
+
+#ifndef _FILE_WRITER_H_
+#define _FILE_WRITER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "checkpoint.h"
+#include "link_layer.h"
+#include "spsc_ring.h"
+
+#define FILE_WRITER_SLOTS 64 // Power of two (ring capacity)
+
+typedef struct
+{
+    unsigned char data[MAX_PAYLOAD_SIZE];
+    int start;        // Offset of the payload inside data
+    int length;       // Payload length
+    uint64_t offset;  // Destination offset in the file
+} FileWriterSlot;
+
+// Payloads are handed to a writer thread through a lock-free single-producer
+// single-consumer ring and written with pwrite(), so the link never waits for
+// storage unless the whole ring is full.
+typedef struct
+{
+    int fd;
+    pthread_t thread;
+    FileWriterSlot *slots;
+    SpscRing ring;
+    int current;       // Slot being filled by the link thread (-1 if none)
+    uint64_t end;      // End of the highest byte written
+    int error;
+    const char *filename;
+    Checkpoint checkpoint;  // Updated after every sync, digest as data is written
+} FileWriter;
+
+// Open filename to receive the file described by checkpoint, preallocating
+// its size, and start the writer thread. Writing resumes at
+// checkpoint->offset, continuing checkpoint->digest; the file is truncated
+// if it is 0. The checkpoint is saved each time the data is synced to disk.
+// Returns 0 on success or -1 on error.
+int fileWriterOpen(FileWriter *writer, const char *filename, const Checkpoint *checkpoint);
+
+// Get the buffer of the next free slot (MAX_PAYLOAD_SIZE bytes), waiting while
+// the ring is full. The same buffer is returned until it is committed.
+unsigned char *fileWriterBuffer(FileWriter *writer);
+
+// Queue length bytes starting at data[start] of the current slot to be
+// written at the given file offset.
+void fileWriterCommit(FileWriter *writer, int start, int length, uint64_t offset);
+
+// Write everything still queued, sync it to disk and save the checkpoint, trim
+// the preallocated space that was not written and close the file.
+// Returns 0 on success or -1 if any write or sync failed.
+int fileWriterClose(FileWriter *writer);
+
+#endif // _FILE_WRITER_H_
@@ -0,0 +1,84 @@
+// Link-layer frame format, frame encoder and table-driven frame parser.
+
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+#include <sys/uio.h>
+
+// Frame delimiters and byte stuffing
+#define FLAG 0x7E
+#define ESC 0x7D
+#define FLAG_REPLACEMENT 0x5E
+#define ESCAPE_REPLACEMENT 0x5D
+
+// Address field
+#define ADDRESS_TM 0x03
+#define ADDRESS_RC 0x01
+
+// Control field
+#define CONTROL_SET 0x03
+#define CONTROL_UA 0x07
+#define DISC 0x0B
+#define RR_0 0xAA
+#define RR_1 0xAB
+#define REJ_0 0x54
+#define REJ_1 0x55
+
+// Worst-case size of an I-frame carrying payloadSize bytes (every payload
+// byte and BCC2 stuffed).
+#define FRAME_MAX_SIZE(payloadSize) (2 * ((payloadSize) + 1) + 5)
+
+typedef enum
+{
+    FP_START,
+    FP_FLAG_RCV,
+    FP_A_RCV,
+    FP_C_RCV,
+    FP_BCC_OK,
+    FP_READING_DATA,
+    FP_DATA_FOUND_ESC,
+    FP_NUM_STATES
+} FrameParserState;
+
+// Frame produced by the parser. The payload of I-frames is stored in the
+// buffer given to frameParserInit() and stays valid until the next feed.
+typedef struct
+{
+    unsigned char address;
+    unsigned char control;
+    int length;  // Payload length without BCC2 (0 for supervision frames)
+    int bcc2Ok;  // TRUE if BCC2 matches (always TRUE for supervision frames)
+} Frame;
+
+typedef struct
+{
+    unsigned char state;
+    unsigned char address;
+    unsigned char control;
+    unsigned char bcc1;  // Expected BCC1 for the current header
+    unsigned char bcc2;  // Running XOR of the payload, BCC2 included
+    unsigned char *data;
+    int capacity;
+    int length;
+} FrameParser;
+
+// Build a byte-stuffed I-frame whose payload is the concatenation of
+// numSegments segments, reading them in place.
+// frame must hold FRAME_MAX_SIZE(payload size) bytes.
+// Returns the frame size.
+int frameEncode(unsigned char *frame, unsigned char address, unsigned char control,
+                const struct iovec *segments, int numSegments);
+
+// Initialize the parser to store I-frame payloads (BCC2 included) in buffer.
+void frameParserInit(FrameParser *parser, unsigned char *buffer, int capacity);
+
+// Discard any partially received frame and hunt for the next FLAG.
+void frameParserReset(FrameParser *parser);
+
+// Feed up to numBytes bytes to the parser, stopping right after the first
+// complete frame. *consumed is set to the number of bytes used.
+// Returns 1 if a frame was completed (stored in *frame), 0 otherwise.
+int frameParserFeed(FrameParser *parser, const unsigned char *bytes, int numBytes,
+                    int *consumed, Frame *frame);
+
+#endif // _FRAME_H_
@@ -0,0 +1,42 @@
+// Asynchronous link layer API, kept out of the link layer interface, which
+// must not be changed. It serves the link opened by llopen().
+
+#ifndef _LINK_LAYER_ASYNC_H_
+#define _LINK_LAYER_ASYNC_H_
+
+#include "link_layer.h"
+
+// Requests are queued and served in order by llpoll(), which runs their
+// callbacks. Do not mix with the blocking calls of link_layer.h while
+// requests are pending. llclose() drops the requests still queued without
+// running their callbacks, and closes the descriptor given by llfd().
+//
+// Completion callback: result is the same a blocking call would return.
+typedef void (*LlCallback)(void *context, int result);
+
+// Maximum number of requests of each kind waiting at a time
+#define LL_ASYNC_QUEUE_SIZE 32
+
+// Queue buf (copied) to be sent; callback gets bufSize once the peer
+// acknowledges it, or -1 if the link is lost.
+// Return "0" on success or "-1" if the queue is full or bufSize is too large.
+int llwrite_async(const unsigned char *buf, int bufSize, LlCallback callback, void *context);
+
+// Queue a read into packet (MAX_PAYLOAD_SIZE bytes, must stay valid until the
+// callback); callback gets the packet size, 0 if the peer disconnected, or
+// -1 if the link is lost. Frames from the peer are only acknowledged once a
+// read is waiting for them.
+// Return "0" on success or "-1" if the queue is full.
+int llread_async(unsigned char *packet, LlCallback callback, void *context);
+
+// Serve the queued requests for up to timeoutMs milliseconds (-1: until a
+// callback runs, 0: only what is ready now), running the callbacks.
+// Return the number of callbacks run, or "-1" on error.
+int llpoll(int timeoutMs);
+
+// Descriptor that becomes readable when llpoll() has work to do, to add to an
+// external poll / epoll loop.
+// Return the descriptor, or "-1" on error.
+int llfd(void);
+
+#endif // _LINK_LAYER_ASYNC_H_
@@ -0,0 +1,47 @@
+// Link layer extensions, kept out of the link layer interface, which must
+// not be changed.
+
+#ifndef _LINK_LAYER_EXT_H_
+#define _LINK_LAYER_EXT_H_
+
+#include <sys/uio.h>
+
+#include "link_layer.h"
+
+// Worst-case size of an encoded frame carrying MAX_PAYLOAD_SIZE bytes.
+#define MAX_FRAME_SIZE (2 * (MAX_PAYLOAD_SIZE + 1) + 5)
+
+// Send the concatenation of iovCount buffers as a single frame, reading them
+// in place (no intermediate packet buffer).
+// Return number of chars written, or "-1" on error.
+int llwritev(const struct iovec *iov, int iovCount);
+
+// Encode the concatenation of iovCount buffers into frame (MAX_FRAME_SIZE
+// bytes), ahead of sending it with llwriteframe(). Safe to call from another
+// thread while the link is busy.
+// Return the frame size, or "-1" on error.
+int llencode(const struct iovec *iov, int iovCount, unsigned char *frame);
+
+// Send a frame built by llencode(), stamping it with the current sequence
+// number, and wait for its acknowledgement.
+// Return the frame size, or "-1" on error.
+int llwriteframe(unsigned char *frame, int frameSize);
+
+// llread() works in both roles: frames rejected because of errors are waited
+// for again, duplicates are acknowledged and dropped. The transmitter gives
+// up after nRetransmissions timeouts without a frame. Besides the sizes
+// given in link_layer.h, llread() returns "0" if the peer disconnected.
+
+// An I-frame the peer sends while llwrite() waits for its acknowledgement
+// (both sides sending at once) is accepted and returned by the next llread().
+// Only one is kept, later ones are left for the peer to retransmit.
+// Return "1" if such a packet is waiting, "0" otherwise.
+int llpending(void);
+
+// Receiver, after llread() returned "0": answer the transmitter's DISC as
+// llclose() would, but keep the port open and wait for the transmitter to
+// connect again (its llopen()).
+// Return "1" on success, or "-1" on error.
+int llreopen(void);
+
+#endif // _LINK_LAYER_EXT_H_
@@ -0,0 +1,272 @@
+// C++20 wrapper of the link layer: RAII session, spans and coroutine
+// awaitables over the asynchronous API.
+
+#ifndef _LINK_SESSION_HPP_
+#define _LINK_SESSION_HPP_
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// The link layer headers are plain C, without linkage guards
+extern "C" {
+#include "link_layer_async.h"
+#include "link_layer_ext.h"
+}
+
+namespace rcom {
+
+enum class Role { Transmitter, Receiver };
+
+// Thrown when the link cannot be opened or is lost.
+class LinkError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+namespace detail {
+
+// The link layer keeps its state in globals, so one session at a time; a
+// closed session resets it and another one can be opened
+inline std::atomic<bool> sessionOpen{false};
+
+// Coroutines whose operation completed, resumed by poll() once llpoll()
+// returned: a coroutine may close the session or start another operation,
+// which must not happen while llpoll() is still serving the link
+inline std::vector<std::coroutine_handle<>> readyHandles;
+
+// Completion shared by the awaitables: stores the result and queues the
+// coroutine to be resumed
+struct Completion {
+    std::coroutine_handle<> handle;
+    int result = -1;
+
+    static void callback(void *context, int result) {
+        auto *completion = static_cast<Completion *>(context);
+        completion->result = result;
+        readyHandles.push_back(completion->handle);
+    }
+};
+
+} // namespace detail
+
+// Connection opened by the constructor and closed by the destructor. The
+// role is a template parameter: the transmitter opens the connection and
+// gives up on reads after the retransmission timeouts, the receiver waits
+// for the transmitter indefinitely and, only in that role, can wait for it
+// to connect again after it disconnected (wait_reconnect()).
+template <Role R>
+class LinkSession {
+public:
+    static constexpr LinkLayerRole linkRole = R == Role::Transmitter ? LlTx : LlRx;
+    static constexpr std::size_t maxPayload = MAX_PAYLOAD_SIZE;
+
+    LinkSession(std::string_view serialPort, int baudRate, int retransmissions = 3, int timeout = 4) {
+        if (serialPort.size() >= sizeof(LinkLayer{}.serialPort)) {
+            throw LinkError("serial port name too long");
+        }
+        if (detail::sessionOpen.exchange(true)) {
+            throw LinkError("a link session is already open");
+        }
+
+        LinkLayer parameters{};
+        serialPort.copy(parameters.serialPort, serialPort.size());
+        parameters.role = linkRole;
+        parameters.baudRate = baudRate;
+        parameters.nRetransmissions = retransmissions;
+        parameters.timeout = timeout;
+
+        if (llopen(parameters) < 0) {
+            detail::sessionOpen = false;
+            if constexpr (R == Role::Transmitter) {
+                throw LinkError("no answer from the receiver");
+            }
+            else {
+                throw LinkError("cannot open the serial port");
+            }
+        }
+        open_ = true;
+    }
+
+    LinkSession(LinkSession &&other) noexcept : open_(std::exchange(other.open_, false)),
+                                                showStatistics_(other.showStatistics_) {}
+
+    LinkSession &operator=(LinkSession &&other) noexcept {
+        if (this != &other) {
+            close();
+            open_ = std::exchange(other.open_, false);
+            showStatistics_ = other.showStatistics_;
+        }
+        return *this;
+    }
+
+    LinkSession(const LinkSession &) = delete;
+    LinkSession &operator=(const LinkSession &) = delete;
+
+    ~LinkSession() { close(); }
+
+    void showStatistics(bool show) { showStatistics_ = show; }
+
+    // Close the connection now instead of in the destructor.
+    // Returns false if the peer did not answer.
+    bool close() {
+        if (!open_) {
+            return true;
+        }
+        open_ = false;
+        int result = llclose(showStatistics_);
+        detail::sessionOpen = false;
+        return result >= 0;
+    }
+
+    // Receiver only: once a receive returned 0 (the transmitter disconnected),
+    // answer its DISC but keep the port open, and wait for it to connect
+    // again. No asynchronous operation may be pending.
+    void wait_reconnect()
+        requires(R == Role::Receiver)
+    {
+        if (llreopen() < 0) {
+            throw LinkError("the transmitter has not disconnected");
+        }
+    }
+
+    // Send data as one frame, encoded straight from the span, and wait for
+    // its acknowledgement.
+    std::size_t send(std::span<const std::byte> data) {
+        checkSize(data.size());
+        int result = llwrite(bytes(data), static_cast<int>(data.size()));
+        if (result < 0) {
+            throw LinkError("link lost while sending");
+        }
+        return result;
+    }
+
+    // Receive the next packet straight into buffer (at least maxPayload bytes).
+    // Returns its size, or 0 if the peer disconnected.
+    std::size_t receive_into(std::span<std::byte> buffer) {
+        checkBuffer(buffer.size());
+        int result = llread(bytes(buffer));
+        if (result < 0) {
+            throw LinkError("link lost while receiving");
+        }
+        return result;
+    }
+
+    // co_await session.async_send(data): resumes with the size sent once
+    // the peer acknowledges it. Coroutines are resumed from poll().
+    auto async_send(std::span<const std::byte> data) {
+        checkSize(data.size());
+
+        struct Awaitable {
+            std::span<const std::byte> data;
+            detail::Completion completion;
+
+            bool await_ready() const noexcept { return false; }
+
+            bool await_suspend(std::coroutine_handle<> handle) {
+                completion.handle = handle;
+                // The frame is encoded right away, data is not used afterwards
+                if (llwrite_async(bytes(data), static_cast<int>(data.size()), detail::Completion::callback,
+                                  &completion) < 0) {
+                    completion.result = -1;
+                    return false;
+                }
+                return true;
+            }
+
+            std::size_t await_resume() const {
+                if (completion.result < 0) {
+                    throw LinkError("link lost while sending");
+                }
+                return completion.result;
+            }
+        };
+        return Awaitable{data, {}};
+    }
+
+    // co_await session.async_receive(buffer): resumes with the packet size,
+    // or 0 if the peer disconnected. buffer must outlive the operation.
+    auto async_receive(std::span<std::byte> buffer) {
+        checkBuffer(buffer.size());
+
+        struct Awaitable {
+            std::span<std::byte> buffer;
+            detail::Completion completion;
+
+            bool await_ready() const noexcept { return false; }
+
+            bool await_suspend(std::coroutine_handle<> handle) {
+                completion.handle = handle;
+                if (llread_async(bytes(buffer), detail::Completion::callback, &completion) < 0) {
+                    completion.result = -1;
+                    return false;
+                }
+                return true;
+            }
+
+            std::size_t await_resume() const {
+                if (completion.result < 0) {
+                    throw LinkError("link lost while receiving");
+                }
+                return completion.result;
+            }
+        };
+        return Awaitable{buffer, {}};
+    }
+
+    // Serve pending asynchronous operations, then resume the coroutines of
+    // those that completed.
+    // Returns the number of operations completed.
+    int poll(int timeoutMs = -1) {
+        int result = llpoll(timeoutMs);
+        std::vector<std::coroutine_handle<>> ready;
+        ready.swap(detail::readyHandles);
+        for (auto handle : ready) {
+            handle.resume();
+        }
+        if (result < 0) {
+            throw LinkError("poll failed");
+        }
+        return result;
+    }
+
+    // Descriptor to watch in an external event loop; call poll(0) when it
+    // becomes readable.
+    int fd() const { return llfd(); }
+
+private:
+    bool open_ = false;
+    bool showStatistics_ = false;
+
+    static const unsigned char *bytes(std::span<const std::byte> data) {
+        return reinterpret_cast<const unsigned char *>(data.data());
+    }
+
+    static unsigned char *bytes(std::span<std::byte> data) {
+        return reinterpret_cast<unsigned char *>(data.data());
+    }
+
+    static void checkSize(std::size_t size) {
+        if (size > maxPayload) {
+            throw std::length_error("packet larger than MAX_PAYLOAD_SIZE");
+        }
+    }
+
+    static void checkBuffer(std::size_t size) {
+        if (size < maxPayload) {
+            throw std::length_error("receive buffer smaller than MAX_PAYLOAD_SIZE");
+        }
+    }
+};
+
+using TransmitterSession = LinkSession<Role::Transmitter>;
+using ReceiverSession = LinkSession<Role::Receiver>;
+
+} // namespace rcom
+
+#endif // _LINK_SESSION_HPP_
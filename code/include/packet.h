@@ -0,0 +1,80 @@
+// Application packet format.
+
+#ifndef _PACKET_H_
+#define _PACKET_H_
+
+#include <stdint.h>
+
+#include "link_layer.h"
+
+// Control field
+#define PACKET_START 1
+#define PACKET_DATA 2
+#define PACKET_END 3
+#define PACKET_ACCEPT 4  // Receiver's answer to START
+
+// Session commands (see session.h)
+#define PACKET_GET 5
+#define PACKET_LIST 6
+#define PACKET_BYE 7
+#define PACKET_ERROR 8
+
+// Delta transfers (see delta.h)
+#define PACKET_SIGNATURE 9  // Block signatures of the receiver's copy
+#define PACKET_COPY 10      // Copy blocks of the receiver's copy
+
+// Deduplicated transfers (see chunk_store.h)
+#define PACKET_MANIFEST 11  // Hashes and lengths of the file's chunks
+#define PACKET_NEEDED 12    // Bitmap of the chunks the receiver lacks
+
+// Type field of the control packet TLVs
+#define TLV_FILE_SIZE 0
+#define TLV_FILE_NAME 1
+#define TLV_FILE_MTIME 2
+#define TLV_OFFSET 3     // Offset to resume the transfer from
+#define TLV_MESSAGE 4
+#define TLV_DIGEST 5     // XXH64 of the whole file, carried by END
+#define TLV_BLOCK_SIZE 6   // Signatures follow ACCEPT: size of the blocks
+#define TLV_BLOCK_COUNT 7  // and how many there are
+#define TLV_CHUNK_STORE 8  // The receiver wants the chunk manifest first
+
+#define DATA_PACKET_HEADER_SIZE 4
+#define COPY_PACKET_SIZE 10
+
+// Append a TLV to a packet (MAX_PAYLOAD_SIZE bytes) of the given size.
+// Returns the new packet size, or -1 if it does not fit.
+int addTlv(unsigned char *packet, int size, unsigned char type, const void *value, int length);
+
+// Append a TLV holding a number in as few big-endian bytes as possible.
+// Returns the new packet size, or -1 if it does not fit.
+int addNumberTlv(unsigned char *packet, int size, unsigned char type, uint64_t value);
+
+// Iterate over the TLVs of a packet, starting with *position = 1.
+// Returns a pointer to the value of the next TLV (type in *type, length in
+// *length), or NULL when there are no more.
+const unsigned char *nextTlv(const unsigned char *packet, int size, int *position, unsigned char *type, int *length);
+
+// Look for the first TLV of the given type.
+// Returns a pointer to its value (length in *length), or NULL if not found.
+const unsigned char *findTlv(const unsigned char *packet, int size, unsigned char type, int *length);
+
+// Read a number TLV.
+// Returns 0 on success or -1 if it is missing or wider than 64 bits.
+int getNumberTlv(const unsigned char *packet, int size, unsigned char type, uint64_t *value);
+
+// Build a START / END control packet carrying the file size and name in
+// packet (MAX_PAYLOAD_SIZE bytes). More TLVs can be appended with addTlv().
+// Returns the packet size, or -1 if it does not fit.
+int getControlPacket(unsigned char *packet, unsigned char cField, uint64_t fileLength, const char *filename);
+
+// Fill the header of a data packet. The data itself is sent in place after it.
+void getDataPacketHeader(unsigned int sequence, unsigned int dataLength, unsigned char *header);
+
+// Build a copy packet: count blocks starting at block number block.
+void getCopyPacket(unsigned int sequence, uint32_t block, uint32_t count, unsigned char *packet);
+
+// Extract the file size and name (to be freed by the caller) from a control packet.
+// Returns 0 on success or -1 if the packet is malformed.
+int parseControlPacket(const unsigned char *packet, int size, uint64_t *fileLength, char **filename);
+
+#endif // _PACKET_H_
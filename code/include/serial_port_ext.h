@@ -0,0 +1,20 @@
+// Serial port extensions, kept out of the serial port interface, which must
+// not be changed. They work on the port opened by openSerialPort().
+
+#ifndef _SERIAL_PORT_EXT_H_
+#define _SERIAL_PORT_EXT_H_
+
+#include "serial_port.h"
+
+// Open and configure the serial port like openSerialPort(), which only
+// knows the rates up to 115200, also at 230400, 460800, 921600, 1000000,
+// 2000000, 3000000 and 4000000.
+// Returns -1 on error.
+int openSerialPortExt(const char *serialPort, int baudRate);
+
+// Read up to numBytes already received from the serial port, without waiting
+// (must check how many were actually read in the return value).
+// Returns -1 on error, otherwise the number of bytes read.
+int readBytesSerialPort(unsigned char *bytes, int numBytes);
+
+#endif // _SERIAL_PORT_EXT_H_
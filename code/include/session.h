@@ -0,0 +1,30 @@
+// Session mode: many file operations over a single connection.
+
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+// Prefix of the filename argument that selects the session mode, since the
+// roles stay tx and rx: the transmitter becomes the client, running the
+// command script named after it, and the receiver the server of the
+// directory named after it (e.g. "session:commands.txt", "session:received/").
+#define SESSION_PREFIX "session:"
+
+// Returns what follows SESSION_PREFIX in filename, or NULL if filename does
+// not select the session mode.
+const char *sessionArgument(const char *filename);
+
+// Client side (opens the connection). Runs the commands in script ("-" for
+// the standard input), one per line:
+//   put <file> [<remote name>]   send a file
+//   get <remote name> [<file>]   receive a file
+//   list                         list the files offered by the server
+//   bye                          end the session (implied at end of script)
+// Returns 0 on success or -1 if the link was lost.
+int sessionClient(const char *script);
+
+// Server side. Serves PUT, GET and LIST requests on the files of directory
+// until the client says BYE or disconnects.
+// Returns 0 on success or -1 if the link was lost.
+int sessionServer(const char *directory);
+
+#endif // _SESSION_H_
@@ -0,0 +1,50 @@
+// Bounded lock-free single-producer single-consumer ring.
+
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <stdatomic.h>
+
+// The ring only hands out slot indices; the slots themselves live in an array
+// owned by the user. Each side only moves its own position, with an atomic
+// release store, and reads the other side's with an acquire load, so neither
+// side takes a lock. A side that finds the ring full (or empty) sleeps on a
+// futex until the other side moves; the other side only makes a system call
+// to wake it up when it is actually waiting.
+typedef struct
+{
+    unsigned int mask;              // Capacity - 1
+    atomic_uint head;               // Next position to be consumed
+    atomic_uint tail;               // Next position to be produced
+    atomic_int closed;
+    atomic_uint producerWake;       // Futex words, bumped to wake up a side
+    atomic_uint consumerWake;
+    atomic_int producerWaiting;
+    atomic_int consumerWaiting;
+} SpscRing;
+
+// The capacity must be a power of two.
+// Returns 0 on success or -1 on error.
+int spscRingInit(SpscRing *ring, unsigned int capacity);
+
+void spscRingDestroy(SpscRing *ring);
+
+// Producer: wait for a free slot.
+// Returns its index or -1 if the ring was closed.
+int spscRingAcquire(SpscRing *ring);
+
+// Producer: hand the slot returned by spscRingAcquire() to the consumer.
+void spscRingPublish(SpscRing *ring);
+
+// Consumer: wait for the oldest published slot.
+// Returns its index or -1 if the ring was closed and is empty.
+int spscRingPeek(SpscRing *ring);
+
+// Consumer: give the slot returned by spscRingPeek() back to the producer.
+void spscRingRelease(SpscRing *ring);
+
+// Either side: no more slots will be produced or consumed. Wakes up the other
+// side; slots already published can still be consumed.
+void spscRingClose(SpscRing *ring);
+
+#endif // _SPSC_RING_H_
@@ -0,0 +1,81 @@
+// Staged transmit pipeline: file reading and frame encoding run ahead of the
+// link on their own threads.
+
+#ifndef _TX_PIPELINE_H_
+#define _TX_PIPELINE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "delta.h"
+#include "digest.h"
+#include "file_reader.h"
+#include "link_layer_ext.h"
+#include "spsc_ring.h"
+
+#define TX_BLOCK_SIZE (16 * 1024)
+#define TX_BLOCK_SLOTS 4       // Ring capacities, powers of two
+#define TX_FRAME_SLOTS 16
+
+// File block prefetched by the reader thread
+typedef struct
+{
+    const unsigned char *data;   // Points into the file mapping or buffer
+    int length;
+    unsigned char buffer[TX_BLOCK_SIZE];  // Only used when the file is not mapped
+} TxBlock;
+
+// Part of the file to send when the receiver already has the rest
+typedef struct
+{
+    uint64_t offset;
+    uint64_t length;
+} TxRange;
+
+// Data frame encoded by the encoder thread, ready for llwriteframe()
+typedef struct
+{
+    unsigned char data[MAX_FRAME_SIZE];
+    int size;
+} TxFrame;
+
+// reader thread -> blocks -> encoder thread -> frames -> link thread
+typedef struct
+{
+    FileReader *reader;
+    int packetSize;
+    const DeltaIndex *delta;  // Receiver's blocks, NULL to send the whole file
+    const TxRange *ranges;    // Only send these, in file order (NULL for all)
+    int numRanges;
+    pthread_t readerThread;
+    pthread_t encoderThread;
+    TxBlock *blocks;
+    SpscRing blockRing;
+    TxFrame *frames;
+    SpscRing frameRing;
+    int current;  // Frame being sent by the link thread (-1 if none)
+    int error;    // TRUE if the file could not be read
+    Digest digest;  // Of the whole file, complete once the last frame is out
+                    // (a resumed transfer hashes the part sent before first)
+    uint64_t literalBytes;  // Sent in data packets
+    uint64_t copiedBytes;   // Sent as block references
+} TxPipeline;
+
+// Start reading the file and encoding data packets of up to packetSize bytes,
+// from the reader's offset. The part of the file before it is only hashed.
+// With delta, blocks the receiver already has are sent as copy packets
+// instead; with ranges, only those parts of the file are sent. Both need the
+// whole file mapped and sent from offset 0.
+// Returns 0 on success or -1 on error.
+int txPipelineStart(TxPipeline *pipeline, FileReader *reader, int packetSize, const DeltaIndex *delta,
+                    const TxRange *ranges, int numRanges);
+
+// Get the next encoded data frame, waiting for it if needed. The previous
+// frame is given back to the encoder.
+// Returns NULL after the last frame (check pipeline->error).
+TxFrame *txPipelineNext(TxPipeline *pipeline);
+
+// Stop the pipeline (even if frames are left) and join its threads.
+void txPipelineStop(TxPipeline *pipeline);
+
+#endif // _TX_PIPELINE_H_
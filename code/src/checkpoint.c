@@ -0,0 +1,99 @@
+// Reception checkpoint implementation
+
+#include "checkpoint.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PATH_SIZE 512
+
+static void checkpointPath(const char *filename, const char *suffix, char *path)
+{
+    snprintf(path, PATH_SIZE, "%s.checkpoint%s", filename, suffix);
+}
+
+int checkpointLoad(const char *filename, Checkpoint *checkpoint)
+{
+    char path[PATH_SIZE];
+    checkpointPath(filename, "", path);
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    // Format: "<size> <mtime> <offset> <name>\n"
+    //         "<acc0> <acc1> <acc2> <acc3> <hex tail>\n" (digest state)
+    Digest *digest = &checkpoint->digest;
+    char tail[2 * DIGEST_STRIPE + 2];
+    int ok = fscanf(fp, "%" SCNu64 " %" SCNd64 " %" SCNu64 " ",
+                    &checkpoint->size, &checkpoint->mtime, &checkpoint->offset) == 3
+             && fgets(checkpoint->name, CHECKPOINT_NAME_SIZE, fp) != NULL
+             && fscanf(fp, "%" SCNx64 " %" SCNx64 " %" SCNx64 " %" SCNx64 " %65s", &digest->acc[0],
+                       &digest->acc[1], &digest->acc[2], &digest->acc[3], tail) == 5;
+    fclose(fp);
+    if (!ok) {
+        return -1;
+    }
+
+    checkpoint->name[strcspn(checkpoint->name, "\n")] = '\0';
+
+    // The tail holds the bytes after the last full stripe ("-" if none)
+    digest->total = checkpoint->offset;
+    digest->buffered = checkpoint->offset % DIGEST_STRIPE;
+    if ((int) strlen(tail) != (digest->buffered > 0 ? 2 * digest->buffered : 1)) {
+        return -1;
+    }
+    for (int i = 0; i < digest->buffered; i++) {
+        unsigned int byte;
+        if (sscanf(tail + 2 * i, "%2x", &byte) != 1) {
+            return -1;
+        }
+        digest->buffer[i] = byte;
+    }
+
+    return checkpoint->offset <= checkpoint->size ? 0 : -1;
+}
+
+int checkpointSave(const char *filename, const Checkpoint *checkpoint)
+{
+    char path[PATH_SIZE], tmpPath[PATH_SIZE];
+    checkpointPath(filename, "", path);
+    checkpointPath(filename, ".tmp", tmpPath);
+
+    FILE *fp = fopen(tmpPath, "w");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    const Digest *digest = &checkpoint->digest;
+    fprintf(fp, "%" PRIu64 " %" PRId64 " %" PRIu64 " %s\n",
+            checkpoint->size, checkpoint->mtime, checkpoint->offset, checkpoint->name);
+    fprintf(fp, "%" PRIx64 " %" PRIx64 " %" PRIx64 " %" PRIx64 " ",
+            digest->acc[0], digest->acc[1], digest->acc[2], digest->acc[3]);
+    for (int i = 0; i < digest->buffered; i++) {
+        fprintf(fp, "%02x", digest->buffer[i]);
+    }
+    fprintf(fp, digest->buffered > 0 ? "\n" : "-\n");
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    return rename(tmpPath, path);
+}
+
+void checkpointRemove(const char *filename)
+{
+    char path[PATH_SIZE];
+    checkpointPath(filename, "", path);
+    unlink(path);
+}
+
+int checkpointSameFile(const Checkpoint *a, const Checkpoint *b)
+{
+    return a->size == b->size && a->mtime == b->mtime && strcmp(a->name, b->name) == 0;
+}
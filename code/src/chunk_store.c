@@ -0,0 +1,271 @@
+// Content-addressed chunk store implementation
+
+#define _FILE_OFFSET_BITS 64 // 64-bit file sizes on 32-bit hosts
+
+#include "chunk_store.h"
+#include "digest.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STORE_MAGIC "RCOMCHK3"
+#define STORE_INITIAL_CAPACITY 4096
+#define MIB (1024 * 1024)
+
+uint64_t chunkStoreLimit(void)
+{
+    const char *value = getenv(CHUNK_STORE_ENV);
+    if (value == NULL || value[0] < '0' || value[0] > '9') {
+        return 0;
+    }
+    char *end;
+    unsigned long long mib = strtoull(value, &end, 10);
+    if (*end != '\0' || mib > UINT64_MAX / MIB) {
+        return 0;
+    }
+    return mib * MIB;
+}
+
+static size_t indexSize(uint64_t capacity)
+{
+    return sizeof(ChunkStoreHeader) + capacity * sizeof(ChunkStoreEntry);
+}
+
+static int mapIndex(ChunkStore *store, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(ChunkStoreHeader)) {
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    ChunkStoreHeader *header = map;
+    if (memcmp(header->magic, STORE_MAGIC, sizeof(header->magic)) != 0
+        || header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0 || header->limit == 0
+        || indexSize(header->capacity) != (size_t) st.st_size) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    store->indexFd = fd;
+    store->map = map;
+    store->mapSize = st.st_size;
+    store->header = header;
+    store->entries = (ChunkStoreEntry *) (header + 1);
+    return 0;
+}
+
+static void unmapIndex(ChunkStore *store)
+{
+    msync(store->map, store->mapSize, MS_SYNC);
+    munmap(store->map, store->mapSize);
+    close(store->indexFd);
+}
+
+// Create an empty index with the given capacity in path, for a ring of limit
+// bytes holding up to head.
+// Returns its file descriptor or -1 on error.
+static int createIndex(const char *path, uint64_t capacity, uint64_t limit, uint64_t head)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ChunkStoreHeader header;
+    memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+    header.capacity = capacity;
+    header.count = 0;
+    header.limit = limit;
+    header.head = head;
+    if (ftruncate(fd, indexSize(capacity)) < 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static ChunkStoreEntry *findBucket(const ChunkStore *store, uint64_t hash)
+{
+    uint64_t mask = store->header->capacity - 1;
+    uint64_t i = hash & mask;
+    while (store->entries[i].used && store->entries[i].hash != hash) {
+        i = (i + 1) & mask;
+    }
+    return &store->entries[i];
+}
+
+// TRUE if the chunk of entry is still in the ring, not overwritten by newer ones
+static int isLive(const ChunkStore *store, const ChunkStoreEntry *entry)
+{
+    return entry->used && entry->length > 0 && store->header->head - entry->position <= store->header->limit;
+}
+
+// Move to an index without the overwritten chunks, twice as large if the
+// others still fill a third of it, replacing the old one atomically.
+static int rebuildIndex(ChunkStore *store)
+{
+    char path[600], tmpPath[600];
+    snprintf(path, sizeof(path), "%s/index", store->path);
+    snprintf(tmpPath, sizeof(tmpPath), "%s/index.tmp", store->path);
+
+    uint64_t live = 0;
+    for (uint64_t i = 0; i < store->header->capacity; i++) {
+        live += isLive(store, &store->entries[i]);
+    }
+    uint64_t capacity = store->header->capacity;
+    if ((live + 1) * 3 > capacity) {
+        capacity *= 2;
+    }
+
+    int fd = createIndex(tmpPath, capacity, store->header->limit, store->header->head);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ChunkStore grown = *store;
+    if (mapIndex(&grown, fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    for (uint64_t i = 0; i < store->header->capacity; i++) {
+        if (isLive(store, &store->entries[i])) {
+            *findBucket(&grown, store->entries[i].hash) = store->entries[i];
+            grown.header->count++;
+        }
+    }
+
+    msync(grown.map, grown.mapSize, MS_SYNC);
+    if (rename(tmpPath, path) < 0) {
+        unmapIndex(&grown);
+        return -1;
+    }
+    unmapIndex(store);
+    *store = grown;
+    return 0;
+}
+
+int chunkStoreOpen(ChunkStore *store, const char *directory, uint64_t limit)
+{
+    char path[600];
+    snprintf(store->path, sizeof(store->path), "%s/" CHUNK_STORE_NAME, directory);
+    if (mkdir(store->path, 0700) < 0 && errno != EEXIST) {
+        perror(store->path);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/data", store->path);
+    store->dataFd = open(path, O_RDWR | O_CREAT, 0600);
+    if (store->dataFd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/index", store->path);
+    int fd = open(path, O_RDWR);
+    if (fd >= 0 && mapIndex(store, fd) == 0) {
+        if (store->header->limit == limit) {
+            return 0;
+        }
+        // The positions of the chunks mean nothing in a ring of another size
+        unmapIndex(store);
+    }
+    else if (fd >= 0) {
+        // Unreadable index
+        close(fd);
+    }
+
+    // Start a new store
+    fd = ftruncate(store->dataFd, 0) == 0 ? createIndex(path, STORE_INITIAL_CAPACITY, limit, 0) : -1;
+    if (fd < 0 || mapIndex(store, fd) < 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        close(store->dataFd);
+        return -1;
+    }
+    return 0;
+}
+
+const ChunkStoreEntry *chunkStoreFind(const ChunkStore *store, uint64_t hash)
+{
+    const ChunkStoreEntry *entry = findBucket(store, hash);
+    if (!isLive(store, entry)) {
+        return NULL;
+    }
+    return entry;
+}
+
+int chunkStoreRead(ChunkStore *store, const ChunkStoreEntry *entry, unsigned char *buffer)
+{
+    off_t offset = entry->position % store->header->limit;
+    if (pread(store->dataFd, buffer, entry->length, offset) == entry->length) {
+        Digest digest;
+        digestInit(&digest);
+        digestUpdate(&digest, buffer, entry->length);
+        if (digestValue(&digest) == entry->hash) {
+            return 0;
+        }
+    }
+
+    // Damaged (e.g. the index reached the disk before the data did)
+    ((ChunkStoreEntry *) entry)->length = 0;
+    return -1;
+}
+
+int chunkStoreAdd(ChunkStore *store, uint64_t hash, const unsigned char *data, uint32_t length)
+{
+    if (length == 0 || length > store->header->limit) {
+        return -1;
+    }
+    ChunkStoreEntry *entry = findBucket(store, hash);
+    if (isLive(store, entry)) {
+        return 0;
+    }
+
+    if (!entry->used && (store->header->count + 1) * 10 > store->header->capacity * 7) {
+        if (rebuildIndex(store) < 0) {
+            return -1;
+        }
+        entry = findBucket(store, hash);
+    }
+
+    // Chunks do not wrap around the end of the ring
+    ChunkStoreHeader *header = store->header;
+    uint64_t position = header->head;
+    if (position % header->limit + length > header->limit) {
+        position += header->limit - position % header->limit;
+    }
+    if (pwrite(store->dataFd, data, length, position % header->limit) != length) {
+        return -1;
+    }
+
+    if (!entry->used) {
+        header->count++;
+    }
+    entry->position = position;
+    entry->length = length;
+    entry->hash = hash;
+    entry->used = 1;
+    header->head = position + length;
+    return 0;
+}
+
+void chunkStoreClose(ChunkStore *store)
+{
+    // Data first, so the index never points past what is on disk
+    fdatasync(store->dataFd);
+    close(store->dataFd);
+    unmapIndex(store);
+}
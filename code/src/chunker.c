@@ -0,0 +1,70 @@
+// Content-defined chunking implementation (gear rolling hash)
+
+#include "chunker.h"
+#include "digest.h"
+
+#include <stdlib.h>
+
+#define CHUNK_MASK (((1ULL << CHUNK_AVERAGE_BITS) - 1) << (64 - CHUNK_AVERAGE_BITS))
+
+static uint64_t gear[256];
+static int gearReady = 0;
+
+// Fixed pseudo-random table (splitmix64), the same on every run so chunk
+// boundaries are reproducible
+static void initGear()
+{
+    uint64_t state = 0x52434F4D31ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    gearReady = 1;
+}
+
+// Length of the chunk starting at data. The hash covers the last 64 bytes,
+// a boundary is cut where its top bits are all zero.
+static uint32_t nextBoundary(const unsigned char *data, uint64_t size)
+{
+    if (size <= CHUNK_MIN_SIZE) {
+        return size;
+    }
+    uint32_t limit = size < CHUNK_MAX_SIZE ? size : CHUNK_MAX_SIZE;
+
+    uint64_t hash = 0;
+    for (uint32_t i = CHUNK_MIN_SIZE; i < limit; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & CHUNK_MASK) == 0) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+int64_t chunkSplit(const unsigned char *data, uint64_t size, Chunk **chunks)
+{
+    if (!gearReady) {
+        initGear();
+    }
+
+    int64_t capacity = size / CHUNK_MIN_SIZE + 1;
+    *chunks = malloc(capacity * sizeof(Chunk));
+    if (*chunks == NULL) {
+        return -1;
+    }
+
+    int64_t count = 0;
+    for (uint64_t offset = 0; offset < size; count++) {
+        uint32_t length = nextBoundary(data + offset, size - offset);
+        Digest digest;
+        digestInit(&digest);
+        digestUpdate(&digest, data + offset, length);
+
+        (*chunks)[count].hash = digestValue(&digest);
+        (*chunks)[count].length = length;
+        offset += length;
+    }
+    return count;
+}
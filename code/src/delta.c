@@ -0,0 +1,121 @@
+// Delta transfer signatures implementation
+
+#include "delta.h"
+#include "digest.h"
+
+#include <stdlib.h>
+
+int deltaBlockSize(uint64_t fileSize)
+{
+    // About sqrt(fileSize), as rsync does, so signatures and literals balance
+    uint64_t blockSize = DELTA_MIN_BLOCK;
+    while (blockSize < DELTA_MAX_BLOCK && blockSize * blockSize < fileSize) {
+        blockSize *= 2;
+    }
+    return blockSize;
+}
+
+// Two 16-bit sums: a = sum of the bytes, b = sum of the running values of a
+uint32_t deltaWeak(const unsigned char *data, int length)
+{
+    uint32_t a = 0, b = 0;
+    for (int i = 0; i < length; i++) {
+        a += data[i];
+        b += (uint32_t) (length - i) * data[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+uint32_t deltaRoll(uint32_t weak, unsigned char out, unsigned char in, int blockSize)
+{
+    uint32_t a = weak & 0xFFFF;
+    uint32_t b = weak >> 16;
+    a = (a - out + in) & 0xFFFF;
+    b = (b - (uint32_t) blockSize * out + a) & 0xFFFF;
+    return a | (b << 16);
+}
+
+uint64_t deltaStrong(const unsigned char *data, int length)
+{
+    Digest digest;
+    digestInit(&digest);
+    digestUpdate(&digest, data, length);
+    return digestValue(&digest);
+}
+
+// Spread the weak checksum over the table bits
+static uint32_t bucket(const DeltaIndex *index, uint32_t weak)
+{
+    return (weak * 2654435761u) & index->tableMask;
+}
+
+int deltaIndexInit(DeltaIndex *index, int blockSize, uint32_t count)
+{
+    uint32_t tableSize = 16;
+    while (tableSize < 2 * (uint64_t) count) {
+        tableSize *= 2;
+    }
+
+    index->blockSize = blockSize;
+    index->count = count;
+    index->tableMask = tableSize - 1;
+    index->blocks = malloc((count > 0 ? count : 1) * sizeof(DeltaSignature));
+    index->table = malloc(tableSize * sizeof(int64_t));
+    if (index->blocks == NULL || index->table == NULL) {
+        free(index->blocks);
+        free(index->table);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < tableSize; i++) {
+        index->table[i] = -1;
+    }
+    return 0;
+}
+
+void deltaIndexAdd(DeltaIndex *index, uint32_t block, uint32_t weak, uint64_t strong)
+{
+    index->blocks[block].weak = weak;
+    index->blocks[block].strong = strong;
+
+    uint32_t i = bucket(index, weak);
+    while (index->table[i] >= 0) {
+        DeltaSignature *other = &index->blocks[index->table[i]];
+        if (other->weak == weak && other->strong == strong) {
+            // Identical block, the first copy is enough
+            return;
+        }
+        i = (i + 1) & index->tableMask;
+    }
+    index->table[i] = block;
+}
+
+int64_t deltaIndexFind(const DeltaIndex *index, uint32_t weak, const unsigned char *window)
+{
+    int haveStrong = 0;
+    uint64_t strong = 0;
+
+    // The strong hash is only computed once the weak checksum matches
+    for (uint32_t i = bucket(index, weak); index->table[i] >= 0; i = (i + 1) & index->tableMask) {
+        const DeltaSignature *block = &index->blocks[index->table[i]];
+        if (block->weak != weak) {
+            continue;
+        }
+        if (!haveStrong) {
+            strong = deltaStrong(window, index->blockSize);
+            haveStrong = 1;
+        }
+        if (block->strong == strong) {
+            return index->table[i];
+        }
+    }
+    return -1;
+}
+
+void deltaIndexFree(DeltaIndex *index)
+{
+    free(index->blocks);
+    free(index->table);
+    index->blocks = NULL;
+    index->table = NULL;
+}
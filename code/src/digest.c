@@ -0,0 +1,127 @@
+// Streaming XXH64 implementation
+
+#include "digest.h"
+
+#include <string.h>
+
+#define PRIME1 11400714785074694791ULL
+#define PRIME2 14029467366897019727ULL
+#define PRIME3 1609587929392839161ULL
+#define PRIME4 9650029242287828579ULL
+#define PRIME5 2870177450012600261ULL
+
+static uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static uint64_t read32(const unsigned char *p)
+{
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    return rotl(acc, 31) * PRIME1;
+}
+
+static uint64_t mergeRound(uint64_t acc, uint64_t value)
+{
+    acc ^= round64(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+static void stripe(Digest *digest, const unsigned char *p)
+{
+    for (int i = 0; i < 4; i++) {
+        digest->acc[i] = round64(digest->acc[i], read64(p + 8 * i));
+    }
+}
+
+void digestInit(Digest *digest)
+{
+    digest->acc[0] = PRIME1 + PRIME2;
+    digest->acc[1] = PRIME2;
+    digest->acc[2] = 0;
+    digest->acc[3] = -PRIME1;
+    digest->total = 0;
+    digest->buffered = 0;
+}
+
+void digestUpdate(Digest *digest, const void *data, size_t length)
+{
+    const unsigned char *p = data;
+    digest->total += length;
+
+    if (digest->buffered > 0) {
+        size_t fill = DIGEST_STRIPE - digest->buffered;
+        if (length < fill) {
+            memcpy(digest->buffer + digest->buffered, p, length);
+            digest->buffered += length;
+            return;
+        }
+        memcpy(digest->buffer + digest->buffered, p, fill);
+        stripe(digest, digest->buffer);
+        digest->buffered = 0;
+        p += fill;
+        length -= fill;
+    }
+
+    while (length >= DIGEST_STRIPE) {
+        stripe(digest, p);
+        p += DIGEST_STRIPE;
+        length -= DIGEST_STRIPE;
+    }
+
+    memcpy(digest->buffer, p, length);
+    digest->buffered = length;
+}
+
+uint64_t digestValue(const Digest *digest)
+{
+    uint64_t h;
+    if (digest->total >= DIGEST_STRIPE) {
+        h = rotl(digest->acc[0], 1) + rotl(digest->acc[1], 7) + rotl(digest->acc[2], 12) + rotl(digest->acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = mergeRound(h, digest->acc[i]);
+        }
+    }
+    else {
+        h = PRIME5;
+    }
+    h += digest->total;
+
+    const unsigned char *p = digest->buffer;
+    int left = digest->buffered;
+    for (; left >= 8; p += 8, left -= 8) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if (left >= 4) {
+        h ^= read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--) {
+        h ^= *p * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,147 @@
+// Sequential file reader implementation
+
+#define _FILE_OFFSET_BITS 64 // 64-bit file sizes on 32-bit hosts
+
+#include "file_reader.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define READ_AHEAD_SIZE (64 * 1024)
+
+int fileReaderOpen(FileReader *reader, const char *filename)
+{
+    reader->fd = open(filename, O_RDONLY);
+    if (reader->fd < 0) {
+        perror(filename);
+        return -1;
+    }
+
+    struct stat fileStatus;
+    if (fstat(reader->fd, &fileStatus) < 0) {
+        perror("fstat");
+        close(reader->fd);
+        return -1;
+    }
+
+    reader->size = fileStatus.st_size;
+    reader->mtime = fileStatus.st_mtime;
+    reader->offset = 0;
+    reader->map = NULL;
+    reader->readAhead = NULL;
+    reader->readAheadLength = 0;
+    reader->readAheadOffset = 0;
+
+    if (reader->size > 0 && reader->size <= SIZE_MAX) {
+        void *map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, reader->size, MADV_SEQUENTIAL);
+            reader->map = map;
+            return 0;
+        }
+    }
+
+    // Not mappable (too large, pipe, ...): fall back to streaming
+    reader->readAhead = malloc(READ_AHEAD_SIZE);
+    if (reader->readAhead == NULL) {
+        close(reader->fd);
+        return -1;
+    }
+    return 0;
+}
+
+int fileReaderSeek(FileReader *reader, uint64_t offset)
+{
+    if (offset > reader->size) {
+        return -1;
+    }
+
+    if (reader->map == NULL) {
+        if (lseek(reader->fd, offset, SEEK_SET) < 0) {
+            return -1;
+        }
+        reader->readAheadLength = 0;
+        reader->readAheadOffset = 0;
+    }
+    reader->offset = offset;
+    return 0;
+}
+
+const unsigned char *fileReaderNext(FileReader *reader, int maxBytes, int *length)
+{
+    if (reader->offset >= reader->size) {
+        return NULL;
+    }
+    if ((uint64_t) maxBytes > reader->size - reader->offset) {
+        maxBytes = reader->size - reader->offset;
+    }
+
+    if (reader->map != NULL) {
+        const unsigned char *chunk = reader->map + reader->offset;
+        reader->offset += maxBytes;
+        *length = maxBytes;
+        return chunk;
+    }
+
+    if (reader->readAheadOffset == reader->readAheadLength) {
+        ssize_t bytes = read(reader->fd, reader->readAhead, READ_AHEAD_SIZE);
+        if (bytes <= 0) {
+            return NULL;
+        }
+        reader->readAheadLength = bytes;
+        reader->readAheadOffset = 0;
+    }
+
+    if ((size_t) maxBytes > reader->readAheadLength - reader->readAheadOffset) {
+        maxBytes = reader->readAheadLength - reader->readAheadOffset;
+    }
+    const unsigned char *chunk = reader->readAhead + reader->readAheadOffset;
+    reader->readAheadOffset += maxBytes;
+    reader->offset += maxBytes;
+    *length = maxBytes;
+    return chunk;
+}
+
+int fileReaderRead(FileReader *reader, unsigned char *buffer, int maxBytes)
+{
+    if (reader->offset >= reader->size) {
+        return 0;
+    }
+    if ((uint64_t) maxBytes > reader->size - reader->offset) {
+        maxBytes = reader->size - reader->offset;
+    }
+
+    // Hand out what is left in the read-ahead buffer first
+    if (reader->map != NULL || reader->readAheadOffset < reader->readAheadLength) {
+        int length;
+        const unsigned char *chunk = fileReaderNext(reader, maxBytes, &length);
+        if (chunk == NULL) {
+            return -1;
+        }
+        memcpy(buffer, chunk, length);
+        return length;
+    }
+
+    ssize_t bytes = read(reader->fd, buffer, maxBytes);
+    if (bytes <= 0) {
+        return -1;
+    }
+    reader->offset += bytes;
+    return bytes;
+}
+
+void fileReaderClose(FileReader *reader)
+{
+    if (reader->map != NULL) {
+        munmap(reader->map, reader->size);
+        reader->map = NULL;
+    }
+    free(reader->readAhead);
+    reader->readAhead = NULL;
+    close(reader->fd);
+}
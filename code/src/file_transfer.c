@@ -0,0 +1,944 @@
+// File transfer over an open link implementation
+
+#define _FILE_OFFSET_BITS 64 // 64-bit file sizes on 32-bit hosts
+
+#include "file_transfer.h"
+#include "checkpoint.h"
+#include "chunk_store.h"
+#include "chunker.h"
+#include "delta.h"
+#include "digest.h"
+#include "file_reader.h"
+#include "file_writer.h"
+#include "link_layer_ext.h"
+#include "packet.h"
+#include "tx_pipeline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PATH_SIZE 512
+
+// Abort a transfer once its START packet was sent, so that the other side
+// stops waiting for the rest of it.
+// Returns -1, or 1 if the link was lost.
+static int abortTransfer(const char *message) {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    packet[0] = PACKET_ERROR;
+    int size = addTlv(packet, 1, TLV_MESSAGE, message, strlen(message));
+    return llwrite(packet, size) < 0 ? 1 : -1;
+}
+
+// Print the message of the PACKET_ERROR the peer aborted the transfer with.
+static void printAbort(const char *filename, const char *peer, const unsigned char *packet, int size) {
+    int length;
+    const unsigned char *message = findTlv(packet, size, TLV_MESSAGE, &length);
+    if (message == NULL) {
+        message = (const unsigned char *) "unknown error";
+        length = strlen((const char *) message);
+    }
+    printf("Transfer of %s aborted by the %s: %.*s\n", filename, peer, length, (const char *) message);
+}
+
+// Receive the signatures of count blocks of blockSize bytes into delta.
+// Unusable parameters still read the signatures, so that the receiver is done
+// sending them when the transfer is aborted.
+// Returns 0 on success, 1 if the link was lost, or -1 on error.
+static int receiveSignatures(DeltaIndex *delta, uint64_t blockSize, uint64_t count) {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+
+    if (count > UINT32_MAX) {
+        return -1;
+    }
+    int valid = blockSize >= DELTA_MIN_BLOCK && blockSize <= DELTA_MAX_BLOCK
+                && deltaIndexInit(delta, blockSize, count) == 0;
+
+    uint32_t block = 0;
+    while (block < count) {
+        int size = llread(packet);
+        if (size <= 0) {
+            if (valid) {
+                deltaIndexFree(delta);
+            }
+            return 1;
+        }
+        if (packet[0] != PACKET_SIGNATURE || (size - 1) % DELTA_SIGNATURE_SIZE != 0
+            || block + (size - 1) / DELTA_SIGNATURE_SIZE > count) {
+            if (valid) {
+                deltaIndexFree(delta);
+            }
+            return -1;
+        }
+        if (!valid) {
+            block += (size - 1) / DELTA_SIGNATURE_SIZE;
+            continue;
+        }
+
+        for (int i = 1; i < size; i += DELTA_SIGNATURE_SIZE, block++) {
+            uint32_t weak = 0;
+            uint64_t strong = 0;
+            for (int j = 0; j < 4; j++) {
+                weak = (weak << 8) | packet[i + j];
+            }
+            for (int j = 4; j < DELTA_SIGNATURE_SIZE; j++) {
+                strong = (strong << 8) | packet[i + j];
+            }
+            deltaIndexAdd(delta, block, weak, strong);
+        }
+    }
+    return valid ? 0 : -1;
+}
+
+// Send the signatures of the first count blocks of the file open in fd.
+// Returns 0 on success or -1 on error.
+static int sendSignatures(int fd, int blockSize, uint32_t count) {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    unsigned char *block = malloc(blockSize);
+    if (block == NULL) {
+        return -1;
+    }
+
+    packet[0] = PACKET_SIGNATURE;
+    int size = 1;
+    for (uint32_t i = 0; i < count; i++) {
+        if (pread(fd, block, blockSize, (off_t) i * blockSize) != blockSize) {
+            // Should not happen, the file was large enough. The sender will
+            // not find this block.
+            memset(block, 0, blockSize);
+        }
+        uint32_t weak = deltaWeak(block, blockSize);
+        uint64_t strong = deltaStrong(block, blockSize);
+
+        for (int j = 0; j < 4; j++) {
+            packet[size++] = weak >> (24 - 8 * j) & 0xFF;
+        }
+        for (int j = 0; j < 8; j++) {
+            packet[size++] = strong >> (56 - 8 * j) & 0xFF;
+        }
+
+        if (size + DELTA_SIGNATURE_SIZE > MAX_PAYLOAD_SIZE || i == count - 1) {
+            if (llwrite(packet, size) < 0) {
+                free(block);
+                return -1;
+            }
+            size = 1;
+        }
+    }
+
+    free(block);
+    return 0;
+}
+
+// Open the copy of filename the receiver already has, if it holds at least
+// one block of a file of newSize bytes.
+// Returns its file descriptor, or -1 if there is no usable copy.
+static int openDeltaBase(const char *filename, uint64_t newSize, int *blockSize, uint32_t *blockCount) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    *blockSize = deltaBlockSize(newSize);
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (uint64_t) st.st_size < (uint64_t) *blockSize
+        || (uint64_t) st.st_size / *blockSize > UINT32_MAX) {
+        close(fd);
+        return -1;
+    }
+
+    *blockCount = st.st_size / *blockSize;
+    return fd;
+}
+
+// Queue length bytes of the base copy, starting at from, to be written at offset.
+// Returns 0 on success or -1 on error.
+static int copyBlocks(FileWriter *writer, int baseFd, uint64_t from, uint64_t length, uint64_t offset) {
+    while (length > 0) {
+        int chunk = length > MAX_PAYLOAD_SIZE ? MAX_PAYLOAD_SIZE : length;
+        unsigned char *buffer = fileWriterBuffer(writer);
+        if (pread(baseFd, buffer, chunk, from) != chunk) {
+            return -1;
+        }
+        fileWriterCommit(writer, 0, chunk, offset);
+        from += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+// Chunk manifest entry on the wire: hash (8 bytes) and length (4 bytes)
+#define MANIFEST_ENTRY_SIZE 12
+
+// Most chunks the receiver takes a manifest of, files of up to 2 GiB (the
+// count is bounded by the file size, which comes from the START packet)
+#define MANIFEST_MAX_CHUNKS (1024 * 1024)
+
+// Send the chunk manifest of the mapped file and get back which chunks the
+// receiver lacks. *ranges is set to the parts of the file to send, or NULL
+// if the file is not mapped (then everything is sent).
+// Returns 0 on success, 1 if the link was lost, 2 if the receiver aborted the
+// transfer, or -1 on error.
+static int negotiateChunks(const char *filename, const FileReader *reader, TxRange **ranges, int *numRanges) {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    Chunk *chunks = NULL;
+    int64_t count = 0;
+
+    *ranges = NULL;
+    *numRanges = 0;
+    if (reader->map != NULL) {
+        count = chunkSplit(reader->map, reader->size, &chunks);
+        if (count < 0 || (*ranges = malloc((count + 1) * sizeof(TxRange))) == NULL) {
+            free(chunks);
+            chunks = NULL;
+            count = 0;
+        }
+    }
+
+    // The manifest ends with an empty packet, one without entries means
+    // the whole file is coming
+    packet[0] = PACKET_MANIFEST;
+    int size = 1;
+    for (int64_t i = 0; i <= count; i++) {
+        if (i == count || size + MANIFEST_ENTRY_SIZE > MAX_PAYLOAD_SIZE) {
+            if (size > 1 && llwrite(packet, size) < 0) {
+                free(chunks);
+                free(*ranges);
+                return 1;
+            }
+            size = 1;
+        }
+        if (i < count) {
+            for (int j = 0; j < 8; j++) {
+                packet[size++] = chunks[i].hash >> (56 - 8 * j) & 0xFF;
+            }
+            for (int j = 0; j < 4; j++) {
+                packet[size++] = chunks[i].length >> (24 - 8 * j) & 0xFF;
+            }
+        }
+    }
+    if (llwrite(packet, 1) < 0) {
+        free(chunks);
+        free(*ranges);
+        return 1;
+    }
+    if (count == 0) {
+        free(*ranges);
+        *ranges = NULL;
+        return 0;
+    }
+
+    // Consecutive chunks the receiver lacks are sent as a single range
+    uint64_t offset = 0;
+    int64_t received = 0;
+    while (received < count) {
+        size = llread(packet);
+        if (size <= 0) {
+            free(chunks);
+            free(*ranges);
+            return 1;
+        }
+        if (packet[0] != PACKET_NEEDED) {
+            free(chunks);
+            free(*ranges);
+            if (packet[0] == PACKET_ERROR) {
+                printAbort(filename, "receiver", packet, size);
+                return 2;
+            }
+            return -1;
+        }
+
+        for (int i = 1; i < size && received < count; i++) {
+            for (int bit = 0; bit < 8 && received < count; bit++, received++) {
+                if (packet[i] & (0x80 >> bit)) {
+                    TxRange *last = *numRanges > 0 ? &(*ranges)[*numRanges - 1] : NULL;
+                    if (last != NULL && last->offset + last->length == offset) {
+                        last->length += chunks[received].length;
+                    }
+                    else {
+                        (*ranges)[(*numRanges)++] = (TxRange) {offset, chunks[received].length};
+                    }
+                }
+                offset += chunks[received].length;
+            }
+        }
+    }
+
+    free(chunks);
+    return 0;
+}
+
+// Receiver side of a deduplicated transfer: chunks found in the store are
+// copied from it, the others arrive as data and are added to it.
+typedef struct
+{
+    ChunkStore store;
+    Chunk *chunks;
+    unsigned char *needed;  // One byte per chunk, TRUE if it comes over the link
+    uint32_t count;
+    uint32_t next;          // First chunk not written yet
+    uint32_t filled;        // Bytes of it received so far
+    unsigned char *buffer;  // CHUNK_MAX_SIZE bytes
+} Dedup;
+
+// Get the directory filename is in (PATH_SIZE bytes), which has the chunk store.
+static void storeDirectory(const char *filename, char *directory) {
+    snprintf(directory, PATH_SIZE, "%s", filename);
+    char *slash = strrchr(directory, '/');
+    if (slash == NULL) {
+        strcpy(directory, ".");
+    }
+    else {
+        slash[slash == directory ? 1 : 0] = '\0';
+    }
+}
+
+// Open the chunk store of the directory filename is received into, with the
+// size limit the user set (stores are only used when there is one).
+// Returns 0 on success or -1 on error.
+static int dedupOpen(Dedup *dedup, const char *filename) {
+    char directory[PATH_SIZE];
+    storeDirectory(filename, directory);
+
+    dedup->chunks = NULL;
+    dedup->needed = NULL;
+    dedup->count = 0;
+    dedup->next = 0;
+    dedup->filled = 0;
+    dedup->buffer = malloc(CHUNK_MAX_SIZE);
+    if (dedup->buffer == NULL) {
+        return -1;
+    }
+    if (chunkStoreOpen(&dedup->store, directory, chunkStoreLimit()) < 0) {
+        free(dedup->buffer);
+        return -1;
+    }
+    return 0;
+}
+
+static void dedupClose(Dedup *dedup) {
+    chunkStoreClose(&dedup->store);
+    free(dedup->chunks);
+    free(dedup->needed);
+    free(dedup->buffer);
+}
+
+// Read the manifest of a file of fileSize bytes and answer with the chunks
+// the store lacks.
+// Returns 0 on success or -1 on error.
+static int dedupNegotiate(Dedup *dedup, uint64_t fileSize) {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    if (fileSize / CHUNK_MIN_SIZE >= MANIFEST_MAX_CHUNKS) {
+        return -1;
+    }
+    uint32_t capacity = fileSize / CHUNK_MIN_SIZE + 1;
+    uint64_t total = 0;
+
+    dedup->chunks = malloc(capacity * sizeof(Chunk));
+    dedup->needed = malloc(capacity);
+    if (dedup->chunks == NULL || dedup->needed == NULL) {
+        return -1;
+    }
+
+    while (TRUE) {
+        int size = llread(packet);
+        if (size <= 0 || packet[0] != PACKET_MANIFEST || (size - 1) % MANIFEST_ENTRY_SIZE != 0) {
+            return -1;
+        }
+        if (size == 1) {
+            break;
+        }
+
+        for (int i = 1; i < size; i += MANIFEST_ENTRY_SIZE) {
+            Chunk chunk = {0, 0};
+            for (int j = 0; j < 8; j++) {
+                chunk.hash = (chunk.hash << 8) | packet[i + j];
+            }
+            for (int j = 8; j < MANIFEST_ENTRY_SIZE; j++) {
+                chunk.length = (chunk.length << 8) | packet[i + j];
+            }
+            if (dedup->count == capacity || chunk.length == 0 || chunk.length > CHUNK_MAX_SIZE) {
+                return -1;
+            }
+            total += chunk.length;
+            dedup->needed[dedup->count] = chunkStoreFind(&dedup->store, chunk.hash) == NULL;
+            dedup->chunks[dedup->count++] = chunk;
+        }
+    }
+
+    if (dedup->count == 0) {
+        // The sender sends the whole file
+        return 0;
+    }
+    if (total != fileSize) {
+        return -1;
+    }
+
+    uint32_t needed = 0;
+    packet[0] = PACKET_NEEDED;
+    int size = 1;
+    for (uint32_t i = 0; i < dedup->count; i += 8) {
+        unsigned char bits = 0;
+        for (uint32_t bit = 0; bit < 8 && i + bit < dedup->count; bit++) {
+            if (dedup->needed[i + bit]) {
+                bits |= 0x80 >> bit;
+                needed++;
+            }
+        }
+        packet[size++] = bits;
+        if (size == MAX_PAYLOAD_SIZE || i + 8 >= dedup->count) {
+            if (llwrite(packet, size) < 0) {
+                return -1;
+            }
+            size = 1;
+        }
+    }
+
+    printf("%u of %u chunks found in the chunk store\n", dedup->count - needed, dedup->count);
+    return 0;
+}
+
+// Take the payload of a data packet, adding each chunk it completes to the store.
+// Returns 0 on success or -1 if it is not what the manifest announced.
+static int dedupData(Dedup *dedup, const unsigned char *data, int length) {
+    while (length > 0) {
+        if (dedup->next == dedup->count || !dedup->needed[dedup->next]) {
+            return -1;
+        }
+
+        Chunk *chunk = &dedup->chunks[dedup->next];
+        int bytes = chunk->length - dedup->filled < (uint32_t) length ? chunk->length - dedup->filled : (uint32_t) length;
+        memcpy(dedup->buffer + dedup->filled, data, bytes);
+        dedup->filled += bytes;
+        data += bytes;
+        length -= bytes;
+
+        if (dedup->filled == chunk->length) {
+            // A damaged chunk is not stored, the file digest will catch it
+            if (deltaStrong(dedup->buffer, chunk->length) == chunk->hash) {
+                chunkStoreAdd(&dedup->store, chunk->hash, dedup->buffer, chunk->length);
+            }
+            dedup->next++;
+            dedup->filled = 0;
+        }
+    }
+    return 0;
+}
+
+// Write the chunks the store has, up to the next one that comes over the link.
+// Returns 0 on success or -1 if the store could not provide one.
+static int dedupCopy(Dedup *dedup, FileWriter *writer, uint64_t *offset) {
+    while (dedup->next < dedup->count && !dedup->needed[dedup->next]) {
+        Chunk *chunk = &dedup->chunks[dedup->next];
+        const ChunkStoreEntry *entry = chunkStoreFind(&dedup->store, chunk->hash);
+        if (entry == NULL || entry->length != chunk->length || chunkStoreRead(&dedup->store, entry, dedup->buffer) < 0) {
+            printf("Chunk %016llx missing from the chunk store\n", (unsigned long long) chunk->hash);
+            return -1;
+        }
+
+        for (uint32_t done = 0; done < chunk->length; ) {
+            int bytes = chunk->length - done > MAX_PAYLOAD_SIZE ? MAX_PAYLOAD_SIZE : chunk->length - done;
+            memcpy(fileWriterBuffer(writer), dedup->buffer + done, bytes);
+            fileWriterCommit(writer, 0, bytes, *offset);
+            *offset += bytes;
+            done += bytes;
+        }
+        dedup->next++;
+    }
+    return 0;
+}
+
+// Add the chunks of a file received without the chunk store (because it was
+// empty) to the store, so that later transfers can use them.
+static void storeChunks(const char *filename) {
+    FileReader reader;
+    if (fileReaderOpen(&reader, filename) < 0) {
+        return;
+    }
+    Chunk *chunks;
+    int64_t count = reader.map != NULL ? chunkSplit(reader.map, reader.size, &chunks) : -1;
+    if (count < 0) {
+        fileReaderClose(&reader);
+        return;
+    }
+
+    char directory[PATH_SIZE];
+    ChunkStore store;
+    storeDirectory(filename, directory);
+    if (chunkStoreOpen(&store, directory, chunkStoreLimit()) == 0) {
+        uint64_t offset = 0;
+        for (int64_t i = 0; i < count; i++) {
+            chunkStoreAdd(&store, chunks[i].hash, reader.map + offset, chunks[i].length);
+            offset += chunks[i].length;
+        }
+        chunkStoreClose(&store);
+    }
+    free(chunks);
+    fileReaderClose(&reader);
+}
+
+// Give up on a delta reception: keep the old copy and drop the new one.
+static void dropDelta(int *baseFd, const char *deltaPath) {
+    close(*baseFd);
+    *baseFd = -1;
+    unlink(deltaPath);
+    checkpointRemove(deltaPath);
+}
+
+int sendFile(const char *filename, const char *name) {
+    struct timespec start, end;
+    FileReader reader;
+
+    if (fileReaderOpen(&reader, filename) < 0) {
+        return -1;
+    }
+    uint64_t fileSize = reader.size;
+
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int size = getControlPacket(packet, PACKET_START, fileSize, name);
+    if (size >= 0) {
+        size = addNumberTlv(packet, size, TLV_FILE_MTIME, reader.mtime);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (size < 0) {
+        fileReaderClose(&reader);
+        return -1;
+    }
+    if (llwrite(packet, size) < 0) {
+        fileReaderClose(&reader);
+        return 1;
+    }
+
+    // The receiver answers with how much of the file it already has
+    uint64_t offset;
+    size = llread(packet);
+    if (size <= 0) {
+        fileReaderClose(&reader);
+        return 1;
+    }
+    if (packet[0] == PACKET_ERROR) {
+        printAbort(filename, "receiver", packet, size);
+        fileReaderClose(&reader);
+        return -1;
+    }
+    if (packet[0] != PACKET_ACCEPT || getNumberTlv(packet, size, TLV_OFFSET, &offset) < 0
+        || fileReaderSeek(&reader, offset) < 0) {
+        printf("Receiver did not accept %s\n", filename);
+        fileReaderClose(&reader);
+        return abortTransfer("invalid answer to START");
+    }
+    if (offset > 0) {
+        printf("Resuming transfer at byte %llu of %llu\n", (unsigned long long) offset, (unsigned long long) fileSize);
+    }
+
+    // A receiver with an older copy of the file follows with the signatures
+    // of its blocks
+    DeltaIndex delta;
+    int haveDelta = FALSE;
+    uint64_t blockSize, blockCount;
+    if (getNumberTlv(packet, size, TLV_BLOCK_SIZE, &blockSize) == 0
+        && getNumberTlv(packet, size, TLV_BLOCK_COUNT, &blockCount) == 0) {
+        int result = receiveSignatures(&delta, blockSize, blockCount);
+        if (result != 0) {
+            printf("Invalid block signatures for %s\n", filename);
+            fileReaderClose(&reader);
+            return result == 1 ? 1 : abortTransfer("invalid block signatures");
+        }
+        haveDelta = TRUE;
+    }
+
+    // A receiver with a chunk store only wants the chunks it lacks
+    TxRange *ranges = NULL;
+    int numRanges = 0;
+    uint64_t chunkStore;
+    if (!haveDelta && getNumberTlv(packet, size, TLV_CHUNK_STORE, &chunkStore) == 0) {
+        int result = negotiateChunks(filename, &reader, &ranges, &numRanges);
+        if (result == 2) {
+            fileReaderClose(&reader);
+            return -1;
+        }
+        if (result != 0) {
+            printf("Chunk negotiation for %s failed\n", filename);
+            fileReaderClose(&reader);
+            return result == 1 ? 1 : abortTransfer("chunk negotiation failed");
+        }
+    }
+    int useChunks = ranges != NULL;
+
+    // File reading and frame encoding run ahead on their own
+    // threads, this one only sends frames and waits for the ACKs
+    TxPipeline pipeline;
+    int useDelta = haveDelta && offset == 0 && reader.map != NULL;
+    if (txPipelineStart(&pipeline, &reader, PACKET_SIZE, useDelta ? &delta : NULL, ranges, numRanges) < 0) {
+        if (haveDelta) {
+            deltaIndexFree(&delta);
+        }
+        free(ranges);
+        fileReaderClose(&reader);
+        return abortTransfer("cannot start the transfer");
+    }
+
+    int linkLost = FALSE;
+    int receiverAborted = FALSE;
+    TxFrame *frame;
+    while ((frame = txPipelineNext(&pipeline)) != NULL) {
+        if (llwriteframe(frame->data, frame->size) < 0) {
+            linkLost = TRUE;
+            break;
+        }
+        // The receiver only sends while the data flows to abort
+        if (llpending()) {
+            receiverAborted = TRUE;
+            break;
+        }
+    }
+    txPipelineStop(&pipeline);
+    fileReaderClose(&reader);
+    if (haveDelta) {
+        deltaIndexFree(&delta);
+    }
+    free(ranges);
+
+    if (linkLost) {
+        // The receiver keeps what it got, a new run continues from there
+        printf("Link lost, transfer of %s interrupted\n", filename);
+        return 1;
+    }
+    if (receiverAborted) {
+        size = llread(packet);
+        if (size > 0 && packet[0] == PACKET_ERROR) {
+            printAbort(filename, "receiver", packet, size);
+        }
+        return -1;
+    }
+    if (pipeline.error) {
+        printf("Error reading %s\n", filename);
+        return abortTransfer("read error");
+    }
+
+    size = getControlPacket(packet, PACKET_END, fileSize, name);
+    if (size >= 0) {
+        size = addNumberTlv(packet, size, TLV_DIGEST, digestValue(&pipeline.digest));
+    }
+    if (size < 0) {
+        return abortTransfer("cannot build the END packet");
+    }
+    if (llwrite(packet, size) < 0) {
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Tempo total de transferência: %.3f segundos\n", elapsed);
+    if (useDelta) {
+        printf("Delta: %llu bytes sent, %llu bytes reused from the receiver's copy\n",
+               (unsigned long long) pipeline.literalBytes, (unsigned long long) pipeline.copiedBytes);
+    }
+    if (useChunks) {
+        printf("Deduplicated: %llu bytes sent, %llu bytes already in the receiver's chunk store\n",
+               (unsigned long long) pipeline.literalBytes, (unsigned long long) (fileSize - pipeline.literalBytes));
+    }
+    return 0;
+}
+
+int receiveFile(const char *filename, unsigned char *request, int *requestSize) {
+    struct timespec start, end;
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    FileWriter writer;
+    int writerOpen = FALSE;
+    int complete = FALSE;
+    int disconnected = FALSE;
+    uint64_t offset = 0;
+    int sequenceNumber = 0;
+    uint64_t expectedDigest;
+    int hasDigest = FALSE;
+    const char *failure = NULL;  // Why the reception failed, told to the sender
+    int aborted = FALSE;
+    int another = FALSE;  // Another request arrived, left in request
+
+    // Delta reception: the new file is built next to the old copy (baseFd)
+    // and replaces it once complete
+    int baseFd = -1;
+    int blockSize = 0;
+    uint32_t blockCount = 0;
+    char deltaPath[PATH_SIZE];
+    snprintf(deltaPath, PATH_SIZE, "%s.delta", filename);
+
+    Dedup dedup;
+    int dedupOpened = FALSE;
+    int useChunks = FALSE;
+    int storeAfter = FALSE;  // Chunk the file into the store once received
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    memcpy(packet, request, *requestSize);
+    unsigned char *rxPacket = packet;
+    int packetSize = *requestSize;
+
+    while (TRUE) {
+        switch (rxPacket[0]) {
+            case PACKET_START: {
+                Checkpoint incoming;
+                char *name;
+                if (parseControlPacket(rxPacket, packetSize, &incoming.size, &name) < 0) {
+                    break;
+                }
+                snprintf(incoming.name, CHECKPOINT_NAME_SIZE, "%s", name);
+                free(name);
+                uint64_t mtime = 0;
+                getNumberTlv(rxPacket, packetSize, TLV_FILE_MTIME, &mtime);
+                incoming.mtime = mtime;
+
+                // The sender moved on to another file
+                if (writerOpen && !checkpointSameFile(&incoming, &writer.checkpoint)) {
+                    another = TRUE;
+                    break;
+                }
+
+                // Chunks are only used from the start of a file
+                if (dedupOpened) {
+                    dedupClose(&dedup);
+                    dedupOpened = FALSE;
+                    useChunks = FALSE;
+                }
+
+                Checkpoint saved;
+                if (writerOpen && checkpointSameFile(&incoming, &writer.checkpoint)) {
+                    // The transmitter reconnected, continue after what we have
+                    incoming.offset = offset;
+                }
+                else {
+                    incoming.offset = 0;
+                    if (checkpointLoad(filename, &saved) == 0 && checkpointSameFile(&incoming, &saved)) {
+                        incoming.offset = saved.offset;
+                        incoming.digest = saved.digest;
+                    }
+                    else if (incoming.size > 0) {
+                        baseFd = openDeltaBase(filename, incoming.size, &blockSize, &blockCount);
+                    }
+                    if (fileWriterOpen(&writer, baseFd >= 0 ? deltaPath : filename, &incoming) < 0) {
+                        if (baseFd >= 0) {
+                            close(baseFd);
+                        }
+                        return -1;
+                    }
+                    writerOpen = TRUE;
+                }
+
+                offset = incoming.offset;
+                sequenceNumber = 0;
+                if (offset > 0) {
+                    printf("Resuming reception at byte %llu of %llu\n", (unsigned long long) offset, (unsigned long long) incoming.size);
+                }
+
+                packet[0] = PACKET_ACCEPT;
+                int size = addNumberTlv(packet, 1, TLV_OFFSET, offset);
+                int signatures = baseFd >= 0 && offset == 0;
+                if (signatures) {
+                    size = addNumberTlv(packet, size, TLV_BLOCK_SIZE, blockSize);
+                    size = addNumberTlv(packet, size, TLV_BLOCK_COUNT, blockCount);
+                }
+                else if (offset == 0 && chunkStoreLimit() > 0 && incoming.size > CHUNK_MIN_SIZE
+                         && incoming.size / CHUNK_MIN_SIZE < MANIFEST_MAX_CHUNKS && dedupOpen(&dedup, filename) == 0) {
+                    if (dedup.store.header->count > 0) {
+                        dedupOpened = TRUE;
+                        size = addNumberTlv(packet, size, TLV_CHUNK_STORE, 1);
+                    }
+                    else {
+                        // Nothing to find in the store, skip the manifest
+                        dedupClose(&dedup);
+                        storeAfter = TRUE;
+                    }
+                }
+                llwrite(packet, size);
+
+                if (signatures) {
+                    printf("Sending the signatures of %u blocks of the old %s\n", blockCount, filename);
+                    sendSignatures(baseFd, blockSize, blockCount);
+                }
+                if (dedupOpened) {
+                    if (dedupNegotiate(&dedup, incoming.size) < 0) {
+                        printf("Invalid chunk manifest for %s\n", filename);
+                        failure = "invalid chunk manifest";
+                        break;
+                    }
+                    useChunks = dedup.count > 0;
+                    if (useChunks && dedupCopy(&dedup, &writer, &offset) < 0) {
+                        failure = "chunk missing from the chunk store";
+                    }
+                }
+                break;
+            }
+
+            case PACKET_DATA: {
+                if (!writerOpen) {
+                    break;
+                }
+                int dataLength = packetSize - DATA_PACKET_HEADER_SIZE;
+                if (dataLength < 0 || (rxPacket[2] << 8 | rxPacket[3]) != dataLength) {
+                    printf("Invalid data packet of %d bytes\n", packetSize);
+                    failure = "invalid data packet";
+                    break;
+                }
+                if (rxPacket[1] != sequenceNumber) {
+                    break;
+                }
+                sequenceNumber = (sequenceNumber + 1) % 100;
+
+                if (useChunks && dedupData(&dedup, rxPacket + DATA_PACKET_HEADER_SIZE, dataLength) < 0) {
+                    printf("Data does not match the chunk manifest\n");
+                    failure = "data does not match the chunk manifest";
+                    break;
+                }
+                fileWriterCommit(&writer, DATA_PACKET_HEADER_SIZE, dataLength, offset);
+                offset += dataLength;
+                if (useChunks && dedupCopy(&dedup, &writer, &offset) < 0) {
+                    failure = "chunk missing from the chunk store";
+                }
+                break;
+            }
+
+            case PACKET_COPY: {
+                if (!writerOpen || baseFd < 0 || packetSize != COPY_PACKET_SIZE || rxPacket[1] != sequenceNumber) {
+                    break;
+                }
+
+                uint32_t block = 0, count = 0;
+                for (int i = 0; i < 4; i++) {
+                    block = (block << 8) | rxPacket[2 + i];
+                    count = (count << 8) | rxPacket[6 + i];
+                }
+                if ((uint64_t) block + count > blockCount) {
+                    break;
+                }
+                sequenceNumber = (sequenceNumber + 1) % 100;
+
+                uint64_t length = (uint64_t) count * blockSize;
+                if (copyBlocks(&writer, baseFd, (uint64_t) block * blockSize, length, offset) < 0) {
+                    perror("copy");
+                    failure = "cannot copy blocks of the old copy";
+                }
+                offset += length;
+                break;
+            }
+
+            case PACKET_END:
+                complete = writerOpen;
+                hasDigest = getNumberTlv(rxPacket, packetSize, TLV_DIGEST, &expectedDigest) == 0;
+                break;
+
+            case PACKET_ERROR:
+                printAbort(filename, "sender", rxPacket, packetSize);
+                aborted = TRUE;
+                break;
+
+            case PACKET_GET:
+            case PACKET_LIST:
+            case PACKET_BYE:
+                another = TRUE;
+                break;
+        }
+
+        if (another) {
+            memcpy(request, rxPacket, packetSize);
+            *requestSize = packetSize;
+        }
+        if (failure != NULL) {
+            // The sender would go on with the rest of the file
+            abortTransfer(failure);
+            break;
+        }
+        if (complete || aborted || another) {
+            break;
+        }
+
+        // Data packets are received straight into the writer's ring and
+        // written to disk by its thread
+        rxPacket = writerOpen ? fileWriterBuffer(&writer) : packet;
+        packetSize = llread(rxPacket);
+        if (packetSize <= 0) {
+            disconnected = packetSize == 0;
+            break;
+        }
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Tempo total de receção: %.3f segundos\n", elapsed);
+
+    if (dedupOpened) {
+        dedupClose(&dedup);
+    }
+    if (!writerOpen) {
+        return another ? 2 : disconnected ? 1 : -1;
+    }
+
+    uint64_t fileSize = writer.checkpoint.size;
+    if (fileWriterClose(&writer) < 0 || failure != NULL) {
+        printf("Error writing %s\n", filename);
+        if (baseFd >= 0) {
+            dropDelta(&baseFd, deltaPath);
+        }
+        return -1;
+    }
+
+    if (!complete || offset != fileSize) {
+        if (baseFd >= 0) {
+            // Delta receptions are not resumed, the next one starts over
+            printf("Transfer of %s interrupted\n", filename);
+            dropDelta(&baseFd, deltaPath);
+        }
+        else {
+            printf("Transfer interrupted at byte %llu of %llu, checkpoint kept to resume\n", (unsigned long long) offset, (unsigned long long) fileSize);
+        }
+        return another ? 2 : disconnected ? 1 : -1;
+    }
+
+    // The writer hashed the data as it went to disk (or restored the hash of
+    // what an earlier run wrote), nothing is read back
+    uint64_t digest = digestValue(&writer.checkpoint.digest);
+    if (hasDigest && digest != expectedDigest) {
+        // Nothing to resume from, the whole file is received again next time
+        printf("Digest mismatch for %s: expected %016llx, got %016llx, file discarded\n", filename,
+               (unsigned long long) expectedDigest, (unsigned long long) digest);
+        if (baseFd >= 0) {
+            dropDelta(&baseFd, deltaPath);
+        }
+        else {
+            unlink(filename);
+            checkpointRemove(filename);
+        }
+        return -1;
+    }
+
+    checkpointRemove(filename);
+    if (!hasDigest) {
+        printf("No digest received, %s not verified\n", filename);
+    }
+    else {
+        printf("Digest OK: %016llx\n", (unsigned long long) digest);
+    }
+
+    if (baseFd >= 0) {
+        close(baseFd);
+        checkpointRemove(deltaPath);
+        if (rename(deltaPath, filename) < 0) {
+            perror(filename);
+            return -1;
+        }
+    }
+    if (storeAfter) {
+        storeChunks(filename);
+    }
+    return 0;
+}
+
@@ -0,0 +1,164 @@
+// Write-behind file writer implementation
+
+#define _GNU_SOURCE          // fallocate()
+#define _FILE_OFFSET_BITS 64 // 64-bit file sizes on 32-bit hosts
+
+#include "file_writer.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// The data is synced (and the checkpoint saved) when SYNC_BATCH bytes or
+// SYNC_INTERVAL seconds worth of data are pending, whichever comes first
+#define SYNC_BATCH (1024 * 1024)
+#define SYNC_INTERVAL 1
+
+// Sync the data and move the checkpoint past it. Once a write or a sync
+// failed, the checkpoint stays where it is: what follows may not be on disk.
+static void syncFile(FileWriter *writer)
+{
+    if (writer->error) {
+        return;
+    }
+    if (fdatasync(writer->fd) < 0) {
+        perror("fdatasync");
+        writer->error = TRUE;
+        return;
+    }
+    writer->checkpoint.offset = writer->end;
+    if (checkpointSave(writer->filename, &writer->checkpoint) < 0) {
+        perror("checkpoint");
+    }
+}
+
+static void *writerThread(void *arg)
+{
+    FileWriter *writer = arg;
+    uint64_t unsynced = 0;
+    struct timespec lastSync, now;
+    clock_gettime(CLOCK_MONOTONIC, &lastSync);
+
+    int index;
+    while ((index = spscRingPeek(&writer->ring)) >= 0) {
+        FileWriterSlot *slot = &writer->slots[index];
+        int written = 0;
+        while (written < slot->length) {
+            ssize_t bytes = pwrite(writer->fd, slot->data + slot->start + written,
+                                   slot->length - written, slot->offset + written);
+            if (bytes <= 0) {
+                perror("pwrite");
+                writer->error = TRUE;
+                break;
+            }
+            written += bytes;
+        }
+
+        // Slots arrive in file order, so the digest follows the data on disk
+        if (slot->offset == writer->end) {
+            digestUpdate(&writer->checkpoint.digest, slot->data + slot->start, written);
+        }
+        if (slot->offset + written > writer->end) {
+            writer->end = slot->offset + written;
+        }
+        unsynced += written;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (unsynced >= SYNC_BATCH || now.tv_sec - lastSync.tv_sec >= SYNC_INTERVAL) {
+            syncFile(writer);
+            unsynced = 0;
+            lastSync = now;
+        }
+
+        spscRingRelease(&writer->ring);
+    }
+
+    syncFile(writer);
+    return NULL;
+}
+
+int fileWriterOpen(FileWriter *writer, const char *filename, const Checkpoint *checkpoint)
+{
+    uint64_t size = checkpoint->size;
+    int flags = checkpoint->offset > 0 ? O_WRONLY | O_CREAT : O_WRONLY | O_CREAT | O_TRUNC;
+    writer->fd = open(filename, flags, 0644);
+    if (writer->fd < 0) {
+        perror(filename);
+        return -1;
+    }
+
+    // Reserve the space up front so the file is not fragmented and writes do
+    // not have to allocate blocks. Not all file systems support it.
+    if (size > 0 && fallocate(writer->fd, 0, 0, size) < 0) {
+        perror("fallocate");
+    }
+
+    writer->slots = malloc(FILE_WRITER_SLOTS * sizeof(FileWriterSlot));
+    if (writer->slots == NULL) {
+        close(writer->fd);
+        return -1;
+    }
+    if (spscRingInit(&writer->ring, FILE_WRITER_SLOTS) < 0) {
+        free(writer->slots);
+        close(writer->fd);
+        return -1;
+    }
+    writer->current = -1;
+    writer->end = checkpoint->offset;
+    writer->error = FALSE;
+    writer->filename = filename;
+    writer->checkpoint = *checkpoint;
+    if (checkpoint->offset == 0) {
+        digestInit(&writer->checkpoint.digest);
+    }
+
+    if (pthread_create(&writer->thread, NULL, writerThread, writer) != 0) {
+        spscRingDestroy(&writer->ring);
+        free(writer->slots);
+        close(writer->fd);
+        return -1;
+    }
+    return 0;
+}
+
+unsigned char *fileWriterBuffer(FileWriter *writer)
+{
+    // Only waits when storage is lagging behind the link by a whole ring
+    if (writer->current < 0) {
+        writer->current = spscRingAcquire(&writer->ring);
+    }
+    return writer->slots[writer->current].data;
+}
+
+void fileWriterCommit(FileWriter *writer, int start, int length, uint64_t offset)
+{
+    FileWriterSlot *slot = &writer->slots[writer->current];
+
+    slot->start = start;
+    slot->length = length;
+    slot->offset = offset;
+
+    writer->current = -1;
+    spscRingPublish(&writer->ring);
+}
+
+int fileWriterClose(FileWriter *writer)
+{
+    spscRingClose(&writer->ring);
+    pthread_join(writer->thread, NULL);
+
+    if (ftruncate(writer->fd, writer->end) < 0) {
+        perror("ftruncate");
+        writer->error = TRUE;
+    }
+
+    spscRingDestroy(&writer->ring);
+    free(writer->slots);
+    writer->slots = NULL;
+
+    if (close(writer->fd) < 0) {
+        writer->error = TRUE;
+    }
+    return writer->error ? -1 : 0;
+}
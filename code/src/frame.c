@@ -0,0 +1,213 @@
+// Frame encoder and table-driven frame parser implementation
+
+#include "frame.h"
+
+#define FALSE 0
+#define TRUE 1
+
+// Byte classes seen by the parser
+typedef enum
+{
+    CL_OTHER,
+    CL_FLAG,
+    CL_ESC,
+    CL_ADDRESS,          // Address only (ADDRESS_RC)
+    CL_CONTROL,          // Control only (UA, DISC, RR, REJ, I-frame)
+    CL_ADDRESS_CONTROL,  // Both an address and a control (ADDRESS_TM == CONTROL_SET)
+    CL_BCC1,             // Matches the expected BCC1 (only assigned in FP_C_RCV)
+    CL_NUM_CLASSES
+} ByteClass;
+
+typedef enum
+{
+    ACT_NONE,
+    ACT_ADDRESS,      // Save the address field
+    ACT_CONTROL,      // Save the control field and start a new payload
+    ACT_STORE,        // Append a payload byte
+    ACT_UNESCAPE,     // Append an escaped payload byte
+    ACT_SUPERVISION,  // Supervision frame complete
+    ACT_INFORMATION   // I-frame complete
+} Action;
+
+typedef struct
+{
+    unsigned char next;
+    unsigned char action;
+} Transition;
+
+static const unsigned char byteClass[256] = {
+    [FLAG] = CL_FLAG,
+    [ESC] = CL_ESC,
+    [ADDRESS_RC] = CL_ADDRESS,
+    [ADDRESS_TM] = CL_ADDRESS_CONTROL,
+    [CONTROL_UA] = CL_CONTROL,
+    [DISC] = CL_CONTROL,
+    [RR_0] = CL_CONTROL,
+    [RR_1] = CL_CONTROL,
+    [REJ_0] = CL_CONTROL,
+    [REJ_1] = CL_CONTROL,
+};
+
+// Entries not listed fall back to {FP_START, ACT_NONE}: the frame is dropped
+// and the parser hunts for the next FLAG.
+static const Transition transitions[FP_NUM_STATES][CL_NUM_CLASSES] = {
+    [FP_START] = {
+        [CL_FLAG] = {FP_FLAG_RCV, ACT_NONE},
+    },
+    [FP_FLAG_RCV] = {
+        [CL_FLAG] = {FP_FLAG_RCV, ACT_NONE},
+        [CL_ADDRESS] = {FP_A_RCV, ACT_ADDRESS},
+        [CL_ADDRESS_CONTROL] = {FP_A_RCV, ACT_ADDRESS},
+    },
+    [FP_A_RCV] = {
+        [CL_FLAG] = {FP_FLAG_RCV, ACT_NONE},
+        [CL_CONTROL] = {FP_C_RCV, ACT_CONTROL},
+        [CL_ADDRESS_CONTROL] = {FP_C_RCV, ACT_CONTROL},
+    },
+    [FP_C_RCV] = {
+        [CL_FLAG] = {FP_FLAG_RCV, ACT_NONE},
+        [CL_BCC1] = {FP_BCC_OK, ACT_NONE},
+    },
+    [FP_BCC_OK] = {
+        [CL_OTHER] = {FP_READING_DATA, ACT_STORE},
+        [CL_FLAG] = {FP_FLAG_RCV, ACT_SUPERVISION},
+        [CL_ESC] = {FP_DATA_FOUND_ESC, ACT_NONE},
+        [CL_ADDRESS] = {FP_READING_DATA, ACT_STORE},
+        [CL_CONTROL] = {FP_READING_DATA, ACT_STORE},
+        [CL_ADDRESS_CONTROL] = {FP_READING_DATA, ACT_STORE},
+        [CL_BCC1] = {FP_READING_DATA, ACT_STORE},
+    },
+    [FP_READING_DATA] = {
+        [CL_OTHER] = {FP_READING_DATA, ACT_STORE},
+        [CL_FLAG] = {FP_FLAG_RCV, ACT_INFORMATION},
+        [CL_ESC] = {FP_DATA_FOUND_ESC, ACT_NONE},
+        [CL_ADDRESS] = {FP_READING_DATA, ACT_STORE},
+        [CL_CONTROL] = {FP_READING_DATA, ACT_STORE},
+        [CL_ADDRESS_CONTROL] = {FP_READING_DATA, ACT_STORE},
+        [CL_BCC1] = {FP_READING_DATA, ACT_STORE},
+    },
+    [FP_DATA_FOUND_ESC] = {
+        // A FLAG right after ESC aborts the frame and opens the next one
+        [CL_OTHER] = {FP_READING_DATA, ACT_UNESCAPE},
+        [CL_FLAG] = {FP_FLAG_RCV, ACT_NONE},
+        [CL_ESC] = {FP_READING_DATA, ACT_UNESCAPE},
+        [CL_ADDRESS] = {FP_READING_DATA, ACT_UNESCAPE},
+        [CL_CONTROL] = {FP_READING_DATA, ACT_UNESCAPE},
+        [CL_ADDRESS_CONTROL] = {FP_READING_DATA, ACT_UNESCAPE},
+        [CL_BCC1] = {FP_READING_DATA, ACT_UNESCAPE},
+    },
+};
+
+int frameEncode(unsigned char *frame, unsigned char address, unsigned char control,
+                const struct iovec *segments, int numSegments)
+{
+    int index = 0;
+    unsigned char bcc2 = 0;
+
+    frame[index++] = FLAG;
+    frame[index++] = address;
+    frame[index++] = control;
+    frame[index++] = address ^ control;
+
+    for (int s = 0; s < numSegments; s++) {
+        const unsigned char *data = segments[s].iov_base;
+        for (size_t i = 0; i < segments[s].iov_len; i++) {
+            unsigned char byte = data[i];
+            bcc2 ^= byte;
+            if (byte == FLAG || byte == ESC) {
+                frame[index++] = ESC;
+                frame[index++] = byte ^ 0x20;
+            } else {
+                frame[index++] = byte;
+            }
+        }
+    }
+
+    if (bcc2 == FLAG || bcc2 == ESC) {
+        frame[index++] = ESC;
+        frame[index++] = bcc2 ^ 0x20;
+    } else {
+        frame[index++] = bcc2;
+    }
+    frame[index++] = FLAG;
+
+    return index;
+}
+
+void frameParserInit(FrameParser *parser, unsigned char *buffer, int capacity)
+{
+    parser->data = buffer;
+    parser->capacity = capacity;
+    frameParserReset(parser);
+}
+
+void frameParserReset(FrameParser *parser)
+{
+    parser->state = FP_START;
+    parser->address = 0;
+    parser->control = 0;
+    parser->bcc1 = 0;
+    parser->bcc2 = 0;
+    parser->length = 0;
+}
+
+int frameParserFeed(FrameParser *parser, const unsigned char *bytes, int numBytes,
+                    int *consumed, Frame *frame)
+{
+    int i = 0;
+
+    while (i < numBytes) {
+        unsigned char byte = bytes[i++];
+        unsigned char cl = byteClass[byte];
+        if (parser->state == FP_C_RCV && byte == parser->bcc1) {
+            cl = CL_BCC1;
+        }
+
+        const Transition *t = &transitions[parser->state][cl];
+        parser->state = t->next;
+
+        switch (t->action) {
+        case ACT_NONE:
+            break;
+        case ACT_ADDRESS:
+            parser->address = byte;
+            break;
+        case ACT_CONTROL:
+            parser->control = byte;
+            parser->bcc1 = parser->address ^ byte;
+            parser->bcc2 = 0;
+            parser->length = 0;
+            break;
+        case ACT_UNESCAPE:
+            byte ^= 0x20;
+            // fall through
+        case ACT_STORE:
+            if (parser->length == parser->capacity) {
+                // Longer than any valid frame, drop it
+                parser->state = FP_START;
+                break;
+            }
+            parser->data[parser->length++] = byte;
+            parser->bcc2 ^= byte;
+            break;
+        case ACT_SUPERVISION:
+            frame->address = parser->address;
+            frame->control = parser->control;
+            frame->length = 0;
+            frame->bcc2Ok = TRUE;
+            *consumed = i;
+            return 1;
+        case ACT_INFORMATION:
+            // XOR over the payload and BCC2 is zero when BCC2 matches
+            frame->address = parser->address;
+            frame->control = parser->control;
+            frame->length = parser->length - 1;
+            frame->bcc2Ok = parser->bcc2 == 0;
+            *consumed = i;
+            return 1;
+        }
+    }
+
+    *consumed = i;
+    return 0;
+}
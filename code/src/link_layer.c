@@ -1,5 +1,7 @@
-#include "link_layer.h"
-#include "serial_port.h"
+#include "link_layer_async.h"
+#include "link_layer_ext.h"
+#include "serial_port_ext.h"
+#include "frame.h"
  
 #include <termios.h>
 #include <fcntl.h> 
@@ -8,41 +10,18 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
  
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
 #define BAUDRATE 38400  
  
-#define FLAG 0x7E
-#define ADDRESS_TM 0x03
-#define ADDRESS_RC 0x01
-#define DISC 0x0B
-#define CONTROL_UA 0x07
-#define CONTROL_SET 0x03
-#define CONTROL_SET_0 0x00
-#define CONTROL_SET_1 0x80
-#define REJ_0 0x54
-#define REJ_1 0x55
-#define RR_0 0xAA
-#define RR_1 0xAB
-#define ESCAPE 0x7D
-#define FLAG_REPLACEMENT 0x5E
-#define ESCAPE_REPLACEMENT 0x5D
-#define ESC 0x7D
 #define FALSE 0
 #define TRUE 1
 
-typedef enum
-{
-    START,
-    FLAG_RCV,
-    A_RCV,
-    C_RCV,
-    BCC_OK,
-    DATA_FOUND_ESC,
-    READING_DATA,
-    STOP_STATE
-} State;
+#define RX_BUFFER_SIZE 1024
  
  
 int alarmEnabled = FALSE;
@@ -54,12 +33,69 @@ int totalRejectedFrames = 0;
 int nRetransmissions = 0;
 int timeout = 0;
  
-int sequenceNumber = 0;
- 
-unsigned char controlField;
-unsigned char addressField;
+int sequenceNumber = 0;    // Sequence number of our next I-frame
+int rxSequenceNumber = 0;  // Sequence number expected from the peer
+int discReceived = FALSE;
  
 LinkLayerRole role;
+
+// I-frames (and the RR / REJ answering them) carry the address of the side
+// that sent the I-frame
+unsigned char localAddress = ADDRESS_TM;
+unsigned char peerAddress = ADDRESS_RC;
+
+// Bytes read from the serial port but not yet fed to the parser
+unsigned char rxBuffer[RX_BUFFER_SIZE];
+int rxHead = 0;
+int rxTail = 0;
+
+// Last I-frame sent by llwrite(), kept for retransmission
+unsigned char txFrame[MAX_FRAME_SIZE];
+
+// Payload of the last I-frame, BCC2 included
+unsigned char frameData[MAX_PAYLOAD_SIZE + 1];
+FrameParser parser;
+
+// I-frame from the peer accepted while waiting for an acknowledgement, kept
+// for the next llread()
+unsigned char pendingPacket[MAX_PAYLOAD_SIZE];
+int pendingLength = 0;
+
+int portFd = -1;
+
+// Asynchronous requests (see llpoll())
+typedef struct
+{
+    unsigned char frame[MAX_FRAME_SIZE];
+    int frameSize;
+    int bufSize;
+    LlCallback callback;
+    void *context;
+} AsyncWrite;
+
+typedef struct
+{
+    unsigned char *packet;
+    LlCallback callback;
+    void *context;
+} AsyncRead;
+
+AsyncWrite asyncWrites[LL_ASYNC_QUEUE_SIZE];
+int asyncWriteHead = 0;
+int asyncWriteCount = 0;
+int asyncWriteInFlight = FALSE;  // The head write was sent and waits for its RR
+int asyncRetries = 0;
+
+AsyncRead asyncReads[LL_ASYNC_QUEUE_SIZE];
+int asyncReadHead = 0;
+int asyncReadCount = 0;
+
+// New I-frame from the peer, held unacknowledged until a read is queued
+unsigned char heldPacket[MAX_PAYLOAD_SIZE];
+int heldLength = 0;
+
+int epollFd = -1;
+int timerFd = -1;  // Retransmission timer, replaces the alarm in async mode
  
 void alarmHandler(int signal)
 {
@@ -92,224 +128,147 @@ int writeSupervisionFrame(unsigned char control, unsigned char address) {
     int bytes = writeBytesSerialPort(buf, 5);
     return (bytes == 5) ? 0 : -1;
 }
- 
-void processReceivedByte(State* state, unsigned char byte, LinkLayerRole role) {
-    switch (role) {
-        case LlTx:
-            switch (*state) {
-                    case START:
-                        if (byte == FLAG) {
-                            *state = FLAG_RCV;
-                        }
-                        break;
- 
-                    case FLAG_RCV:
-                        if (byte == ADDRESS_RC || byte == ADDRESS_TM) {
-                            *state = A_RCV;
-                            addressField = byte;
-                        }
-                        else if (byte != FLAG) {
-                            *state = START; 
-                        }
-                        break;
- 
-                    case A_RCV:
-                        if (byte == CONTROL_UA || byte == DISC || byte == RR_0 || byte == RR_1 || byte == REJ_0 || byte == REJ_1) {
-                            *state = C_RCV;
-                            controlField = byte;
-                        }
-                        else if (byte == FLAG) {
-                            *state = FLAG_RCV; 
-                        }
-                        else {
-                            *state = START; 
-                        }
-                        break;
- 
-                    case C_RCV:
-                        if (byte == (controlField ^ addressField)) {
-                            *state = BCC_OK;
-                        }
-                        else if (byte == FLAG) {
-                            *state = FLAG_RCV; 
-                        }
-                        else {
-                            *state = START; 
-                        }
-                        break;
- 
-                    case BCC_OK:
-                        if (byte == FLAG) {
-                            *state = STOP_STATE; 
-                        }
-                        else {
-                            *state = START; 
-                        }
-                        break;
- 
-                    default:
-                        *state = START;
-                        break;
-                }
-            break;
-            case LlRx: {
-                        switch (*state) {
-                            case START:  
-                                if (byte == FLAG) {
-                                    *state = FLAG_RCV;
-                                }
-                                break;
- 
-                            case FLAG_RCV:  
-                                if (byte == ADDRESS_TM || byte == ADDRESS_RC) {
-                                    *state = A_RCV;
-                                } else if (byte != FLAG) {  
-                                    *state = START;
-                                }
-                                break;
- 
-                            case A_RCV: 
-                                if (byte == CONTROL_SET || byte == DISC || byte == CONTROL_UA) {
-                                    *state = C_RCV;
-                                } else if (byte == FLAG) {  
-                                    *state = FLAG_RCV;
-                                } else {
-                                    *state = START;  
-                                }
-                                break;
- 
-                            case C_RCV:  
-                                if (byte == (ADDRESS_TM ^ CONTROL_SET) || byte == (ADDRESS_TM ^ DISC) || byte == (ADDRESS_RC ^ CONTROL_UA)) {
-                                    *state = BCC_OK;
-                                } else if (byte == FLAG) {  
-                                    *state = FLAG_RCV;
-                                } else {
-                                    *state = START;  
-                                }
-                                break;
- 
-                            case BCC_OK:  
-                                if (byte == FLAG) {
-                                    *state = STOP_STATE;  
-                                } else {
-                                    *state = START;  
-                                }
-                                break;
- 
-                            default:
-                                *state = START;  
-                                break;
- 
-                    }
- 
-                break;
-            }
+
+// Feed received bytes to the frame parser until a complete frame comes out.
+// If untilAlarm is TRUE, gives up as soon as the alarm fires.
+// Returns 1 if a frame was received, 0 otherwise.
+int receiveFrame(Frame *frame, int untilAlarm) {
+    while (!untilAlarm || alarmEnabled) {
+        if (rxHead == rxTail) {
+            int bytes = readBytesSerialPort(rxBuffer, RX_BUFFER_SIZE);
+            rxHead = 0;
+            rxTail = bytes > 0 ? bytes : 0;
+            continue;
+        }
+
+        int consumed;
+        int complete = frameParserFeed(&parser, rxBuffer + rxHead, rxTail - rxHead, &consumed, frame);
+        rxHead += consumed;
+        if (complete) {
+            return 1;
+        }
     }
+    return 0;
 }
- 
-unsigned char readControl() {
-    unsigned char controlField = 0, addressField = 0;
-    State state = START;
-    while(state != STOP_STATE && alarmEnabled) {
-        unsigned char byte;
-        if (readByteSerialPort(&byte) > 0) {
-            switch (state)
-            {
-            case START:
-                if (byte == FLAG) {
-                    state = FLAG_RCV;
-                }
-                break;
-            case FLAG_RCV:
-                if (byte == ADDRESS_RC || byte == ADDRESS_TM) {
-                    state = A_RCV;
-                    addressField = byte;
-                } else if (byte != FLAG) {
-                    state = START;
-                }
-                break;
-            case A_RCV:
-                if (byte == RR_0 || byte == RR_1 || byte == REJ_0 || byte == REJ_1 || byte == DISC) {
-                    state = C_RCV;
-                    controlField = byte;
-                } else if (byte == FLAG) {
-                    state = FLAG_RCV;
-                } else {
-                    state = START;
-                }
-                break;
-            case C_RCV:
-                if (byte == (controlField ^ addressField)) {
-                    state = BCC_OK;
-                } else if (byte == FLAG) {
-                    state = FLAG_RCV;
-                } else {
-                    state = START;
-                }
-                break;
-            case BCC_OK:
-                if (byte == FLAG) {
-                    state = STOP_STATE;
-                } else {
-                    state = START;
-                }
-                break;
-            default:
-                break;
-            }
-        }
+
+int isInformationFrame(const Frame *frame) {
+    return frame->address == peerAddress && frame->length > 0 && (frame->control == RR_0 || frame->control == RR_1);
+}
+
+// Check an I-frame from the peer and answer it.
+// Returns TRUE if it is a new frame (payload in frameData), FALSE if it is a
+// duplicate or was rejected.
+int acceptInformationFrame(const Frame *frame) {
+    int frameSequence = frame->control == RR_1 ? 1 : 0;
+
+    if (frameSequence != rxSequenceNumber) {
+        // Duplicate whose acknowledgement was lost
+        writeSupervisionFrame(rxSequenceNumber == 0 ? RR_0 : RR_1, peerAddress);
+        return FALSE;
+    }
+
+    if (!frame->bcc2Ok) {
+        writeSupervisionFrame(frameSequence == 0 ? REJ_0 : REJ_1, peerAddress);
+        printf("Received BCC2 differs from calculated BCC2. Sending REJ: 0x%x \n", frameSequence == 0 ? REJ_0 : REJ_1);
+        return FALSE;
+    }
+
+    rxSequenceNumber ^= 1;
+    writeSupervisionFrame(rxSequenceNumber == 0 ? RR_0 : RR_1, peerAddress);
+    return TRUE;
+}
+
+// Answer frames that arrive while waiting for something else: duplicate
+// I-frames are acknowledged again (new ones are left for the peer to
+// retransmit) and a repeated SET means our UA was lost or the transmitter
+// reconnected.
+void handleUnexpectedFrame(const Frame *frame) {
+    if (isInformationFrame(frame) && (frame->control == RR_1 ? 1 : 0) != rxSequenceNumber) {
+        writeSupervisionFrame(rxSequenceNumber == 0 ? RR_0 : RR_1, peerAddress);
+    }
+    else if (role == LlRx && frame->control == CONTROL_SET && frame->length == 0) {
+        sequenceNumber = 0;
+        rxSequenceNumber = 0;
+        discReceived = FALSE;
+        pendingLength = 0;
+        writeSupervisionFrame(CONTROL_UA, ADDRESS_RC);
     }
-    return controlField;
 }
  
+// Close the epoll instance and the timer, if open.
+void closeAsyncFds() {
+    if (epollFd >= 0) {
+        close(epollFd);
+        epollFd = -1;
+    }
+    if (timerFd >= 0) {
+        close(timerFd);
+        timerFd = -1;
+    }
+}
+
+// Drop every queued request (without running its callback) and the held
+// frame, and close the descriptors, so that the next connection starts clean.
+void resetAsync() {
+    closeAsyncFds();
+    asyncWriteHead = 0;
+    asyncWriteCount = 0;
+    asyncWriteInFlight = FALSE;
+    asyncRetries = 0;
+    asyncReadHead = 0;
+    asyncReadCount = 0;
+    heldLength = 0;
+}
+
 ////////////////////////////////////////////////
 // LLOPEN
 ////////////////////////////////////////////////
  int llopen(LinkLayer connectionParameters)
 {
-    int fd = openSerialPort(connectionParameters.serialPort, connectionParameters.baudRate);
+    resetAsync();
+    int fd = openSerialPortExt(connectionParameters.serialPort, connectionParameters.baudRate);
  
     if (fd < 0) return -1;
  
+    portFd = fd;
     nRetransmissions = connectionParameters.nRetransmissions;
     timeout = connectionParameters.timeout;
-    State state = START;
     role = connectionParameters.role;  
+    frameParserInit(&parser, frameData, sizeof(frameData));
+    rxHead = rxTail = 0;
+    sequenceNumber = 0;
+    rxSequenceNumber = 0;
+    discReceived = FALSE;
+    pendingLength = 0;
+    localAddress = role == LlTx ? ADDRESS_TM : ADDRESS_RC;
+    peerAddress = role == LlTx ? ADDRESS_RC : ADDRESS_TM;
+
+    Frame frame;
+    int connected = FALSE;
  
     switch (connectionParameters.role) {
         case LlTx:
-            while (alarmCount <= nRetransmissions) {
+            while (!connected && alarmCount <= nRetransmissions) {
                 if (!alarmEnabled) {
                     writeSupervisionFrame(CONTROL_SET, ADDRESS_TM);
                     setupAlarm(timeout); 
                 }
  
-                while (state != STOP_STATE && alarmEnabled) {  
-                    unsigned char byte;
-                    if (readByteSerialPort(&byte) > 0) {
-                        processReceivedByte(&state, byte, connectionParameters.role);  
-                    }
-                }
- 
-                if (state == STOP_STATE) {
-                    break;
-                } else {
-                    alarmEnabled = FALSE;
-                    state = START; 
+                if (receiveFrame(&frame, TRUE) && frame.control == CONTROL_UA) {
+                    connected = TRUE;
                 }
             }
+            resetAlarm();
  
-            if (state != STOP_STATE) return -1;
+            if (!connected) return -1;
             break;
  
         case LlRx:
-            while (state != STOP_STATE) {  
-                unsigned char byte;
-                if (readByteSerialPort(&byte) > 0) {
-                    processReceivedByte(&state, byte, connectionParameters.role);
+            while (!connected) {  
+                if (receiveFrame(&frame, FALSE) && frame.control == CONTROL_SET && frame.length == 0) {
+                    connected = TRUE;
                 }
             }
-            state = START;
             writeSupervisionFrame(CONTROL_UA, ADDRESS_RC);
             break;
  
@@ -324,73 +283,84 @@ unsigned char readControl() {
 // LLWRITE
 ////////////////////////////////////////////////
 int llwrite(const unsigned char *buf, int bufSize) {
-    unsigned int frameSize = 6;
-    for (int i = 0; i < bufSize; i++) {
-        if (buf[i] == FLAG || buf[i] == ESC) {
-            frameSize++;
-        }
-        frameSize++;
+    struct iovec iov = {(void *) buf, bufSize};
+    return llwritev(&iov, 1);
+}
+
+int llwritev(const struct iovec *iov, int iovCount) {
+    int frameSize = llencode(iov, iovCount, txFrame);
+    if (frameSize < 0) {
+        return -1;
     }
- 
-    unsigned char* frame = (unsigned char*) malloc(frameSize);
- 
-    if (!frame) {
+
+    if (llwriteframe(txFrame, frameSize) < 0) {
         return -1;
     }
-    int index = 0;
-    frame[index++] = FLAG;
-    frame[index++] = ADDRESS_TM;
-    frame[index++] = sequenceNumber == 0 ? RR_0 : RR_1;
-    frame[index++] = frame[1] ^ frame[2];
- 
-    // Calculate BCC2 prior to stuffing
-    unsigned char bcc2 = 0;
-    for (int i = 0; i < bufSize; i++) {
-        bcc2 ^= buf[i];
-    }
- 
-    // Stuff bytes
-    for (int i = 0; i < bufSize; i++) {
-        if (buf[i] == FLAG || buf[i] == ESC) {
-            frame[index++] = ESC;
-            frame[index++] = buf[i] ^ 0x20;
-        } else {
-            frame[index++] = buf[i];
-        }
+
+    int bufSize = 0;
+    for (int i = 0; i < iovCount; i++) {
+        bufSize += iov[i].iov_len;
+    }
+    return bufSize;
+}
+
+int llencode(const struct iovec *iov, int iovCount, unsigned char *frame) {
+    int bufSize = 0;
+    for (int i = 0; i < iovCount; i++) {
+        bufSize += iov[i].iov_len;
     }
-    frame[index++] = bcc2;
-    frame[index++] = FLAG;
+    if (bufSize > MAX_PAYLOAD_SIZE) {
+        return -1;
+    }
+
+    // The control field and BCC1 are set by llwriteframe()
+    return frameEncode(frame, localAddress, RR_0, iov, iovCount);
+}
+
+int llwriteframe(unsigned char *frame, int frameSize) {
+    // The header is never stuffed, so it can be patched in place
+    frame[2] = sequenceNumber == 0 ? RR_0 : RR_1;
+    frame[3] = frame[1] ^ frame[2];
  
     resetAlarm();
 
  
     while (alarmCount <= nRetransmissions) {
         if (!alarmEnabled) {
-            if(writeBytesSerialPort(frame, frameSize) > 0) {
- 
-                setupAlarm(timeout);
-                unsigned char controlField = readControl();
- 
-                if(controlField == 0) {
-                    continue;
-                }
+            if (writeBytesSerialPort(frame, frameSize) <= 0) {
+                continue;
+            }
+            setupAlarm(timeout);
+        }
 
-                else if (controlField == RR_1 || controlField == RR_0) {
-                    sequenceNumber = controlField == RR_1 ? 1 : 0;
-                    free(frame);
-                    resetAlarm();
-                    return bufSize;
-                }   
-
-                else if (controlField == REJ_0 || controlField == REJ_1) {
-                    resetAlarm();
-                    totalRejectedFrames++;
-                } 
+        Frame reply;
+        if (!receiveFrame(&reply, TRUE)) {
+            continue;
+        }
+        if (reply.address != localAddress || reply.length > 0) {
+            if (pendingLength == 0 && isInformationFrame(&reply) && acceptInformationFrame(&reply)) {
+                // The peer is sending at the same time (e.g. to abort)
+                memcpy(pendingPacket, frameData, reply.length);
+                pendingLength = reply.length;
+            }
+            else {
+                handleUnexpectedFrame(&reply);
             }
+            continue;
         }
+
+        // Answers to an earlier copy of a frame are stale and ignored
+        if (reply.control == (sequenceNumber == 0 ? RR_1 : RR_0)) {
+            sequenceNumber ^= 1;
+            resetAlarm();
+            return frameSize;
+        }   
+
+        else if (reply.control == (sequenceNumber == 0 ? REJ_0 : REJ_1)) {
+            resetAlarm();
+            totalRejectedFrames++;
+        } 
     }
- 
-    free(frame);
 
     return -1;
 }
@@ -400,136 +370,412 @@ int llwrite(const unsigned char *buf, int bufSize) {
 // LLREAD
 ////////////////////////////////////////////////
 int llread(unsigned char *packet) {
-    unsigned char byte, controlField;
-    State state = START;
-    int index = 0;
- 
-    while(state != STOP_STATE) {
-        if (readByteSerialPort(&byte) > 0) {
-            switch (state)
-            {
-            case START:
-                if(byte == FLAG) state = FLAG_RCV;
-                break;
-            case FLAG_RCV:
-                if(byte == ADDRESS_TM) state = A_RCV;
-                else if(byte != FLAG) state = START;
-                break;
-            case A_RCV:
-                if(byte == RR_0 || byte == RR_1) {
-                    controlField = byte;
-                    state = C_RCV;
-                } else if(byte == DISC) {
-                    writeSupervisionFrame(CONTROL_UA, ADDRESS_RC);
-                    return 0;
-                } else if(byte == FLAG) state = FLAG_RCV;
-                else state = START;
-                break;
-            case C_RCV:
-                if(byte == (ADDRESS_TM ^ controlField)) state = BCC_OK;
-                else if(byte == FLAG) state = FLAG_RCV;
-                else state = START;
-                break;
-            case BCC_OK:
-                if(byte == ESC) state = DATA_FOUND_ESC;
-                else if(byte == FLAG) {
-                    state = STOP_STATE;
-                    unsigned char bcc2 = packet[index-1];
-                    unsigned char bcc2Calc = 0;
-                    for(int i = 0; i < index - 1; i++) {
-                        bcc2Calc ^= packet[i];
-                    }
+    Frame frame;
+
+    if (pendingLength > 0) {
+        int length = pendingLength;
+        memcpy(packet, pendingPacket, length);
+        pendingLength = 0;
+        return length;
+    }
+
+    // The receiver waits for the transmitter indefinitely, the transmitter
+    // only as long as it would retransmit its own frames
+    resetAlarm();
+    while (role == LlRx || alarmCount <= nRetransmissions) {
+        if (role == LlTx) {
+            setupAlarm(timeout);
+        }
+        if (!receiveFrame(&frame, role == LlTx)) {
+            continue;
+        }
+
+        if (frame.control == DISC && frame.length == 0) {
+            discReceived = TRUE;
+            resetAlarm();
+            return 0;
+        }
+
+        if (!isInformationFrame(&frame)) {
+            handleUnexpectedFrame(&frame);
+            continue;
+        }
+
+        if (acceptInformationFrame(&frame)) {
+            memcpy(packet, frameData, frame.length);
+            if (packet[0] == 2) {
+                totalNumFrames++;
+            }
+            resetAlarm();
+            return frame.length;
+        }
+    }
+
+    resetAlarm();
+    return -1;
+}
+ 
+ 
+int llpending(void) {
+    return pendingLength > 0;
+}
 
-                    if(bcc2 == bcc2Calc) {
-                        writeSupervisionFrame(controlField == RR_0 ? RR_1 : RR_0, ADDRESS_TM);
-                        if (packet[0] == 2) {
-                            totalNumFrames++;
-                        }
-                        return index - 1;
+int llreopen(void) {
+    Frame frame;
+
+    if (role != LlRx || !discReceived) {
+        return -1;
+    }
+    if (writeSupervisionFrame(DISC, ADDRESS_RC) < 0) {
+        return -1;
+    }
+
+    // The transmitter's UA is not needed: its next SET ends the wait
+    while (TRUE) {
+        if (!receiveFrame(&frame, FALSE)) {
+            continue;
+        }
+        if (frame.control == DISC && frame.length == 0) {
+            // Our DISC was lost
+            writeSupervisionFrame(DISC, ADDRESS_RC);
+        }
+        else if (frame.control == CONTROL_SET && frame.length == 0) {
+            handleUnexpectedFrame(&frame);
+            return 1;
+        }
+    }
+}
+ 
+ 
+////////////////////////////////////////////////
+// ASYNC
+////////////////////////////////////////////////
+// Create the epoll instance watching the serial port and the timer.
+int setupAsync() {
+    if (epollFd >= 0) {
+        return 0;
+    }
+
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    epollFd = epoll_create1(0);
+    if (timerFd < 0 || epollFd < 0) {
+        perror("llfd");
+        closeAsyncFds();
+        return -1;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN};
+    event.data.fd = portFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, portFd, &event) < 0) {
+        perror("epoll_ctl");
+        closeAsyncFds();
+        return -1;
+    }
+    event.data.fd = timerFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event) < 0) {
+        perror("epoll_ctl");
+        closeAsyncFds();
+        return -1;
+    }
+    return 0;
+}
+
+void armTimer(int seconds) {
+    struct itimerspec spec = {{0, 0}, {seconds, 0}};
+    timerfd_settime(timerFd, 0, &spec, NULL);
+}
+
+// Send the write at the head of the queue, stamped with the current sequence number.
+void sendAsyncWrite() {
+    AsyncWrite *request = &asyncWrites[asyncWriteHead];
+    request->frame[2] = sequenceNumber == 0 ? RR_0 : RR_1;
+    request->frame[3] = request->frame[1] ^ request->frame[2];
+
+    writeBytesSerialPort(request->frame, request->frameSize);
+    asyncWriteInFlight = TRUE;
+    armTimer(timeout);
+}
+
+// Remove the head write and run its callback.
+void completeAsyncWrite(int result) {
+    AsyncWrite *request = &asyncWrites[asyncWriteHead];
+    LlCallback callback = request->callback;
+    void *context = request->context;
+
+    asyncWriteHead = (asyncWriteHead + 1) % LL_ASYNC_QUEUE_SIZE;
+    asyncWriteCount--;
+    asyncWriteInFlight = FALSE;
+    asyncRetries = 0;
+    armTimer(0);
+
+    callback(context, result);
+}
+
+// Remove the head read and run its callback.
+void completeAsyncRead(int result) {
+    AsyncRead *request = &asyncReads[asyncReadHead];
+    LlCallback callback = request->callback;
+    void *context = request->context;
+
+    asyncReadHead = (asyncReadHead + 1) % LL_ASYNC_QUEUE_SIZE;
+    asyncReadCount--;
+
+    callback(context, result);
+}
+
+// Hand the held I-frame to the oldest read and acknowledge it.
+void deliverHeldPacket() {
+    AsyncRead *request = &asyncReads[asyncReadHead];
+    int length = heldLength;
+
+    memcpy(request->packet, heldPacket, length);
+    heldLength = 0;
+    rxSequenceNumber ^= 1;
+    writeSupervisionFrame(rxSequenceNumber == 0 ? RR_0 : RR_1, peerAddress);
+    if (request->packet[0] == 2) {
+        totalNumFrames++;
+    }
+
+    completeAsyncRead(length);
+}
+
+// Give up on every request after the link was lost.
+// Returns the number of callbacks run.
+int failAsync() {
+    int callbacks = 0;
+    while (asyncWriteCount > 0) {
+        completeAsyncWrite(-1);
+        callbacks++;
+    }
+    while (asyncReadCount > 0) {
+        completeAsyncRead(-1);
+        callbacks++;
+    }
+    return callbacks;
+}
+
+// Returns the number of callbacks run.
+int handleAsyncFrame(const Frame *frame) {
+    if (frame->control == DISC && frame->length == 0) {
+        discReceived = TRUE;
+        int callbacks = 0;
+        while (asyncReadCount > 0) {
+            completeAsyncRead(0);
+            callbacks++;
+        }
+        return callbacks;
+    }
+
+    if (isInformationFrame(frame)) {
+        if (heldLength > 0) {
+            // Retransmission of the frame already held
+            return 0;
+        }
+        if ((frame->control == RR_1 ? 1 : 0) == rxSequenceNumber && frame->bcc2Ok) {
+            // New frame: keep it until a read takes it
+            memcpy(heldPacket, frameData, frame->length);
+            heldLength = frame->length;
+            if (asyncReadCount > 0) {
+                deliverHeldPacket();
+                return 1;
+            }
+            return 0;
+        }
+        acceptInformationFrame(frame);
+        return 0;
+    }
+
+    if (frame->address != localAddress || frame->length > 0) {
+        handleUnexpectedFrame(frame);
+        return 0;
+    }
+
+    if (!asyncWriteInFlight) {
+        return 0;
+    }
+    // Answers to an earlier copy of a frame are stale and ignored
+    if (frame->control == (sequenceNumber == 0 ? RR_1 : RR_0)) {
+        int bufSize = asyncWrites[asyncWriteHead].bufSize;
+        sequenceNumber ^= 1;
+        completeAsyncWrite(bufSize);
+        return 1;
+    }
+    if (frame->control == (sequenceNumber == 0 ? REJ_0 : REJ_1)) {
+        totalRejectedFrames++;
+        sendAsyncWrite();
+    }
+    return 0;
+}
+
+int llwrite_async(const unsigned char *buf, int bufSize, LlCallback callback, void *context) {
+    if (asyncWriteCount == LL_ASYNC_QUEUE_SIZE || setupAsync() < 0) {
+        return -1;
+    }
+
+    AsyncWrite *request = &asyncWrites[(asyncWriteHead + asyncWriteCount) % LL_ASYNC_QUEUE_SIZE];
+    struct iovec iov = {(void *) buf, bufSize};
+    request->frameSize = llencode(&iov, 1, request->frame);
+    if (request->frameSize < 0) {
+        return -1;
+    }
+    request->bufSize = bufSize;
+    request->callback = callback;
+    request->context = context;
+    asyncWriteCount++;
+    return 0;
+}
+
+int llread_async(unsigned char *packet, LlCallback callback, void *context) {
+    if (asyncReadCount == LL_ASYNC_QUEUE_SIZE || setupAsync() < 0) {
+        return -1;
+    }
+
+    AsyncRead *request = &asyncReads[(asyncReadHead + asyncReadCount) % LL_ASYNC_QUEUE_SIZE];
+    request->packet = packet;
+    request->callback = callback;
+    request->context = context;
+    asyncReadCount++;
+    return 0;
+}
+
+int llpoll(int timeoutMs) {
+    if (setupAsync() < 0) {
+        return -1;
+    }
+
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += timeoutMs % 1000 * 1000000L;
+
+    int callbacks = 0;
+    while (TRUE) {
+        // Work that needs no I/O: a frame waiting for a read, the next write
+        if (heldLength > 0 && asyncReadCount > 0) {
+            deliverHeldPacket();
+            callbacks++;
+        }
+        while (discReceived && asyncReadCount > 0) {
+            completeAsyncRead(0);
+            callbacks++;
+        }
+        if (!asyncWriteInFlight && asyncWriteCount > 0) {
+            sendAsyncWrite();
+        }
+
+        // Bytes already buffered are parsed before waiting for more. Once a
+        // callback ran, only what is ready is served.
+        if (rxHead == rxTail) {
+            int wait = 0;
+            if (callbacks == 0 && timeoutMs < 0) {
+                wait = -1;
+            }
+            else if (callbacks == 0) {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                long remaining = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+                wait = remaining > 0 ? remaining : 0;
+            }
+
+            struct epoll_event events[2];
+            int ready = epoll_wait(epollFd, events, 2, wait);
+            if (ready < 0) {
+                return -1;
+            }
+            if (ready == 0) {
+                return callbacks;
+            }
+
+            for (int i = 0; i < ready; i++) {
+                if (events[i].data.fd == timerFd) {
+                    uint64_t expirations;
+                    if (read(timerFd, &expirations, sizeof(expirations)) <= 0 || !asyncWriteInFlight) {
+                        continue;
                     }
-                    else {
-                        writeSupervisionFrame(controlField == RR_0 ? REJ_0 : REJ_1, ADDRESS_TM);
-                        printf("Received BCC2 differs from calculated BCC2. Sending REJ: 0x%x \n", controlField == RR_0 ? REJ_0 : REJ_1);
-                        return -1;
+                    totalNumRetransmissions++;
+                    if (++asyncRetries > nRetransmissions) {
+                        return callbacks + failAsync();
                     }
+                    printf("Timeout #%d\n", asyncRetries);
+                    sendAsyncWrite();
                 }
                 else {
-                    packet[index++] = byte;
+                    int bytes = readBytesSerialPort(rxBuffer, RX_BUFFER_SIZE);
+                    rxHead = 0;
+                    rxTail = bytes > 0 ? bytes : 0;
                 }
-                break;
-            case DATA_FOUND_ESC:
-                state = BCC_OK;
-                if(byte == FLAG_REPLACEMENT) packet[index++] = FLAG;
-                else if(byte == ESCAPE_REPLACEMENT) packet[index++] = ESC;
-                break;
-            default:
-                break;
+            }
+        }
+
+        while (rxHead < rxTail) {
+            Frame frame;
+            int consumed;
+            int complete = frameParserFeed(&parser, rxBuffer + rxHead, rxTail - rxHead, &consumed, &frame);
+            rxHead += consumed;
+            if (complete) {
+                callbacks += handleAsyncFrame(&frame);
             }
         }
     }
-    return -1;
 }
- 
- 
+
+int llfd(void) {
+    return setupAsync() < 0 ? -1 : epollFd;
+}
+
 ////////////////////////////////////////////////
 // LLCLOSE
 ////////////////////////////////////////////////
 int llclose(int showStatistics)
 {
-    State state = START;
+    Frame frame;
+    int closed = FALSE;
  
+    resetAsync();
     resetAlarm();
     switch (role) {
     case LlTx:
-        while (alarmCount <= nRetransmissions) {
+        while (!closed && alarmCount <= nRetransmissions) {
             if (!alarmEnabled) {
                 if (writeSupervisionFrame(DISC, ADDRESS_TM) < 0) {
-                    return -1;
+                    break;
                 }
                 setupAlarm(timeout); 
             }
  
-            while (state != STOP_STATE && alarmEnabled) {
-                unsigned char byte;
-                if (readByteSerialPort(&byte) > 0) {
-                    processReceivedByte(&state, byte, LlTx);
-                }
-            }
- 
-            if (state == STOP_STATE) {
-                break;
-            } else {
-                alarmEnabled = FALSE;
-                state = START;
+            if (receiveFrame(&frame, TRUE) && frame.control == DISC) {
+                closed = TRUE;
             }
         }
+        resetAlarm();
  
-        if (state != STOP_STATE) {
-            return -1;
-        }
- 
-        if (writeSupervisionFrame(CONTROL_UA, ADDRESS_RC) < 0) {
-            return -1;
+        if (closed && writeSupervisionFrame(CONTROL_UA, ADDRESS_RC) < 0) {
+            closed = FALSE;
         }
         break;
  
     case LlRx:
-        while (state != STOP_STATE) {
-            unsigned char byte;
-            if (readByteSerialPort(&byte) > 0) {
-                processReceivedByte(&state, byte, LlRx);
+        while (!discReceived) {
+            if (receiveFrame(&frame, FALSE)) {
+                if (frame.control == DISC) {
+                    discReceived = TRUE;
+                } else {
+                    handleUnexpectedFrame(&frame);
+                }
             }
         }
  
         if (writeSupervisionFrame(DISC, ADDRESS_RC) < 0) {
-            return -1;
+            break;
         }
  
-        state = START;
-        while (state != STOP_STATE) {
-            unsigned char byte;
-            if (readByteSerialPort(&byte) > 0) {
-                processReceivedByte(&state, byte, LlRx);
+        while (!closed) {
+            if (receiveFrame(&frame, FALSE)) {
+                if (frame.control == CONTROL_UA) {
+                    closed = TRUE;
+                } else if (frame.control == DISC) {
+                    // Our DISC was lost
+                    writeSupervisionFrame(DISC, ADDRESS_RC);
+                }
             }
         }
         break;
@@ -538,7 +784,13 @@ int llclose(int showStatistics)
         return -1;
     }
  
+    // The port is closed even if the peer did not answer, so it can be
+    // opened again
     int clstat = closeSerialPort();
+    portFd = -1;
+    if (!closed) {
+        return -1;
+    }
     if (showStatistics) {
         printf("Connection closed. Statistics: \n");
         if (role == LlTx) {
@@ -0,0 +1,112 @@
+// Application packet format implementation
+
+#include "packet.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int addTlv(unsigned char *packet, int size, unsigned char type, const void *value, int length) {
+    if (length > 255 || size + 2 + length > MAX_PAYLOAD_SIZE) {
+        return -1;
+    }
+
+    packet[size++] = type;
+    packet[size++] = length;
+    memcpy(packet + size, value, length);
+    return size + length;
+}
+
+int addNumberTlv(unsigned char *packet, int size, unsigned char type, uint64_t value) {
+    // Smallest number of bytes holding value (at least one), big-endian
+    int length = 1;
+    while (length < 8 && (value >> (8 * length)) != 0) {
+        length++;
+    }
+
+    unsigned char bytes[8];
+    for (int j = 0; j < length; j++) {
+        bytes[length - 1 - j] = value & 0xFF;
+        value >>= 8;
+    }
+    return addTlv(packet, size, type, bytes, length);
+}
+
+const unsigned char *nextTlv(const unsigned char *packet, int size, int *position, unsigned char *type, int *length) {
+    int i = *position;
+    if (i + 2 > size || i + 2 + packet[i + 1] > size) {
+        return NULL;
+    }
+
+    *type = packet[i];
+    *length = packet[i + 1];
+    *position = i + 2 + *length;
+    return packet + i + 2;
+}
+
+const unsigned char *findTlv(const unsigned char *packet, int size, unsigned char type, int *length) {
+    int position = 1;
+    unsigned char tlvType;
+    const unsigned char *value;
+    while ((value = nextTlv(packet, size, &position, &tlvType, length)) != NULL) {
+        if (tlvType == type) {
+            return value;
+        }
+    }
+    return NULL;
+}
+
+int getNumberTlv(const unsigned char *packet, int size, unsigned char type, uint64_t *value) {
+    int length;
+    const unsigned char *bytes = findTlv(packet, size, type, &length);
+    if (bytes == NULL || length > 8) {
+        return -1;
+    }
+
+    *value = 0;
+    for (int i = 0; i < length; i++) {
+        *value = (*value << 8) | bytes[i];
+    }
+    return 0;
+}
+
+int getControlPacket(unsigned char *packet, unsigned char cField, uint64_t fileLength, const char *filename) {
+    packet[0] = cField;
+    int size = addNumberTlv(packet, 1, TLV_FILE_SIZE, fileLength);
+    return addTlv(packet, size, TLV_FILE_NAME, filename, strlen(filename));
+}
+
+void getDataPacketHeader(unsigned int sequence, unsigned int dataLength, unsigned char *header) {
+    header[0] = PACKET_DATA;
+    header[1] = sequence;
+    header[2] = dataLength >> 8 & 0xFF;
+    header[3] = dataLength & 0xFF;
+}
+
+void getCopyPacket(unsigned int sequence, uint32_t block, uint32_t count, unsigned char *packet) {
+    packet[0] = PACKET_COPY;
+    packet[1] = sequence;
+    for (int i = 0; i < 4; i++) {
+        packet[2 + i] = block >> (24 - 8 * i) & 0xFF;
+        packet[6 + i] = count >> (24 - 8 * i) & 0xFF;
+    }
+}
+
+int parseControlPacket(const unsigned char *packet, int size, uint64_t *fileLength, char **filename) {
+    if (getNumberTlv(packet, size, TLV_FILE_SIZE, fileLength) < 0) {
+        return -1;
+    }
+
+    int length;
+    const unsigned char *name = findTlv(packet, size, TLV_FILE_NAME, &length);
+    if (name == NULL) {
+        return -1;
+    }
+
+    *filename = (char*) malloc(length + 1);
+    if (!*filename) {
+        return -1;
+    }
+    memcpy(*filename, name, length);
+    (*filename)[length] = '\0';
+    return 0;
+}
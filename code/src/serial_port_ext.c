@@ -0,0 +1,62 @@
+// Serial port extensions implementation
+
+#include "serial_port_ext.h"
+
+#include <stdio.h>
+#include <termios.h>
+#include <unistd.h>
+
+extern int fd;  // Serial port opened by openSerialPort()
+
+// Speed of the rates openSerialPort() does not know, or B0 for the others
+static speed_t extendedSpeed(int baudRate)
+{
+    switch (baudRate)
+    {
+    case 230400:
+        return B230400;
+    case 460800:
+        return B460800;
+    case 921600:
+        return B921600;
+    case 1000000:
+        return B1000000;
+    case 2000000:
+        return B2000000;
+    case 3000000:
+        return B3000000;
+    case 4000000:
+        return B4000000;
+    default:
+        return B0;
+    }
+}
+
+int openSerialPortExt(const char *serialPort, int baudRate)
+{
+    speed_t speed = extendedSpeed(baudRate);
+    if (speed == B0)
+    {
+        return openSerialPort(serialPort, baudRate);
+    }
+
+    // Configure the port at a known rate, then switch to the faster one
+    if (openSerialPort(serialPort, 115200) < 0)
+    {
+        return -1;
+    }
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == -1 || cfsetispeed(&tio, speed) == -1
+        || cfsetospeed(&tio, speed) == -1 || tcsetattr(fd, TCSANOW, &tio) == -1)
+    {
+        perror("tcsetattr");
+        closeSerialPort();
+        return -1;
+    }
+    return fd;
+}
+
+int readBytesSerialPort(unsigned char *bytes, int numBytes)
+{
+    return read(fd, bytes, numBytes);
+}
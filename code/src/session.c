@@ -0,0 +1,332 @@
+// Session mode implementation
+
+#include "session.h"
+#include "chunk_store.h"
+#include "file_transfer.h"
+#include "link_layer.h"
+#include "packet.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define PATH_SIZE 512
+#define LINE_SIZE 512
+#define NAME_SIZE 256
+
+const char *sessionArgument(const char *filename) {
+    size_t length = strlen(SESSION_PREFIX);
+    return strncmp(filename, SESSION_PREFIX, length) == 0 ? filename + length : NULL;
+}
+
+// Name a file is stored under on the other side: only its last component,
+// so a request can never reach outside the served directory
+static const char *baseName(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
+}
+
+static int endsWith(const char *name, const char *suffix) {
+    size_t nameLength = strlen(name), suffixLength = strlen(suffix);
+    return nameLength >= suffixLength && strcmp(name + nameLength - suffixLength, suffix) == 0;
+}
+
+// Files left by receptions in progress
+static int isPartial(const char *name) {
+    return endsWith(name, ".checkpoint") || endsWith(name, ".checkpoint.tmp") || endsWith(name, ".delta");
+}
+
+// Names a file can be stored or fetched under: not a directory, nor one of
+// the files the server keeps next to the received ones
+static int validName(const char *name) {
+    return name[0] != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0
+           && strcmp(name, CHUNK_STORE_NAME) != 0 && !isPartial(name);
+}
+
+// Send a packet made of a single string TLV.
+// Returns 0 on success or -1 on error.
+static int sendStringPacket(unsigned char cField, unsigned char type, const char *value) {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    packet[0] = cField;
+    int size = addTlv(packet, 1, type, value, strlen(value));
+    if (size < 0) {
+        return -1;
+    }
+    return llwrite(packet, size) < 0 ? -1 : 0;
+}
+
+// Copy a string TLV into value (size bytes, NUL terminated).
+// Returns 0 on success or -1 if it is missing.
+static int getStringTlv(const unsigned char *packet, int packetSize, unsigned char type, char *value, int size) {
+    int length;
+    const unsigned char *tlv = findTlv(packet, packetSize, type, &length);
+    if (tlv == NULL || length >= size) {
+        return -1;
+    }
+    memcpy(value, tlv, length);
+    value[length] = '\0';
+    return 0;
+}
+
+////////////////////////////////////////////////
+// CLIENT
+////////////////////////////////////////////////
+
+static int clientPut(const char *local, const char *remote) {
+    printf("put %s -> %s\n", local, remote);
+    // A file that cannot be read leaves the link usable, a lost link does not
+    return sendFile(local, remote) == 1 ? -1 : 0;
+}
+
+static int clientGet(const char *remote, const char *local) {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+
+    printf("get %s -> %s\n", remote, local);
+    if (sendStringPacket(PACKET_GET, TLV_FILE_NAME, remote) < 0) {
+        return -1;
+    }
+
+    int size = llread(packet);
+    if (size <= 0) {
+        return -1;
+    }
+
+    char message[NAME_SIZE];
+    switch (packet[0]) {
+        case PACKET_START:
+            return receiveFile(local, packet, &size) == 1 ? -1 : 0;
+
+        case PACKET_ERROR:
+            if (getStringTlv(packet, size, TLV_MESSAGE, message, NAME_SIZE) < 0) {
+                strcpy(message, "unknown error");
+            }
+            printf("get %s failed: %s\n", remote, message);
+            return 0;
+
+        default:
+            return -1;
+    }
+}
+
+static int clientList() {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+
+    packet[0] = PACKET_LIST;
+    if (llwrite(packet, 1) < 0) {
+        return -1;
+    }
+
+    // The listing spans as many LIST packets as needed, an empty one ends it
+    while (TRUE) {
+        int size = llread(packet);
+        if (size <= 0 || packet[0] != PACKET_LIST) {
+            return -1;
+        }
+        if (size == 1) {
+            return 0;
+        }
+
+        int position = 1;
+        unsigned char type;
+        int length;
+        const unsigned char *value;
+        char name[NAME_SIZE] = "";
+        while ((value = nextTlv(packet, size, &position, &type, &length)) != NULL) {
+            if (type == TLV_FILE_NAME && length < NAME_SIZE) {
+                memcpy(name, value, length);
+                name[length] = '\0';
+            }
+            else if (type == TLV_FILE_SIZE) {
+                uint64_t fileSize = 0;
+                for (int i = 0; i < length; i++) {
+                    fileSize = (fileSize << 8) | value[i];
+                }
+                printf("%12llu  %s\n", (unsigned long long) fileSize, name);
+            }
+        }
+    }
+}
+
+int sessionClient(const char *script) {
+    FILE *input = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+    if (input == NULL) {
+        perror(script);
+        return -1;
+    }
+
+    int result = 0;
+    char line[LINE_SIZE];
+    while (result == 0 && fgets(line, LINE_SIZE, input) != NULL) {
+        char command[16], first[NAME_SIZE], second[NAME_SIZE];
+        int args = sscanf(line, "%15s %255s %255s", command, first, second);
+        if (args < 1 || command[0] == '#') {
+            continue;
+        }
+
+        if (strcmp(command, "put") == 0 && args >= 2) {
+            result = clientPut(first, args == 3 ? second : baseName(first));
+        }
+        else if (strcmp(command, "get") == 0 && args >= 2) {
+            result = clientGet(first, args == 3 ? second : baseName(first));
+        }
+        else if (strcmp(command, "list") == 0) {
+            result = clientList();
+        }
+        else if (strcmp(command, "bye") == 0) {
+            break;
+        }
+        else {
+            printf("Unknown command: %s", line);
+        }
+    }
+
+    if (input != stdin) {
+        fclose(input);
+    }
+
+    if (result < 0) {
+        printf("Link lost, session ended\n");
+        return -1;
+    }
+
+    unsigned char packet[1] = {PACKET_BYE};
+    return llwrite(packet, 1) < 0 ? -1 : 0;
+}
+
+////////////////////////////////////////////////
+// SERVER
+////////////////////////////////////////////////
+
+static void serverPath(const char *directory, const char *name, char *path) {
+    snprintf(path, PATH_SIZE, "%s/%s", directory, baseName(name));
+}
+
+// Each request handler returns 0 when the session can go on, 1 if the client
+// disconnected or -1 if the link was lost.
+
+// Receive the file the client puts. Also returns 2 if the client sent another
+// request before the end of the file, left in packet and *size.
+static int serverPut(const char *directory, unsigned char *packet, int *size) {
+    uint64_t fileSize;
+    char *name;
+    if (parseControlPacket(packet, *size, &fileSize, &name) < 0) {
+        return 0;
+    }
+
+    if (!validName(baseName(name))) {
+        free(name);
+        return sendStringPacket(PACKET_ERROR, TLV_MESSAGE, "invalid file name");
+    }
+
+    char path[PATH_SIZE];
+    serverPath(directory, name, path);
+    free(name);
+
+    printf("put %s\n", path);
+    int result = receiveFile(path, packet, size);
+    return result < 0 ? 0 : result;
+}
+
+static int serverGet(const char *directory, const unsigned char *packet, int size) {
+    char name[NAME_SIZE], path[PATH_SIZE];
+    struct stat st;
+
+    if (getStringTlv(packet, size, TLV_FILE_NAME, name, NAME_SIZE) < 0 || !validName(baseName(name))) {
+        return sendStringPacket(PACKET_ERROR, TLV_MESSAGE, "invalid file name");
+    }
+    serverPath(directory, name, path);
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return sendStringPacket(PACKET_ERROR, TLV_MESSAGE, "no such file");
+    }
+
+    printf("get %s\n", path);
+    return sendFile(path, baseName(name)) == 1 ? -1 : 0;
+}
+
+static int serverList(const char *directory) {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    DIR *dir = opendir(directory);
+    if (dir == NULL) {
+        return sendStringPacket(PACKET_ERROR, TLV_MESSAGE, "cannot read directory");
+    }
+
+    packet[0] = PACKET_LIST;
+    int size = 1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char path[PATH_SIZE];
+        struct stat st;
+        serverPath(directory, entry->d_name, path);
+        if (isPartial(entry->d_name) || stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        int next = addTlv(packet, size, TLV_FILE_NAME, entry->d_name, strlen(entry->d_name));
+        if (next >= 0) {
+            next = addNumberTlv(packet, next, TLV_FILE_SIZE, st.st_size);
+        }
+        if (next < 0) {
+            // Packet full, send it and start the next one with this entry
+            if (llwrite(packet, size) < 0) {
+                closedir(dir);
+                return -1;
+            }
+            size = addTlv(packet, 1, TLV_FILE_NAME, entry->d_name, strlen(entry->d_name));
+            next = addNumberTlv(packet, size, TLV_FILE_SIZE, st.st_size);
+        }
+        size = next;
+    }
+    closedir(dir);
+
+    if (size > 1 && llwrite(packet, size) < 0) {
+        return -1;
+    }
+    return llwrite(packet, 1) < 0 ? -1 : 0;
+}
+
+int sessionServer(const char *directory) {
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int size;
+    int pending = FALSE;  // The next request was already read into packet
+
+    while (TRUE) {
+        if (!pending) {
+            size = llread(packet);
+        }
+        pending = FALSE;
+        if (size == 0) {
+            return 0;
+        }
+        if (size < 0) {
+            return -1;
+        }
+
+        int result = 0;
+        switch (packet[0]) {
+            case PACKET_START:
+                result = serverPut(directory, packet, &size);
+                if (result == 2) {
+                    pending = TRUE;
+                    result = 0;
+                }
+                break;
+
+            case PACKET_GET:
+                result = serverGet(directory, packet, size);
+                break;
+
+            case PACKET_LIST:
+                result = serverList(directory);
+                break;
+
+            case PACKET_BYE:
+                return 0;
+        }
+
+        if (result != 0) {
+            return result == 1 ? 0 : -1;
+        }
+    }
+}
@@ -0,0 +1,124 @@
+// Single-producer single-consumer ring implementation
+
+#include "spsc_ring.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Sleep while *word still holds value (a wake-up in between returns at once).
+static void futexWait(atomic_uint *word, unsigned int value)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void wakeUp(atomic_uint *word)
+{
+    atomic_fetch_add(word, 1);
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// The waiting flag and the positions use sequentially consistent operations:
+// a side that sets its flag and then finds no progress, and the other side
+// that moves its position and then reads the flag, cannot both miss each
+// other.
+static void wakeIfWaiting(atomic_int *waiting, atomic_uint *word)
+{
+    if (atomic_load(waiting)) {
+        wakeUp(word);
+    }
+}
+
+int spscRingInit(SpscRing *ring, unsigned int capacity)
+{
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        return -1;
+    }
+    ring->mask = capacity - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, 0);
+    atomic_init(&ring->producerWake, 0);
+    atomic_init(&ring->consumerWake, 0);
+    atomic_init(&ring->producerWaiting, 0);
+    atomic_init(&ring->consumerWaiting, 0);
+    return 0;
+}
+
+void spscRingDestroy(SpscRing *ring)
+{
+    // Nothing is allocated by the ring
+    (void) ring;
+}
+
+int spscRingAcquire(SpscRing *ring)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (1) {
+        if (atomic_load_explicit(&ring->closed, memory_order_acquire)) {
+            return -1;
+        }
+        // The positions run freely; their difference is the number of used slots
+        if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) <= ring->mask) {
+            return tail & ring->mask;
+        }
+
+        // Full: announce the wait, then check again before going to sleep
+        unsigned int wake = atomic_load(&ring->producerWake);
+        atomic_store(&ring->producerWaiting, 1);
+        if (!atomic_load(&ring->closed) && tail - atomic_load(&ring->head) > ring->mask) {
+            futexWait(&ring->producerWake, wake);
+        }
+        atomic_store(&ring->producerWaiting, 0);
+    }
+}
+
+void spscRingPublish(SpscRing *ring)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store(&ring->tail, tail + 1);
+    wakeIfWaiting(&ring->consumerWaiting, &ring->consumerWake);
+}
+
+int spscRingPeek(SpscRing *ring)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (1) {
+        if (head != atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+            return head & ring->mask;
+        }
+        if (atomic_load_explicit(&ring->closed, memory_order_acquire)) {
+            // Slots published just before closing are still consumed
+            if (head != atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+                return head & ring->mask;
+            }
+            return -1;
+        }
+
+        // Empty: announce the wait, then check again before going to sleep
+        unsigned int wake = atomic_load(&ring->consumerWake);
+        atomic_store(&ring->consumerWaiting, 1);
+        if (!atomic_load(&ring->closed) && head == atomic_load(&ring->tail)) {
+            futexWait(&ring->consumerWake, wake);
+        }
+        atomic_store(&ring->consumerWaiting, 0);
+    }
+}
+
+void spscRingRelease(SpscRing *ring)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store(&ring->head, head + 1);
+    wakeIfWaiting(&ring->producerWaiting, &ring->producerWake);
+}
+
+void spscRingClose(SpscRing *ring)
+{
+    if (atomic_exchange(&ring->closed, 1)) {
+        return;
+    }
+    wakeUp(&ring->producerWake);
+    wakeUp(&ring->consumerWake);
+}
@@ -0,0 +1,349 @@
+// Staged transmit pipeline implementation
+
+#include "tx_pipeline.h"
+#include "packet.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Fault the pages of a mapped block in, so the encoder never waits for the disk
+static void prefetchBlock(const unsigned char *data, int length)
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    uintptr_t pageStart = (uintptr_t) data & ~(uintptr_t) (pageSize - 1);
+    madvise((void *) pageStart, (uintptr_t) data + length - pageStart, MADV_WILLNEED);
+
+    for (int i = 0; i < length; i += pageSize) {
+        (void) *(volatile const unsigned char *) (data + i);
+    }
+}
+
+static void *readerThread(void *arg)
+{
+    TxPipeline *pipeline = arg;
+    FileReader *reader = pipeline->reader;
+
+    // A resumed transfer still needs the digest of what was sent before.
+    // It is hashed from the mapping, which only reads pages not cached yet;
+    // a file that could not be mapped is read again from its start.
+    uint64_t start = reader->offset;
+    if (start > 0 && fileReaderSeek(reader, 0) == 0) {
+        while (reader->offset < start) {
+            int maxBytes = start - reader->offset > TX_BLOCK_SIZE ? TX_BLOCK_SIZE : start - reader->offset;
+            int length;
+            const unsigned char *data = fileReaderNext(reader, maxBytes, &length);
+            if (data == NULL) {
+                pipeline->error = TRUE;
+                spscRingClose(&pipeline->blockRing);
+                return NULL;
+            }
+            digestUpdate(&pipeline->digest, data, length);
+        }
+    }
+
+    int index;
+    while (reader->offset < reader->size && (index = spscRingAcquire(&pipeline->blockRing)) >= 0) {
+        TxBlock *block = &pipeline->blocks[index];
+
+        if (reader->map != NULL) {
+            block->data = fileReaderNext(reader, TX_BLOCK_SIZE, &block->length);
+            if (block->data == NULL) {
+                pipeline->error = TRUE;
+                break;
+            }
+            prefetchBlock(block->data, block->length);
+        }
+        else {
+            block->length = fileReaderRead(reader, block->buffer, TX_BLOCK_SIZE);
+            block->data = block->buffer;
+            if (block->length <= 0) {
+                pipeline->error = TRUE;
+                break;
+            }
+        }
+
+        digestUpdate(&pipeline->digest, block->data, block->length);
+        spscRingPublish(&pipeline->blockRing);
+    }
+
+    spscRingClose(&pipeline->blockRing);
+    return NULL;
+}
+
+// Encode a packet into the next free frame.
+// Returns 0 on success or -1 if the link thread gave up.
+static int emitPacket(TxPipeline *pipeline, const struct iovec *segments, int numSegments)
+{
+    int frameIndex = spscRingAcquire(&pipeline->frameRing);
+    if (frameIndex < 0) {
+        return -1;
+    }
+
+    TxFrame *frame = &pipeline->frames[frameIndex];
+    frame->size = llencode(segments, numSegments, frame->data);
+    spscRingPublish(&pipeline->frameRing);
+    return 0;
+}
+
+// Send length bytes in data packets of up to packetSize bytes.
+// Returns 0 on success or -1 if the link thread gave up.
+static int emitData(TxPipeline *pipeline, int *packetNum, const unsigned char *data, uint64_t length)
+{
+    for (uint64_t offset = 0; offset < length; offset += pipeline->packetSize) {
+        uint64_t remaining = length - offset;
+        int bytesToSend = remaining > (uint64_t) pipeline->packetSize ? pipeline->packetSize : (int) remaining;
+        unsigned char header[DATA_PACKET_HEADER_SIZE];
+        getDataPacketHeader(*packetNum, bytesToSend, header);
+        struct iovec dataPacket[2] = {
+            {header, sizeof(header)},
+            {(void *) (data + offset), bytesToSend},
+        };
+
+        if (emitPacket(pipeline, dataPacket, 2) < 0) {
+            return -1;
+        }
+        *packetNum = (*packetNum + 1) % 100;
+        pipeline->literalBytes += bytesToSend;
+    }
+    return 0;
+}
+
+static int emitCopy(TxPipeline *pipeline, int *packetNum, uint32_t block, uint32_t count)
+{
+    unsigned char packet[COPY_PACKET_SIZE];
+    getCopyPacket(*packetNum, block, count, packet);
+    struct iovec copyPacket = {packet, sizeof(packet)};
+
+    if (emitPacket(pipeline, &copyPacket, 1) < 0) {
+        return -1;
+    }
+    *packetNum = (*packetNum + 1) % 100;
+    pipeline->copiedBytes += (uint64_t) count * pipeline->delta->blockSize;
+    return 0;
+}
+
+static void encodeBlocks(TxPipeline *pipeline)
+{
+    int packetNum = 0;
+
+    int blockIndex;
+    while ((blockIndex = spscRingPeek(&pipeline->blockRing)) >= 0) {
+        TxBlock *block = &pipeline->blocks[blockIndex];
+        if (emitData(pipeline, &packetNum, block->data, block->length) < 0) {
+            return;
+        }
+        spscRingRelease(&pipeline->blockRing);
+    }
+}
+
+// Wait until the reader thread has prefetched the mapping up to end.
+// Returns the end of the prefetched part, or -1 after a read error.
+static int64_t waitPrefetched(TxPipeline *pipeline, uint64_t available, uint64_t end)
+{
+    while (available < end) {
+        int blockIndex = spscRingPeek(&pipeline->blockRing);
+        if (blockIndex < 0) {
+            return -1;
+        }
+        TxBlock *block = &pipeline->blocks[blockIndex];
+        available = block->data - pipeline->reader->map + block->length;
+        spscRingRelease(&pipeline->blockRing);
+    }
+    return available;
+}
+
+static void encodeRanges(TxPipeline *pipeline)
+{
+    const unsigned char *map = pipeline->reader->map;
+    int64_t available = 0;
+    int packetNum = 0;
+
+    for (int i = 0; i < pipeline->numRanges; i++) {
+        const TxRange *range = &pipeline->ranges[i];
+        available = waitPrefetched(pipeline, available, range->offset + range->length);
+        if (available < 0 || emitData(pipeline, &packetNum, map + range->offset, range->length) < 0) {
+            return;
+        }
+    }
+
+    // Let the reader thread finish the digest
+    waitPrefetched(pipeline, available, pipeline->reader->size);
+}
+
+// Slide a block-sized window over the mapped file with a rolling checksum.
+// Matching blocks become copy packets (runs of consecutive blocks are merged),
+// the bytes in between data packets. The block ring only tells how far the
+// reader thread has prefetched the mapping.
+static void encodeDelta(TxPipeline *pipeline)
+{
+    const DeltaIndex *delta = pipeline->delta;
+    const unsigned char *map = pipeline->reader->map;
+    uint64_t size = pipeline->reader->size;
+    int blockSize = delta->blockSize;
+
+    int64_t available = 0;   // Bytes prefetched so far
+    uint64_t position = 0;   // Start of the window
+    uint64_t literal = 0;    // Start of the bytes not sent yet
+    uint32_t weak = 0;
+    int rolling = FALSE;
+    uint32_t copyBlock = 0, copyCount = 0;
+    int packetNum = 0;
+
+    while (TRUE) {
+        available = waitPrefetched(pipeline, available, position + blockSize < size ? position + blockSize : size);
+        if (available < 0) {
+            return;
+        }
+        if (position + blockSize > size) {
+            break;
+        }
+
+        if (!rolling) {
+            weak = deltaWeak(map + position, blockSize);
+            rolling = TRUE;
+        }
+
+        int64_t match = deltaIndexFind(delta, weak, map + position);
+        if (match >= 0) {
+            if (copyCount > 0 && match != copyBlock + copyCount) {
+                if (emitCopy(pipeline, &packetNum, copyBlock, copyCount) < 0) {
+                    return;
+                }
+                copyCount = 0;
+            }
+            if (literal < position) {
+                if (emitData(pipeline, &packetNum, map + literal, position - literal) < 0) {
+                    return;
+                }
+            }
+            if (copyCount == 0) {
+                copyBlock = match;
+            }
+            copyCount++;
+
+            position += blockSize;
+            literal = position;
+            rolling = FALSE;
+            continue;
+        }
+
+        if (copyCount > 0) {
+            if (emitCopy(pipeline, &packetNum, copyBlock, copyCount) < 0) {
+                return;
+            }
+            copyCount = 0;
+        }
+        if (position + 1 - literal == (uint64_t) pipeline->packetSize) {
+            if (emitData(pipeline, &packetNum, map + literal, pipeline->packetSize) < 0) {
+                return;
+            }
+            literal += pipeline->packetSize;
+        }
+
+        if (position + blockSize < size) {
+            weak = deltaRoll(weak, map[position], map[position + blockSize], blockSize);
+        }
+        position++;
+    }
+
+    if (copyCount > 0 && emitCopy(pipeline, &packetNum, copyBlock, copyCount) < 0) {
+        return;
+    }
+    emitData(pipeline, &packetNum, map + literal, size - literal);
+}
+
+static void *encoderThread(void *arg)
+{
+    TxPipeline *pipeline = arg;
+
+    if (pipeline->delta != NULL) {
+        encodeDelta(pipeline);
+    }
+    else if (pipeline->ranges != NULL) {
+        encodeRanges(pipeline);
+    }
+    else {
+        encodeBlocks(pipeline);
+    }
+
+    // Unblock the reader thread if we stopped early
+    spscRingClose(&pipeline->blockRing);
+    spscRingClose(&pipeline->frameRing);
+    return NULL;
+}
+
+int txPipelineStart(TxPipeline *pipeline, FileReader *reader, int packetSize, const DeltaIndex *delta,
+                    const TxRange *ranges, int numRanges)
+{
+    pipeline->reader = reader;
+    pipeline->packetSize = packetSize;
+    pipeline->delta = delta;
+    pipeline->ranges = ranges;
+    pipeline->numRanges = numRanges;
+    pipeline->literalBytes = 0;
+    pipeline->copiedBytes = 0;
+    pipeline->current = -1;
+    pipeline->error = FALSE;
+    digestInit(&pipeline->digest);
+
+    pipeline->blocks = malloc(TX_BLOCK_SLOTS * sizeof(TxBlock));
+    pipeline->frames = malloc(TX_FRAME_SLOTS * sizeof(TxFrame));
+    if (pipeline->blocks == NULL || pipeline->frames == NULL) {
+        free(pipeline->blocks);
+        free(pipeline->frames);
+        return -1;
+    }
+
+    if (spscRingInit(&pipeline->blockRing, TX_BLOCK_SLOTS) < 0 ||
+        spscRingInit(&pipeline->frameRing, TX_FRAME_SLOTS) < 0) {
+        free(pipeline->blocks);
+        free(pipeline->frames);
+        return -1;
+    }
+
+    if (pthread_create(&pipeline->readerThread, NULL, readerThread, pipeline) != 0) {
+        spscRingDestroy(&pipeline->blockRing);
+        spscRingDestroy(&pipeline->frameRing);
+        free(pipeline->blocks);
+        free(pipeline->frames);
+        return -1;
+    }
+    if (pthread_create(&pipeline->encoderThread, NULL, encoderThread, pipeline) != 0) {
+        spscRingClose(&pipeline->blockRing);
+        pthread_join(pipeline->readerThread, NULL);
+        spscRingDestroy(&pipeline->blockRing);
+        spscRingDestroy(&pipeline->frameRing);
+        free(pipeline->blocks);
+        free(pipeline->frames);
+        return -1;
+    }
+    return 0;
+}
+
+TxFrame *txPipelineNext(TxPipeline *pipeline)
+{
+    if (pipeline->current >= 0) {
+        spscRingRelease(&pipeline->frameRing);
+    }
+
+    pipeline->current = spscRingPeek(&pipeline->frameRing);
+    if (pipeline->current < 0) {
+        return NULL;
+    }
+    return &pipeline->frames[pipeline->current];
+}
+
+void txPipelineStop(TxPipeline *pipeline)
+{
+    spscRingClose(&pipeline->frameRing);
+    pthread_join(pipeline->encoderThread, NULL);
+    pthread_join(pipeline->readerThread, NULL);
+
+    spscRingDestroy(&pipeline->blockRing);
+    spscRingDestroy(&pipeline->frameRing);
+    free(pipeline->blocks);
+    free(pipeline->frames);
+}
@@ -0,0 +1,257 @@
+// Opens, closes and opens again a link session in the same process, sending
+// through the asynchronous API each time, then runs both ends as coroutines
+// awaiting async_send / async_receive, the receiver waiting for the
+// transmitter to reconnect in between. The two ends run on a pair of
+// pseudo-terminals joined by a relay thread, the receiver in a child process.
+
+#include "link_session.hpp"
+
+#include <array>
+#include <atomic>
+#include <coroutine>
+#include <csignal>
+#include <cstdio>
+#include <exception>
+#include <poll.h>
+#include <pty.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+constexpr int rounds = 2;
+constexpr int baudRate = 115200;
+constexpr std::size_t packetSize = 64;
+constexpr int coroutinePackets = 3;  // Per transmitter session
+
+// Copy what each master side reads to the other one, like a null-modem cable
+void relay(int a, int b, const std::atomic<bool> &stop) {
+    // The link layer's retransmission alarm belongs to the main thread
+    sigset_t alarm;
+    sigemptyset(&alarm);
+    sigaddset(&alarm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm, nullptr);
+
+    pollfd fds[2] = {{a, POLLIN, 0}, {b, POLLIN, 0}};
+    unsigned char buffer[4096];
+    while (!stop) {
+        if (poll(fds, 2, 100) <= 0) {
+            continue;
+        }
+        for (int i = 0; i < 2; i++) {
+            if ((fds[i].revents & POLLIN) == 0) {
+                continue;
+            }
+            ssize_t bytes = read(fds[i].fd, buffer, sizeof(buffer));
+            for (ssize_t written = 0; written < bytes;) {
+                ssize_t result = write(fds[1 - i].fd, buffer + written, bytes - written);
+                if (result <= 0) {
+                    break;
+                }
+                written += result;
+            }
+        }
+    }
+}
+
+// Coroutine started right away, holding what it returned once done
+class Task {
+public:
+    struct promise_type {
+        bool ok = false;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(bool value) { ok = value; }
+        void unhandled_exception() { ok = false; }
+    };
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() { handle_.destroy(); }
+
+    bool done() const { return handle_.done(); }
+    bool ok() const { return handle_.promise().ok; }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// Poll the session until the coroutine is done.
+template <typename Session>
+bool drive(Session &session, const Task &task) {
+    while (!task.done()) {
+        session.poll(-1);
+    }
+    return task.ok();
+}
+
+// Send coroutinePackets packets filled with first, first + 1, ..., then close
+// the session from the coroutine, which poll() resumed.
+Task sendPackets(rcom::TransmitterSession &session, int first) {
+    std::array<std::byte, packetSize> packet;
+    for (int i = 0; i < coroutinePackets; i++) {
+        packet.fill(std::byte(first + i));
+        std::size_t sent = co_await session.async_send(packet);
+        if (sent != packetSize) {
+            std::printf("coroutine packet %d not acknowledged\n", first + i);
+            co_return false;
+        }
+    }
+    co_return session.close();
+}
+
+// Receive the packets of two transmitter sessions, waiting for the
+// transmitter to reconnect after the first one.
+Task receivePackets(rcom::ReceiverSession &session) {
+    std::array<std::byte, rcom::ReceiverSession::maxPayload> buffer;
+    for (int connection = 0; connection < 2; connection++) {
+        for (int i = 0; i < coroutinePackets; i++) {
+            std::size_t size = co_await session.async_receive(buffer);
+            if (size != packetSize || buffer[0] != std::byte(connection * coroutinePackets + i)) {
+                std::printf("coroutine packet %d: wrong packet received\n", connection * coroutinePackets + i);
+                co_return false;
+            }
+        }
+        if (co_await session.async_receive(buffer) != 0) {
+            std::printf("coroutine: no disconnection after the packets\n");
+            co_return false;
+        }
+        if (connection == 0) {
+            session.wait_reconnect();
+        }
+    }
+    co_return session.close();
+}
+
+// Receive one packet per session, filled with the round number, then the
+// packets of the coroutines.
+int runReceiver(const char *port) {
+    std::array<std::byte, rcom::ReceiverSession::maxPayload> buffer;
+    try {
+        for (int round = 0; round < rounds; round++) {
+            rcom::ReceiverSession session(port, baudRate, 3, 1);
+            std::size_t size = session.receive_into(buffer);
+            if (size != packetSize || buffer[0] != std::byte(round)) {
+                std::printf("round %d: wrong packet received\n", round);
+                return 1;
+            }
+            if (!session.close()) {
+                return 1;
+            }
+        }
+
+        rcom::ReceiverSession session(port, baudRate, 3, 1);
+        Task task = receivePackets(session);
+        if (!drive(session, task)) {
+            return 1;
+        }
+    }
+    catch (const std::exception &error) {
+        std::printf("receiver: %s\n", error.what());
+        return 1;
+    }
+    return 0;
+}
+
+struct Send {
+    bool done = false;
+    int result = -1;
+};
+
+bool runTransmitter(const char *port) {
+    try {
+        for (int round = 0; round < rounds; round++) {
+            rcom::TransmitterSession session(port, baudRate, 3, 1);
+            std::array<unsigned char, packetSize> packet;
+            packet.fill(round);
+
+            // Each session sets up the asynchronous state again
+            Send send;
+            auto callback = [](void *context, int result) {
+                auto *request = static_cast<Send *>(context);
+                request->done = true;
+                request->result = result;
+            };
+            if (llwrite_async(packet.data(), packet.size(), callback, &send) < 0) {
+                std::printf("round %d: cannot queue the packet\n", round);
+                return false;
+            }
+            while (!send.done) {
+                session.poll(-1);
+            }
+            if (send.result != static_cast<int>(packetSize)) {
+                std::printf("round %d: packet not acknowledged\n", round);
+                return false;
+            }
+            if (!session.close()) {
+                std::printf("round %d: no answer to DISC\n", round);
+                return false;
+            }
+        }
+
+        // Two sessions, which the receiver sees as one with a reconnection
+        for (int connection = 0; connection < 2; connection++) {
+            rcom::TransmitterSession session(port, baudRate, 3, 1);
+            Task task = sendPackets(session, connection * coroutinePackets);
+            if (!drive(session, task)) {
+                std::printf("coroutine session %d failed\n", connection);
+                return false;
+            }
+        }
+    }
+    catch (const std::exception &error) {
+        std::printf("transmitter: %s\n", error.what());
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main() {
+    int txMaster, txSlave, rxMaster, rxSlave;
+    char txPort[128], rxPort[128];
+    if (openpty(&txMaster, &txSlave, txPort, nullptr, nullptr) < 0
+        || openpty(&rxMaster, &rxSlave, rxPort, nullptr, nullptr) < 0) {
+        std::perror("openpty");
+        return 1;
+    }
+
+    std::fflush(stdout);
+    pid_t receiver = fork();
+    if (receiver < 0) {
+        std::perror("fork");
+        return 1;
+    }
+    if (receiver == 0) {
+        _exit(runReceiver(rxPort));
+    }
+
+    std::atomic<bool> stop{false};
+    std::thread relayThread(relay, txMaster, rxMaster, std::cref(stop));
+    bool ok = runTransmitter(txPort);
+
+    // The receiver waits for the transmitter forever, stop it if it is stuck
+    int status = 0;
+    pid_t exited = 0;
+    for (int i = 0; i < 50 && (exited = waitpid(receiver, &status, WNOHANG)) == 0; i++) {
+        usleep(100000);
+    }
+    if (exited == 0) {
+        kill(receiver, SIGKILL);
+        waitpid(receiver, &status, 0);
+        ok = false;
+    }
+    else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        ok = false;
+    }
+
+    stop = true;
+    relayThread.join();
+    std::printf("Link session test: %s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,310 @@
+// Capture replay tool.
+// Feeds the bytes of one direction of a cable capture (see "capture" in the
+// cable program) through the link-layer frame parser and the application
+// packet decoder, as fast as possible. Reports the parser speed and the
+// frames and decisions the receiver would make, with a digest of them to
+// check that a changed parser behaves identically on real traffic.
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "digest.h"
+#include "frame.h"
+#include "packet.h"
+
+#define FALSE 0
+#define TRUE 1
+
+#define BLOCK_SHB 0x0A0D0D0A
+#define BLOCK_EPB 6
+#define BYTE_ORDER_MAGIC 0x1A2B3C4D
+
+// Receiver decisions on a frame
+typedef enum
+{
+    DEC_ACCEPT,     // New I-frame: RR, payload handed to the application
+    DEC_DUPLICATE,  // I-frame already received: RR again
+    DEC_REJECT,     // BCC2 mismatch: REJ
+    DEC_SET,        // Connection (re)established: sequence numbers reset
+    DEC_SUPERVISION,
+    DEC_NUM_DECISIONS
+} Decision;
+
+static const char *decisionNames[DEC_NUM_DECISIONS] = {
+    "ACCEPT", "DUPLICATE", "REJ", "SET", "SUPERVISION"
+};
+
+static const char *packetNames[] = {
+    [PACKET_START] = "START", [PACKET_DATA] = "DATA", [PACKET_END] = "END",
+    [PACKET_ACCEPT] = "ACCEPT", [PACKET_GET] = "GET", [PACKET_LIST] = "LIST",
+    [PACKET_BYE] = "BYE", [PACKET_ERROR] = "ERROR", [PACKET_SIGNATURE] = "SIGNATURE",
+    [PACKET_COPY] = "COPY", [PACKET_MANIFEST] = "MANIFEST", [PACKET_NEEDED] = "NEEDED",
+};
+
+#define NUM_PACKET_TYPES (sizeof(packetNames) / sizeof(packetNames[0]))
+
+typedef struct
+{
+    unsigned long long frames;
+    unsigned long long decisions[DEC_NUM_DECISIONS];
+    unsigned long long packets[NUM_PACKET_TYPES + 1];  // Last entry: unknown types
+    unsigned long long dataBytes;
+    Digest digest;  // Of every frame and decision, in order
+} ReplayResult;
+
+// Read the bytes captured on one interface, in order.
+// Returns a buffer to be freed by the caller (size in *length), or NULL on error.
+unsigned char *loadCapture(const char *filename, uint32_t interface, size_t *length)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        perror(filename);
+        return NULL;
+    }
+
+    unsigned char *bytes = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+    unsigned char *block = NULL;
+    uint32_t header[2];
+
+    while (fread(header, sizeof(header), 1, file) == 1) {
+        uint32_t type = header[0];
+        uint32_t total = header[1];
+        if (total < 12 || total % 4 != 0) {
+            fprintf(stderr, "%s: malformed block\n", filename);
+            goto error;
+        }
+        unsigned char *body = realloc(block, total - 8);
+        if (body == NULL) {
+            goto error;
+        }
+        block = body;
+        if (fread(block, total - 8, 1, file) != 1) {
+            fprintf(stderr, "%s: truncated block\n", filename);
+            goto error;
+        }
+
+        if (type == BLOCK_SHB) {
+            uint32_t magic;
+            memcpy(&magic, block, 4);
+            if (magic != BYTE_ORDER_MAGIC) {
+                fprintf(stderr, "%s: captured on a host of a different byte order\n", filename);
+                goto error;
+            }
+        }
+        else if (type == BLOCK_EPB) {
+            // Interface, timestamp (2 words), captured and original length
+            uint32_t epb[5];
+            memcpy(epb, block, sizeof(epb));
+            if (epb[0] != interface) {
+                continue;
+            }
+            if (epb[3] > total - 8 - sizeof(epb)) {
+                fprintf(stderr, "%s: malformed packet\n", filename);
+                goto error;
+            }
+            if (size + epb[3] > capacity) {
+                capacity = capacity == 0 ? 65536 : capacity;
+                while (size + epb[3] > capacity) {
+                    capacity *= 2;
+                }
+                unsigned char *grown = realloc(bytes, capacity);
+                if (grown == NULL) {
+                    goto error;
+                }
+                bytes = grown;
+            }
+            memcpy(bytes + size, block + sizeof(epb), epb[3]);
+            size += epb[3];
+        }
+    }
+
+    free(block);
+    fclose(file);
+    *length = size;
+    return bytes != NULL ? bytes : malloc(1);
+
+error:
+    free(block);
+    free(bytes);
+    fclose(file);
+    return NULL;
+}
+
+// Decode the application packet carried by an accepted I-frame
+void decodePacket(const unsigned char *packet, int size, ReplayResult *result, int verbose)
+{
+    unsigned char type = packet[0];
+    int known = type < NUM_PACKET_TYPES && packetNames[type] != NULL;
+    result->packets[known ? type : NUM_PACKET_TYPES]++;
+
+    if (type == PACKET_DATA && size >= DATA_PACKET_HEADER_SIZE) {
+        result->dataBytes += size - DATA_PACKET_HEADER_SIZE;
+    }
+    if (!verbose) {
+        return;
+    }
+
+    printf("  %s", known ? packetNames[type] : "UNKNOWN");
+    uint64_t fileLength;
+    char *filename;
+    if ((type == PACKET_START || type == PACKET_END) && parseControlPacket(packet, size, &fileLength, &filename) == 0) {
+        printf(" %s (%llu bytes)", filename, (unsigned long long) fileLength);
+        free(filename);
+    }
+    else if (type == PACKET_DATA && size >= DATA_PACKET_HEADER_SIZE) {
+        printf(" #%u, %d bytes", packet[1], size - DATA_PACKET_HEADER_SIZE);
+    }
+}
+
+// Run the parser over the whole stream, making the receiver's decisions
+void replay(const unsigned char *bytes, size_t length, ReplayResult *result, int verbose)
+{
+    static unsigned char payload[MAX_PAYLOAD_SIZE + 1];
+    FrameParser parser;
+    Frame frame;
+    int expected = 0;  // Sequence number of the next new I-frame
+    size_t position = 0;
+
+    frameParserInit(&parser, payload, sizeof(payload));
+    memset(result, 0, sizeof(*result));
+    digestInit(&result->digest);
+
+    while (position < length) {
+        int chunk = length - position < 65536 ? length - position : 65536;
+        int consumed;
+        int complete = frameParserFeed(&parser, bytes + position, chunk, &consumed, &frame);
+        position += consumed;
+        if (!complete) {
+            continue;
+        }
+
+        Decision decision;
+        int isInformation = frame.length > 0 && (frame.control == RR_0 || frame.control == RR_1);
+        if (isInformation) {
+            int sequence = frame.control == RR_1 ? 1 : 0;
+            if (sequence != expected) {
+                decision = DEC_DUPLICATE;
+            }
+            else if (!frame.bcc2Ok) {
+                decision = DEC_REJECT;
+            }
+            else {
+                decision = DEC_ACCEPT;
+                expected ^= 1;
+            }
+        }
+        else if (frame.control == CONTROL_SET && frame.length == 0) {
+            decision = DEC_SET;
+            expected = 0;
+        }
+        else {
+            decision = DEC_SUPERVISION;
+        }
+
+        result->frames++;
+        result->decisions[decision]++;
+        unsigned char record[4] = { frame.address, frame.control, decision, frame.bcc2Ok };
+        digestUpdate(&result->digest, record, sizeof(record));
+        digestUpdate(&result->digest, &frame.length, sizeof(frame.length));
+
+        if (verbose) {
+            printf("%10zu: A=0x%02X C=0x%02X %4d bytes %s", position, frame.address, frame.control,
+                   frame.length, decisionNames[decision]);
+        }
+        if (decision == DEC_ACCEPT) {
+            decodePacket(payload, frame.length, result, verbose);
+        }
+        if (verbose) {
+            printf("\n");
+        }
+    }
+}
+
+void usage(const char *program)
+{
+    printf("Usage: %s [-i interface] [-n repetitions] [-v] capture.pcapng\n"
+           "  -i : 0 replays the bytes received by the receiver (Tx->Rx, default),\n"
+           "       1 those received by the transmitter (Rx->Tx); 2n and 2n + 1 for\n"
+           "       link n of a cable hosting several links\n"
+           "  -n : times to run the parser over the capture for timing (default 10)\n"
+           "  -v : print every frame, the decision on it and the packet it carries\n",
+           program);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t interface = 0;
+    int repetitions = 10;
+    int verbose = FALSE;
+    int option;
+
+    while ((option = getopt(argc, argv, "i:n:vh")) != -1) {
+        switch (option) {
+        case 'i':
+            interface = atoi(optarg);
+            break;
+        case 'n':
+            repetitions = atoi(optarg);
+            break;
+        case 'v':
+            verbose = TRUE;
+            break;
+        default:
+            usage(argv[0]);
+            exit(option == 'h' ? 0 : 1);
+        }
+    }
+    if (optind != argc - 1 || repetitions < 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    size_t length;
+    unsigned char *bytes = loadCapture(argv[optind], interface, &length);
+    if (bytes == NULL) {
+        exit(1);
+    }
+
+    // The first run gives the results (and the listing); the timed runs
+    // repeat it without printing
+    ReplayResult result;
+    replay(bytes, length, &result, verbose);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < repetitions; i++) {
+        ReplayResult timed;
+        replay(bytes, length, &timed, FALSE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("Replayed %zu bytes from interface %u, %d times in %.3f s\n", length, interface, repetitions, elapsed);
+    if (length > 0 && elapsed > 0) {
+        printf("Speed: %.0f frames/s, %.2f ns/byte, %.1f MB/s\n",
+               result.frames * repetitions / elapsed, elapsed * 1e9 / ((double) length * repetitions),
+               length * repetitions / elapsed / 1e6);
+    }
+
+    printf("Frames: %llu", result.frames);
+    for (int d = 0; d < DEC_NUM_DECISIONS; d++) {
+        printf(", %s %llu", decisionNames[d], result.decisions[d]);
+    }
+    printf("\nPackets:");
+    for (size_t t = 0; t <= NUM_PACKET_TYPES; t++) {
+        if (result.packets[t] > 0) {
+            printf(" %s %llu", t < NUM_PACKET_TYPES ? packetNames[t] : "UNKNOWN", result.packets[t]);
+        }
+    }
+    printf("\nData bytes: %llu\n", result.dataBytes);
+    printf("Decision digest: %016llx\n", (unsigned long long) digestValue(&result.digest));
+
+    free(bytes);
+    return 0;
+}